@@ -0,0 +1,336 @@
+//////////////////////////////////////////////////////////////////////
+// bench.cpp -- Assembler and decompiler throughput benchmarks
+///////////////////////////////////////////////////////////////////////
+//
+// Generates a random corpus of valid waveform sources and WaveData
+// C files from a fixed seed, then times in process:
+//
+//	parse		Lexer and parse() of every source
+//	encode		parse() plus encode() of each section
+//	assemble	Assembler::assemble() with listing and C code
+//	decompile_c	decompile(path) of each WaveData C file
+//	decompile_wave	decompile() of each unpacked 32-byte waveform
+//
+// Each benchmark is run several times and the median time reported,
+// one JSON object per line, so that runs can be compared by tools:
+//
+//	$ ./ezbench [-n sources] [-c cfiles] [-r repeats] [-s seed]
+//
+// The corpus line gives the compiler and the flags that libezusbcc.a
+// was built with (EZBENCH_BUILD, from the Makefile), since reports
+// are only comparable between builds that agree on them.
+
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <random>
+#include <functional>
+
+#include "libezusbcc.hpp"
+
+#ifndef EZBENCH_BUILD
+#define EZBENCH_BUILD	"unknown"
+#endif
+
+using namespace ezusbcc;
+
+//////////////////////////////////////////////////////////////////////
+// An ostream that formats everything and keeps nothing
+//////////////////////////////////////////////////////////////////////
+
+class NullBuf : public std::streambuf {
+protected:
+	int overflow(int c) override {
+		return c == EOF ? 0 : c;
+	}
+	std::streamsize xsputn(const char *,std::streamsize n) override {
+		return n;
+	}
+};
+
+struct s_corpus {
+	std::vector<std::string> sources;	// Assembler source text
+	std::vector<std::string> cpaths;	// WaveData C files
+	unsigned long	lines = 0;		// Source lines
+	unsigned long	waveforms = 0;		// Source sections
+};
+
+//////////////////////////////////////////////////////////////////////
+// Generate one source of 1 to 4 sections, each with its own random
+// environment and 1 to 7 valid states.
+//////////////////////////////////////////////////////////////////////
+
+static std::string
+gen_source(std::mt19937& rng,s_corpus& corpus) {
+	static const char *flags[] = { "PF", "EF", "FF" };
+	std::ostringstream src;
+	unsigned nsections = rng() % 4 + 1;
+
+	auto pick = [&](const std::map<std::string,unsigned,std::less<>>& m) {
+		auto it = m.begin();
+
+		std::advance(it,rng() % m.size());
+		return it->first;
+	};
+
+	src << "; Generated source\n";
+	++corpus.lines;
+	for ( unsigned wx=0; wx < nsections; ++wx ) {
+		unsigned trictl = rng() % 2, cfg5 = rng() % 2, cfg7 = rng() % 2, flgsel = rng() % 3;
+		unsigned nstates = rng() % 7 + 1;
+		const auto& opermap = opertab.at(cfg5).at(flgsel).at(cfg7);
+		const auto& oemap = oetab.at(trictl);
+
+		src << "\t.WAVEFORM\t" << wx << "\t\t; Section " << wx << '\n'
+			<< "\t.TRICTL\t\t" << trictl << '\n'
+			<< "\t.GPIFREADYCFG5\t" << cfg5 << '\n'
+			<< "\t.GPIFREADYCFG7\t" << cfg7 << '\n'
+			<< "\t.EPXGPIFFLGSEL\t" << flags[flgsel] << '\n';
+		corpus.lines += 5;
+
+		for ( unsigned sx=0; sx < nstates; ++sx ) {
+			bool dp = rng() % 5 < 2;
+			std::string opc = dp ? "J" : "";
+
+			for ( const char *c = "S+GDN"; *c; ++c )
+				if ( rng() % 3 == 0 )
+					opc += *c;
+			if ( dp && rng() % 4 == 0 )
+				opc += '*';
+			if ( opc.empty() )
+				opc = "Z";
+
+			src << '\t' << opc << '\t';
+			if ( dp ) {
+				static const char *funcs[] = { "AND", "OR", "XOR", "/AND" };
+
+				src << pick(opermap) << ' ' << funcs[rng() % 4] << ' ' << pick(opermap) << ' ';
+			} else	{
+				src << rng() % 256 + 1 << ' ';
+			}
+			for ( unsigned ox = rng() % 4; ox > 0; --ox )
+				src << pick(oemap) << ' ';
+			if ( dp ) {
+				for ( unsigned tx=0; tx<2; ++tx ) {
+					unsigned target = rng() % (nstates + 2);
+
+					src << '$' << (target > nstates ? 7 : target) << ' ';
+				}
+			}
+			if ( rng() % 2 )
+				src << "\t; State " << sx;
+			src << '\n';
+			++corpus.lines;
+		}
+		++corpus.waveforms;
+	}
+	return src.str();
+}
+
+//////////////////////////////////////////////////////////////////////
+// Write a gpif.c style file holding a random WaveData[128]
+//////////////////////////////////////////////////////////////////////
+
+static void
+gen_cfile(std::mt19937& rng,const std::string& path) {
+	static const char *rows[] = { "/* LenBr */", "/* Opcode*/", "/* Output*/", "/* LFun  */" };
+	std::ofstream c(path);
+	char hex[8];
+
+	c << "// Generated\n#include \"fx2.h\"\n\nconst char xdata WaveData[128] =\n{\n";
+	for ( unsigned wx=0; wx<4; ++wx ) {
+		c << "// Wave " << wx << '\n';
+		for ( unsigned rx=0; rx<4; ++rx ) {
+			c << rows[rx];
+			for ( unsigned bx=0; bx<8; ++bx ) {
+				snprintf(hex,sizeof hex," 0x%02X,",unsigned(rng() & 0xFF));
+				c << hex;
+			}
+			c << '\n';
+		}
+	}
+	c << "};\n";
+}
+
+//////////////////////////////////////////////////////////////////////
+// Median seconds of repeats runs of fn
+//////////////////////////////////////////////////////////////////////
+
+static double
+timed(unsigned repeats,const std::function<void()>& fn) {
+	std::vector<double> times;
+
+	for ( unsigned rx=0; rx < repeats; ++rx ) {
+		auto t0 = std::chrono::steady_clock::now();
+
+		fn();
+
+		std::chrono::duration<double> secs = std::chrono::steady_clock::now() - t0;
+		times.push_back(secs.count());
+	}
+	std::sort(times.begin(),times.end());
+	return times[times.size() / 2];
+}
+
+static long
+peak_rss_kb() {
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF,&ru);
+	return ru.ru_maxrss;
+}
+
+static void
+report(const char *name,double secs,unsigned long lines,unsigned long waveforms) {
+	printf("{\"benchmark\":\"%s\",\"seconds\":%.6f,\"lines\":%lu,\"waveforms\":%lu,"
+		"\"lines_per_sec\":%.0f,\"waveforms_per_sec\":%.0f,\"peak_rss_kb\":%ld}\n",
+		name,secs,lines,waveforms,
+		secs > 0 ? lines / secs : 0.0,
+		secs > 0 ? waveforms / secs : 0.0,
+		peak_rss_kb());
+	fflush(stdout);
+}
+
+int
+main(int argc,char **argv) {
+	unsigned nsources = 20000, ncfiles = 2000, repeats = 5, seed = 1;
+	char tmpdir[] = "/tmp/ezbenchXXXXXX";
+	s_corpus corpus;
+	int optch;
+
+	while ( (optch = getopt(argc,argv,"n:c:r:s:")) != -1 ) {
+		unsigned value = strtoul(optarg,nullptr,10);
+
+		switch ( optch ) {
+		case 'n':
+			nsources = value;
+			break;
+		case 'c':
+			ncfiles = value;
+			break;
+		case 'r':
+			repeats = value ? value : 1;
+			break;
+		case 's':
+			seed = value;
+			break;
+		default:
+			std::cerr << "Usage: " << argv[0] << " [-n sources] [-c cfiles] [-r repeats] [-s seed]\n";
+			return 1;
+		}
+	}
+
+	if ( !mkdtemp(tmpdir) ) {
+		perror(tmpdir);
+		return 1;
+	}
+
+	std::mt19937 rng(seed);
+
+	for ( unsigned ux=0; ux < nsources; ++ux )
+		corpus.sources.push_back(gen_source(rng,corpus));
+	for ( unsigned ux=0; ux < ncfiles; ++ux ) {
+		corpus.cpaths.push_back(std::string(tmpdir) + "/gpif" + std::to_string(ux) + ".c");
+		gen_cfile(rng,corpus.cpaths.back());
+	}
+
+	printf("{\"corpus\":{\"seed\":%u,\"sources\":%u,\"lines\":%lu,\"waveforms\":%lu,\"cfiles\":%u,\"repeats\":%u,"
+		"\"build\":\"%s\",\"compiler\":\"%s\"}}\n",
+		seed,nsources,corpus.lines,corpus.waveforms,ncfiles,repeats,EZBENCH_BUILD,__VERSION__);
+
+	NullBuf nullbuf;
+	std::ostream null(&nullbuf);
+	Assembler as;
+	unsigned long failures = 0;
+
+	report("parse",timed(repeats,[&]() {
+		for ( auto& text : corpus.sources ) {
+			Lexer lex(text);
+			s_instr instr;
+
+			while ( parse(lex,instr) )
+				;
+		}
+	}),corpus.lines,corpus.waveforms);
+
+	report("encode",timed(repeats,[&]() {
+		for ( auto& text : corpus.sources ) {
+			Lexer lex(text);
+			s_instr instr;
+			std::vector<s_instr> instrs;
+			std::map<unsigned,unsigned> environ = {
+				{ unsigned(PseudoOps::Trictl),		0u },
+				{ unsigned(PseudoOps::GpifReadyCfg5),	0u },
+				{ unsigned(PseudoOps::GpifReadyCfg7),	0u },
+				{ unsigned(PseudoOps::EpxGpifFlgSel),	0u },
+			};
+
+			while ( parse(lex,instr) ) {
+				auto it = pseudotab.find(instr.stropcode);
+
+				if ( it == pseudotab.end() ) {
+					instrs.push_back(instr);
+					continue;
+				}
+				if ( PseudoOps(it->second) == PseudoOps::WaveForm ) {
+					encode(instrs,environ);
+					instrs.clear();
+				} else if ( PseudoOps(it->second) == PseudoOps::EpxGpifFlgSel ) {
+					environ[it->second] = flgsel.find(instr.stroperands[0])->second;
+				} else	{
+					environ[it->second] = instr.stroperands[0][0] - '0';
+				}
+			}
+			encode(instrs,environ);
+		}
+	}),corpus.lines,corpus.waveforms);
+
+	report("assemble",timed(repeats,[&]() {
+		for ( auto& text : corpus.sources ) {
+			std::vector<s_diagnostic> errors;
+
+			if ( !as.assemble(text,null,null,errors) )
+				++failures;
+		}
+	}),corpus.lines,corpus.waveforms);
+
+	report("decompile_c",timed(repeats,[&]() {
+		for ( auto& path : corpus.cpaths ) {
+			std::vector<s_diagnostic> errors;
+
+			if ( !Decompiler().decompile_file(path.c_str(),null,errors) )
+				++failures;
+		}
+	}),ncfiles * 4 * 8ul,ncfiles * 4ul);
+
+	{
+		std::vector<std::array<uint8_t,32>> waves(ncfiles * 4ul);
+
+		for ( auto& wave : waves )
+			for ( auto& byte : wave )
+				byte = rng() & 0xFF;
+
+		report("decompile_wave",timed(repeats,[&]() {
+			unsigned wx = 0;
+
+			for ( auto& wave : waves )
+				decompile(wx++ & 3,wave.data(),null);
+		}),waves.size() * 8ul,waves.size());
+	}
+
+	for ( auto& path : corpus.cpaths )
+		unlink(path.c_str());
+	rmdir(tmpdir);
+
+	if ( failures ) {
+		std::cerr << failures << " corpus items failed to assemble or decompile\n";
+		return 1;
+	}
+	return 0;
+}
+
+// End bench.cpp
@@ -7,6 +7,9 @@
 // accepts the source code from stdin and generates the C code on
 // stdout. Listing and errors are put to stderr.
 //
+// The work is done by libezusbcc (libezusbcc.cpp, API in ezusbcc.hpp),
+// which other programs can link to assemble and decompile in process.
+//
 // SOURCE CODE FORMAT (UPPERCASE ONLY):
 //
 // ; Comments..
@@ -22,7 +25,32 @@
 //	.GPIFREADYCFG7	{ 0 | 1 }		; INTRDY available when 1
 //	.EPXGPIFFLGSEL	{ PF | EF | FF }	; Selected FIFO flag
 //	.EP		{ 2 | 4 | 6 | 8 }	; Default 2
-//	.WAVEFORM	n			; Names output C code array
+//	.WAVEFORM	n			; Names output, or starts section n
+//	.IFCLK		{ 30 | 48 }		; IFCLK MHz, default 48
+//	.WORDWIDE	{ 0 | 1 }		; 16-bit data bus when 1
+//	.ASYNC		{ 0 | 1 }		; RDY sampled asynchronously
+//	.IDLECTL	n			; Idle OEn/CTLn levels, default 0
+//	.FLOWSTATE	{ 0..6 }		; State run by the flow engine
+//	.FLOWLOGIC	A OP B			; Flow logic function
+//	.FLOWEQ0CTL	{ 0 | [OEn] [CTLn] }	; Outputs when FLOWLOGIC is 0
+//	.FLOWEQ1CTL	{ 0 | [OEn] [CTLn] }	; Outputs when FLOWLOGIC is 1
+//	.FLOWHOLDOFF	n			; FLOWHOLDOFF register
+//	.FLOWSTB	n			; FLOWSTB register
+//	.FLOWSTBEDGE	{ NONE | RISING | FALLING | BOTH }
+//	.FLOWSTBHPERIOD	n			; Strobe half period, IFCLKs
+//	.MINPULSE	CTLn ns			; Shortest assertion of CTLn
+//	.SETUP		CTLn ns			; DATA before CTLn rises
+//	.HOLD		CTLn ns			; DATA after CTLn falls
+//	.EPBUF		{ 2 | 3 | 4 }		; .EP buffers, default 2
+//	.AUTOCOMMIT	{ 0 | 1 }		; AUTOIN/AUTOOUT, default 1
+//
+// Each .WAVEFORM after the first starts a new section, so one source
+// can hold waveforms 0 to 3. Pseudo ops before the first .WAVEFORM are
+// the defaults for every section. With more than one section the
+// complete 128-byte WaveData[] is emitted, else waveformN[32].
+// A section with .FLOWSTATE also gets its 9-byte flow state block,
+// in FlowStates[36] (or flowstatesN[9] beside waveformN[32]). Numbers
+// may be given in decimal, or in hex as 0xNN.
 //
 // NDP OPCODES:
 //	[S][+][G][D][N]   	[count=1] [OEn] [CTLn]
@@ -44,6 +72,188 @@
 //	Z	Placeholder when none of the above
 //	*	Re-execute (DP only)
 //
+// TO OPTIMIZE:
+//
+//    $ ./ezusbcc -O <waveform.wvf
+//
+//    merges adjacent NDP states with equal opcode and outputs, turns
+//    unconditional DP jumps to the next state into NDP states, drops
+//    unreachable states and renumbers the branch targets.
+//
+// TO ANALYZE:
+//
+//    $ ./ezusbcc -a <waveform.wvf
+//
+//    walks every path from state 0 to idle state 7 and reports the
+//    best and worst case cycles per transaction when no RDY stalls,
+//    with bytes per transaction on 8 and 16-bit buses and peak MB/s
+//    for .IFCLK and .WORDWIDE. With .ASYNC, 2 synchronizer cycles
+//    are added to the worst case for each DP decision on a RDY pin.
+//
+// TIMING CONSTRAINTS:
+//
+//    .MINPULSE, .SETUP and .HOLD CTLn ns are checked on every path
+//    from state 0 to idle that does not wait, at the .IFCLK period
+//    and after -O. The worst slack of each is listed, and a negative
+//    slack is an error naming the path.
+//
+// TO PLAN TRANSFERS:
+//
+//    $ ./ezusbcc -P 2 <waveform.wvf
+//
+//    predicts the sustained MB/s through .EP with 2 host requests
+//    queued, from the waveform's best case cycles, the .EPBUF
+//    buffering, .AUTOCOMMIT, 512-byte bulk packets at 13 per
+//    microframe and the host queue, and names the limiting stage.
+//
+// TO SIMULATE:
+//
+//    $ ./ezusbcc -S stimulus -n 4 -f 30 <waveform.wvf
+//
+//    runs the encoded states cycle by cycle for 4 transactions and
+//    reports IFCLK cycles per transaction, bytes moved and MB/s at
+//    30 MHz to stderr. The idle state 7 itself is not counted.
+//    Bytes are counted for each DATA sample, or for each NEXT when
+//    the waveform uses NEXT (a FIFO write). The stimulus file sets
+//    the DP inputs, which are all 0 until changed:
+//
+//	; cycle	term=value ...
+//	0	RDY0=1 INTRDY=1
+//	10	RDY0=0
+//
+//    where term is one of RDY0..RDY5 TC PF EF FF INTRDY.
+//
+//    With -V run.vcd the simulated cycles are also written as a
+//    VCD for GTKWave: IFCLK, STATE, the CTL/OE pins, DATA, NEXT,
+//    INCAD, GPIFADR and the inputs, one scope per section.
+//
+// TO SIMULATE THE ENDPOINT FIFO:
+//
+//    $ ./ezusbcc -F 40 -L 256 -n 1000 <waveform.wvf
+//
+//    runs the waveform against its .EPBUF x 512-byte FIFO, with the
+//    host filling it (a write waveform, using NEXT) or draining it
+//    (a read waveform) a packet at a time at 40 MB/s. FIFOFLAG is
+//    driven each cycle with the fill, as PF, EF or FF by
+//    .EPXGPIFFLGSEL, PF being asserted at >= 256 bytes (-L '<256'
+//    for <=, at most the FIFO size, and only with -F). The fill
+//    range, the cycles spent looping on FIFOFLAG, the cycles the host
+//    stalled on the FIFO and the sustained MB/s are reported, with
+//    any underruns or overruns.
+//
+// TO REPLAY A CAPTURE:
+//
+//    $ ./ezusbcc -R capture.vcd <waveform.wvf
+//    $ ./ezusbcc -R capture.csv gpif.c
+//
+//    runs the assembled (or each decompiled) waveform against RDY
+//    and flag inputs captured by a logic analyzer, one sample per
+//    IFCLK cycle, restarting it as soon as it reaches idle. A VCD is
+//    sampled at the rising edges of its IFCLK signal, else once an
+//    IFCLK period; a CSV has a header naming its columns (RDY0..5,
+//    TC, PF, EF, FF, FIFOFLAG, INTRDY, TIME) and a row per cycle.
+//    The capture is streamed, so it may be of any size. Reported are
+//    the transactions, bytes, MB/s, idle cycles waiting on inputs and
+//    the five longest waits, with the time each began.
+//
+// OUTPUT FORMATS:
+//
+//    $ ./ezusbcc -o hex <waveform.wvf >waveform.hex
+//
+//    c	   waveformN[32] or WaveData[128] C code (default)
+//    bin  the raw waveform memory bytes
+//    hex  Intel HEX placed at 0xE400 + 32 * n (0xE400 for WaveData)
+//    regs 3-byte register writes: address high, address low, value
+//    json metrics of each waveform (also --metrics json)
+//
+// TO GATE ON METRICS:
+//
+//    $ ./ezusbcc --compare baseline.json --threshold 5 <waveform.wvf
+//
+//    compares the metrics with a baseline saved by --metrics json,
+//    listing the changed waveforms and states, and exits with 1 when
+//    a waveform's worst case MB/s drops by more than 5%.
+//
+// TO GENERATE GpifInit():
+//
+//    $ ./ezusbcc -I <waveform.wvf
+//
+//    emits WaveData[128], InitData[7] and a GpifInit() setting
+//    IFCONFIG, GPIFREADYCFG, GPIFCTLCFG, GPIFIDLECS, GPIFIDLECTL,
+//    GPIFWFSELECT and EPnGPIFFLGSEL (for each .EP) from the pseudo
+//    ops. With -o regs, the same settings are register writes around
+//    the waveform bytes.
+//
+// TO RELOAD AT RUN TIME:
+//
+//    $ ./ezusbcc -D loaded.wvf <waveform.wvf
+//
+//    emits GpifPatch[] and a GpifReload() that changes the GPIF from
+//    the set of loaded.wvf, as its GpifInit() left it, to the set of
+//    waveform.wvf. Only the waveform and register bytes that differ
+//    are written, in runs copied by the autopointers. The bytes,
+//    runs and estimated 8051 cycles are reported to stderr, against
+//    those of GpifInit(). With -o regs, the patch is register writes.
+//
+// TO SYNTHESIZE:
+//
+//    $ ./ezusbcc -Y spec >waveform.wvf
+//
+//    searches for the waveform with the fewest IFCLK cycles per
+//    transaction that meets a timing spec, and writes it as source:
+//
+//	.PSEUDOOP	<arg>		; Copied to the source
+//	IDLE	[OEn] [CTLn]		; Outputs high at idle
+//	GATE	A [OP B]		; Wait for this before starting
+//	STROBE	CTLn width		; Driven from idle >= width cycles
+//	DRIVE	CTLn setup hold		; Data driven setup cycles before
+//					; CTLn and held hold cycles after
+//	SAMPLE	CTLn setup hold		; Data sampled setup cycles after
+//					; CTLn starts, hold before it ends
+//	NEXT				; NEXT after the data
+//
+// BATCH MODE:
+//
+//    $ ./ezusbcc -B outdir a.wvf b.wvf gpif.c ...
+//
+//    assembles each .wvf to outdir/a.c with its listing in
+//    outdir/a.lst, and decompiles each .c file to outdir/gpif.dis,
+//    using one thread per core. Errors are reported per file, in
+//    the order given, after all files have been processed.
+//
+// COMPILE CACHE:
+//
+//    $ ./ezusbcc -C .ezcache [-M 64] -B outdir *.wvf
+//
+//    keeps each assembly in the cache directory, under a hash of the
+//    parsed tokens, the environment of each section, the options and
+//    the ezusbcc version. A source that is found there has its output
+//    and listing replayed without being encoded again. The least
+//    recently used entries are removed to keep the cache within -M
+//    megabytes. The hits, misses, stores and evictions are reported
+//    on stderr.
+//
+// TO SCAN FIRMWARE:
+//
+//    $ ./ezusbcc -X firmware.ihx build/ ...
+//
+//    finds the waveform tables in firmware images, Intel HEX (.ihx,
+//    .hex) or binary (.bin), searching directories for them, and
+//    decompiles each. A table is 1 to 4 waveforms of 32 bytes whose
+//    states are all legal encodings and reach idle state 7. The files
+//    are scanned on a thread per core and reported in order, each
+//    table as "; 0xADDR: size bytes" and its source.
+//
+// PHASE STATISTICS:
+//
+//    $ ./ezusbcc --stats [--trace trace.json] -B outdir *.wvf
+//
+//    reports on stderr the calls, items, wall time and allocations
+//    of each phase: tokenize, pseudo ops, encode, listing, emit, and
+//    for a decompile the array scan and unpacking. With --trace, the
+//    spans are also written as Chrome trace events. Neither can be
+//    given with -D, -X or -Y.
+//
 // TO DECOMPILE:
 //
 //
@@ -52,6 +262,10 @@
 //
 //    $ ./ezusbcc gpif.c
 //
+//    With -a, the decompile also reports duplicate waveforms (byte
+//    identical, or behaving the same under every RDY input) and the
+//    compacted slots and GPIFWFSELECT for the selected ones.
+//
 // Note that the decompile doesn't figure out the environment
 // that it runs within. As a result, some values will show as
 // RDY5|TC or PF|EF|FF where it can't know. It may also get
@@ -59,980 +273,691 @@
 // from that point on that TRICTL is in effect.
 
 #include <stdio.h>
-#include <stdarg.h>
 #include <stdlib.h>
 #include <unistd.h>
-#include <errno.h>
+#include <getopt.h>
 #include <string.h>
-#include <assert.h>
+#include <strings.h>
+#include <dirent.h>
+#include <sys/stat.h>
 
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <vector>
 #include <string>
-#include <sstream>
 #include <map>
-#include <array>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <algorithm>
+#include <new>
 
-static void uncompile(int argc,char **argv);
+#include "ezusbcc.hpp"
+#include "lexer.hpp"
 
-enum class PseudoOps {
-	Trictl,			// TRICTL
-	GpifReadyCfg5,		// 
-	GpifReadyCfg7,		// 
-	EpxGpifFlgSel,		// PF, EF or FF
-	Ep,			// 2, 4, 6 or 8
-	WaveForm,		// x
-};
-
-static const std::map<std::string,int> pseudotab = {
-	{ ".TRICTL",		int(PseudoOps::Trictl) },
-	{ ".GPIFREADYCFG5",	int(PseudoOps::GpifReadyCfg5) },
-	{ ".GPIFREADYCFG7",	int(PseudoOps::GpifReadyCfg7) },
-	{ ".EPXGPIFFLGSEL",	int(PseudoOps::EpxGpifFlgSel) },
-	{ ".EP",		int(PseudoOps::Ep) },
-	{ ".WAVEFORM",		int(PseudoOps::WaveForm) },
-};
+using namespace ezusbcc;
 
-static const std::map<std::string,int> flgsel = {
-	{ "PF",	0 },
-	{ "EF", 1 },
-	{ "FF", 2 },
-};
+//////////////////////////////////////////////////////////////////////
+// Allocations are counted per thread for --stats
+//////////////////////////////////////////////////////////////////////
 
-static const std::map<unsigned,std::map<std::string,unsigned>> oetab = {
-	{ 0, {			// TRICTL=0
-		{ "CTL5", 5 },
-		{ "CTL4", 4 },
-		{ "CTL3", 3 },
-		{ "CTL2", 2 },
-		{ "CTL1", 1 },
-		{ "CTL0", 0 },
-	  }
-	},
-	{ 1, {			// TRICTL=1
-		{ "OE3",  7 },
-		{ "OE2",  6 },
-		{ "OE1",  5 },
-		{ "OE0",  4 },
-		{ "CTL3", 3 },
-		{ "CTL2", 2 },
-		{ "CTL1", 1 },
-		{ "CTL0", 0 },
-	  }
-	}
-};
+void *
+operator new(size_t size) {
+	void *p = malloc(size ? size : 1);
 
-static const std::map<std::string,unsigned> functab = {
-	{ "AND",   0b00 },
-	{ "OR",    0b01 },
-	{ "XOR",   0b10 },
-	{ "/AND",  0b11 }
-};
+	if ( !p )
+		throw std::bad_alloc();
+	++thread_allocs.count;
+	thread_allocs.bytes += size;
+	return p;
+}
 
-static const std::map<unsigned/*GpifReadyCfg5*/,
-	std::map<unsigned/*EPxGPIFFLGSEL*/,
-	std::map<unsigned/*GPIFREADYCFG.7*/,
-	std::map<std::string,unsigned>
-	>>> opertab = {
-		{ 0/*gpifReadyCfg5=0*/,	{
-			{ 0/*EPxGPIFFLGSEL=0 (PF)*/, {
-				{ 0/*GPIFREADYCFG.7=0*/, {
-					{ "RDY0",  0b000 },
-					{ "RDY1",  0b001 },
-					{ "RDY2",  0b010 },
-					{ "RDY3",  0b011 },
-					{ "RDY4",  0b100 },
-					{ "RDY5",  0b101 },	// GPIFREADYCFG.5 = 0
-					{ "PF",    0b110 },	// EPxGPIFFLGSEL
-				}},
-				{ 1/*GPIFREADYCFG.7=1*/, {
-					{ "RDY0",  0b000 },
-					{ "RDY1",  0b001 },
-					{ "RDY2",  0b010 },
-					{ "RDY3",  0b011 },
-					{ "RDY4",  0b100 },
-					{ "RDY5",  0b101 },	// GPIFREADYCFG.5 = 0
-					{ "PF",    0b110 },	// EPxGPIFFLGSEL=0
-				}},
-			}},
-			{ 1/*EPxGPIFFLGSEL=1 (EF)*/, {
-				{ 0/*GPIFREADYCFG.7=0*/, {
-					{ "RDY0",  0b000 },
-					{ "RDY1",  0b001 },
-					{ "RDY2",  0b010 },
-					{ "RDY3",  0b011 },
-					{ "RDY4",  0b100 },
-					{ "RDY5",  0b101 },	// GPIFREADYCFG.5 = 0
-					{ "EF",    0b110 },	// EPxGPIFFLGSEL=1
-				}},
-				{ 1/*GPIFREADYCFG.7=1*/, {
-					{ "RDY0",  0b000 },
-					{ "RDY1",  0b001 },
-					{ "RDY2",  0b010 },
-					{ "RDY3",  0b011 },
-					{ "RDY4",  0b100 },
-					{ "RDY5",  0b101 },	// GPIFREADYCFG.5 = 0
-					{ "EF",    0b110 },	// EPxGPIFFLGSEL = 1
-					{ "INTRDY",0b111 },
-				}},
-			}},
-			{ 2/*EPxGPIFFLGSEL=1 (FF)*/, {
-				{ 0/*GPIFREADYCFG.7=0*/, {
-					{ "RDY0",  0b000 },
-					{ "RDY1",  0b001 },
-					{ "RDY2",  0b010 },
-					{ "RDY3",  0b011 },
-					{ "RDY4",  0b100 },
-					{ "RDY5",  0b101 },	// GPIFREADYCFG.5 = 0
-					{ "FF",    0b110 },	// EPxGPIFFLGSEL=2
-				}},
-				{ 1/*GPIFREADYCFG.7=1*/, {
-					{ "RDY0",  0b000 },
-					{ "RDY1",  0b001 },
-					{ "RDY2",  0b010 },
-					{ "RDY3",  0b011 },
-					{ "RDY4",  0b100 },
-					{ "RDY5",  0b101 },	// GPIFREADYCFG.5 = 0
-					{ "FF",    0b110 },	// EPxGPIFFLGSEL = 2
-					{ "INTRDY",0b111 },
-				}},
-			}},
-		}},
-		{ 1/*GpifReadyCfg5=1*/, {
-			{ 0/*EPxGPIFFLGSEL=0 (PF)*/, {
-				{ 0/*GPIFREADYCFG.7=0*/, {
-					{ "RDY0",  0b000 },
-					{ "RDY1",  0b001 },
-					{ "RDY2",  0b010 },
-					{ "RDY3",  0b011 },
-					{ "RDY4",  0b100 },
-					{ "TC",    0b101 },	// GPIFREADYCFG.5 = 1
-					{ "PF",    0b110 },	// EPxGPIFFLGSEL
-				}},
-				{ 1/*GPIFREADYCFG.7=1*/, {
-					{ "RDY0",  0b000 },
-					{ "RDY1",  0b001 },
-					{ "RDY2",  0b010 },
-					{ "RDY3",  0b011 },
-					{ "RDY4",  0b100 },
-					{ "TC",    0b101 },	// GPIFREADYCFG.5 = 1
-					{ "PF",    0b110 },	// EPxGPIFFLGSEL=0
-				}},
-			}},
-			{ 1/*EPxGPIFFLGSEL=1 (EF)*/, {
-				{ 0/*GPIFREADYCFG.7=0*/, {
-					{ "RDY0",  0b000 },
-					{ "RDY1",  0b001 },
-					{ "RDY2",  0b010 },
-					{ "RDY3",  0b011 },
-					{ "RDY4",  0b100 },
-					{ "TC",    0b101 },	// GPIFREADYCFG.5 = 1
-					{ "EF",    0b110 },	// EPxGPIFFLGSEL=1
-				}},
-				{ 1/*GPIFREADYCFG.7=1*/, {
-					{ "RDY0",  0b000 },
-					{ "RDY1",  0b001 },
-					{ "RDY2",  0b010 },
-					{ "RDY3",  0b011 },
-					{ "RDY4",  0b100 },
-					{ "TC",    0b101 },	// GPIFREADYCFG.5 = 1
-					{ "EF",    0b110 },	// EPxGPIFFLGSEL = 1
-					{ "INTRDY",0b111 },
-				}},
-			}},
-			{ 2/*EPxGPIFFLGSEL=1 (FF)*/, {
-				{ 0/*GPIFREADYCFG.7=0*/, {
-					{ "RDY0",  0b000 },
-					{ "RDY1",  0b001 },
-					{ "RDY2",  0b010 },
-					{ "RDY3",  0b011 },
-					{ "RDY4",  0b100 },
-					{ "TC",    0b101 },	// GPIFREADYCFG.5 = 1
-					{ "FF",    0b110 },	// EPxGPIFFLGSEL=2
-				}},
-				{ 1/*GPIFREADYCFG.7=1*/, {
-					{ "RDY0",  0b000 },
-					{ "RDY1",  0b001 },
-					{ "RDY2",  0b010 },
-					{ "RDY3",  0b011 },
-					{ "RDY4",  0b100 },
-					{ "TC",    0b101 },	// GPIFREADYCFG.5 = 1
-					{ "FF",    0b110 },	// EPxGPIFFLGSEL = 2
-					{ "INTRDY",0b111 },
-				}},
-			}},
-		}}
-	};
+void
+operator delete(void *p) noexcept {
+	free(p);
+}
 
-union u_opcode {
-	uint8_t			byte;
-	struct s_opcode {
-		uint8_t	dp : 1;		// 1 == DP
-		uint8_t	data : 1;	// 1 == Drive FIFO / Sample
-		uint8_t	next : 1;	// 1 == move next to FIFO, or use UDMACRCH:L
-		uint8_t	incad : 1;	// 1 == increment GPIFADR
-		uint8_t	gint : 1;	// 1 == generate a GPIFWF
-		uint8_t	sgl : 1;	// 1 == use SGLDATH:L / UDMACRCH:L
-		uint8_t	reserved : 2;	// Ignored
-	}			bits;
-};
+void
+operator delete(void *p,size_t) noexcept {
+	free(p);
+}
 
-union u_logfunc {
-	enum class e_logfunc {
-		a_and_b = 0,
-		a_or_b = 1,
-		a_xor_b = 2,
-		na_and_b = 3
-	};
-	uint8_t			byte;
-	struct s_logfunc {
-		uint8_t	termb : 3;	// TERM B
-		uint8_t	terma : 3;	// TERM A
-		uint8_t	lfunc : 2;	// e_log_func
-	}			bits;
-};
+static int uncompile(int argc,char **argv,const s_options& opts);
+static int batch(const char *outdir,int nfiles,char **files,const s_options& opts);
+static void cache_report(const Cache& cache);
+static int synthesis(const char *specpath);
+static int compare(const char *basepath,std::string_view src,const s_options& opts,double threshold);
+static int reload(const char *loadedpath,std::string_view src,const s_options& opts);
+static int firmscan(int npaths,char **paths);
 
-union u_branch {
-	uint8_t			byte;
-	struct s_branch {
-		uint8_t	branch0 : 3;
-		uint8_t	branch1 : 3;
-		uint8_t	reserved : 1;
-		uint8_t	reexecute : 1;
-	}			bits;
-};
+static void
+usage(const char *cmd) {
+	std::cerr << "Usage: " << cmd << " [-O] [-I] [-o format] [-a] [-P depth] [-s] [-S stimulus] [-n count] [-f MHz] [-w] [-t] [-V file.vcd] [-F MB/s [-L level]] [-C dir [-M MB]] <source.wvf\n"
+		<< "       " << cmd << " gpif.c ...\n"
+		<< "       " << cmd << " -R capture.vcd [-f MHz] { gpif.c ... | <source.wvf }\n"
+		<< "       " << cmd << " -Y spec >source.wvf\n"
+		<< "       " << cmd << " -D loaded.wvf [-o c|regs] <source.wvf\n"
+		<< "       " << cmd << " -X { firmware.ihx | firmware.bin | dir } ...\n"
+		<< "       " << cmd << " [options] --compare baseline.json [--threshold pct] <source.wvf\n"
+		<< "       " << cmd << " [options] -B outdir { source.wvf | gpif.c } ...\n"
+		<< "\t-B dir\tBatch assemble and decompile the files into dir\n"
+		<< "\t-C dir\tCache assemblies in dir\n"
+		<< "\t-M MB\tCache size limit (default 64, 0 for none)\n"
+		<< "\t-I\tAlso emit InitData[] and GpifInit()\n"
+		<< "\t-O\tOptimize away redundant states\n"
+		<< "\t-o fmt\tOutput c (default), bin, hex, regs or json (metrics)\n"
+		<< "\t--metrics json\tSame as -o json\n"
+		<< "\t--compare file\tCompare the metrics with a baseline, failing on a regression\n"
+		<< "\t--threshold pct\tMB/s that may be lost before it is a regression (default 0)\n"
+		<< "\t-a\tAnalyze best and worst case cycles, or duplicate waveforms\n"
+		<< "\t-P depth\tPlan transfers with depth host requests queued\n"
+		<< "\t-s\tSimulate the assembled waveform\n"
+		<< "\t-S file\tRDY/flag stimulus for the simulation (implies -s)\n"
+		<< "\t-n count\tTransactions to simulate (default 1)\n"
+		<< "\t-f MHz\tIFCLK frequency (default .IFCLK)\n"
+		<< "\t-w\t16-bit data bus (default .WORDWIDE)\n"
+		<< "\t-t\tTrace each simulated cycle\n"
+		<< "\t-V file\tWrite the simulated cycles to a VCD file (implies -s)\n"
+		<< "\t-F MB/s\tSimulate the EP FIFO, with the host at MB/s (implies -s)\n"
+		<< "\t-L level\tPF at >= level bytes, or <level for <= (default half the FIFO)\n"
+		<< "\t-R file\tReplay captured inputs (VCD or CSV) through the waveform\n"
+		<< "\t-D file\tEmit the patch that reloads the GPIF from file's set to the source\n"
+		<< "\t--stats\tReport the time, calls and allocations of each phase on stderr\n"
+		<< "\t--trace file\tAlso write the phases as Chrome trace events (implies --stats)\n"
+		<< "\t-X\tScan firmware images for waveform tables and decompile them\n"
+		<< "\t-Y spec\tSynthesize the fastest waveform meeting spec\n";
+}
 
-union u_output {
-	uint8_t			byte;
-	struct s_output1 {
-		uint8_t	ctl0 : 1;
-		uint8_t	ctl1 : 1;
-		uint8_t	ctl2 : 1;
-		uint8_t	ctl3 : 1;
-		uint8_t	oes0 : 1;
-		uint8_t	oes1 : 1;
-		uint8_t	oes2 : 1;
-		uint8_t	oes3 : 1;
-	}			bits1;
-	struct s_output0 {
-		uint8_t	ctl0 : 1;
-		uint8_t	ctl1 : 1;
-		uint8_t	ctl2 : 1;
-		uint8_t	ctl3 : 1;
-		uint8_t	ctl4 : 1;
-		uint8_t	ctl5 : 1;
-		uint8_t	reserved : 2;
-	}			bits0;
+static const std::map<std::string,OutFormat,std::less<>> formattab = {
+	{ "c",		OutFormat::C },
+	{ "bin",	OutFormat::Bin },
+	{ "hex",	OutFormat::Hex },
+	{ "regs",	OutFormat::Regs },
+	{ "json",	OutFormat::Json },
 };
 
-struct s_instr {
-	std::string		stropcode;
-	std::vector<std::string> stroperands;
-	std::string		strcomment;
-	std::string		error;
-
-	u_branch		branch;
-	u_opcode		opcode;
-	u_logfunc		logfunc;
-	u_output		output;
-
-	void clear() {
-		stropcode.clear();
-		stroperands.clear();
-		strcomment.clear();
-		opcode.byte = 0;
-		logfunc.byte = 0;
-		branch.byte = 0;
-		output.byte = 0;
-	};
+static const struct option longopts[] = {
+	{ "metrics",	required_argument,	nullptr,	'm' },
+	{ "compare",	required_argument,	nullptr,	'c' },
+	{ "threshold",	required_argument,	nullptr,	'T' },
+	{ "stats",	no_argument,		nullptr,	'k' },
+	{ "trace",	required_argument,	nullptr,	'e' },
+	{ "help",	no_argument,		nullptr,	'h' },
+	{ nullptr,	0,			nullptr,	0 },
 };
 
-static bool
-parse(std::istream& istr,s_instr& instr) {
-	std::stringstream ss;
-	char pk;
-
-	instr.clear();
-
-	for (;;) {
-		if ( istr.eof() )
-			return false;
-		istr >> instr.stropcode;
-		if ( instr.stropcode[0] != ';' && !instr.stropcode.empty() )
+int
+main(int argc,char **argv) {
+	s_options opts;
+	s_simopts& simopts = opts.sim;
+	const char *outdir = nullptr;
+	const char *cachedir = nullptr;
+	const char *specpath = nullptr;
+	const char *vcdpath = nullptr;
+	const char *basepath = nullptr;
+	const char *loadedpath = nullptr;
+	const char *tracepath = nullptr;
+	bool scan = false, stats = false;
+	double threshold = 0.0;
+	unsigned long cachemb = 64;
+	int optch;
+
+	while ( (optch = getopt_long(argc,argv,"B:C:M:IOo:aP:sS:n:f:wtV:F:L:R:D:XY:m:c:T:h",longopts,nullptr)) != -1 ) {
+		char *ep = nullptr;
+
+		switch ( optch ) {
+		case 'B':
+			outdir = optarg;
 			break;
-		while ( !istr.eof() && istr.get() != '\n' )
-			;
-	}
-
-	while ( !istr.eof() && (pk = istr.peek()) != '\n' ) {
-		std::string token;
+		case 'C':
+			cachedir = optarg;
+			break;
+		case 'M':
+			cachemb = strtoul(optarg,&ep,10);
+			break;
+		case 'I':
+			opts.init = true;
+			break;
+		case 'O':
+			opts.optimize = true;
+			break;
+		case 'o':
+			{
+				auto it = formattab.find(optarg);
 
-		istr >> token;
-		if ( token[0] != ';' ) {
-			instr.stroperands.push_back(token);
-		} else	{
-			while ( (pk = istr.peek()) != '\n' ) {
-				ss << pk;
-				istr.get();
+				if ( it == formattab.end() )
+					ep = optarg;
+				else	opts.format = it->second;
 			}
-			if ( ss.tellp() > 0 )
-				instr.strcomment = ss.str();
 			break;
+		case 'a':
+			opts.analyze = true;
+			break;
+		case 'P':
+			opts.hostqueue = strtoul(optarg,&ep,10);
+			if ( opts.hostqueue == 0 )
+				ep = optarg;
+			break;
+		case 'S':
+			simopts.stimpath = optarg;
+			// Fall thru
+		case 's':
+			simopts.simulate = true;
+			break;
+		case 'n':
+			simopts.transactions = strtoul(optarg,&ep,10);
+			simopts.simulate = true;
+			break;
+		case 'f':
+			simopts.ifclk = strtod(optarg,&ep);
+			if ( !(simopts.ifclk > 0.0) )
+				ep = optarg;
+			break;
+		case 'w':
+			simopts.wordwide = true;
+			break;
+		case 't':
+			simopts.trace = simopts.simulate = true;
+			break;
+		case 'V':
+			vcdpath = optarg;
+			simopts.simulate = true;
+			break;
+		case 'F':
+			simopts.usbrate = strtod(optarg,&ep);
+			if ( !(simopts.usbrate > 0.0) )
+				ep = optarg;
+			simopts.simulate = true;
+			break;
+		case 'L':
+			simopts.pfbelow = *optarg == '<';
+			simopts.pflevel = strtol(simopts.pfbelow ? optarg + 1 : optarg,&ep,10);
+			if ( simopts.pflevel < 0 )
+				ep = optarg;
+			break;
+		case 'R':
+			simopts.replaypath = optarg;
+			simopts.simulate = true;
+			break;
+		case 'D':
+			loadedpath = optarg;
+			break;
+		case 'X':
+			scan = true;
+			break;
+		case 'Y':
+			specpath = optarg;
+			break;
+		case 'm':
+			if ( strcmp(optarg,"json") != 0 )
+				ep = optarg;
+			opts.format = OutFormat::Json;
+			break;
+		case 'c':
+			basepath = optarg;
+			opts.format = OutFormat::Json;
+			break;
+		case 'T':
+			threshold = strtod(optarg,&ep);
+			if ( threshold < 0.0 )
+				ep = optarg;
+			break;
+		case 'k':
+			stats = true;
+			break;
+		case 'e':
+			tracepath = optarg;
+			stats = true;
+			break;
+		case 'h':
+			usage(argv[0]);
+			exit(0);
+		default:
+			usage(argv[0]);
+			exit(1);
+		}
+		if ( ep && *ep ) {
+			std::cerr << "*** ERROR: Invalid argument '" << optarg << "' for -" << char(optch) << '\n';
+			exit(1);
 		}
 	}
-		
-	while ( !istr.eof() ) {
-		if ( istr.get() == '\n' )
-			break;
+
+	if ( opts.init && (opts.format == OutFormat::Bin || opts.format == OutFormat::Hex || opts.format == OutFormat::Json) ) {
+		std::cerr << "*** ERROR: -I needs -o c or -o regs\n";
+		exit(1);
 	}
-	return true;
-}
 
-int
-main(int argc,char **argv) {
-	if ( argc > 1 )
-		uncompile(argc,argv);
-
-	std::vector<s_instr> instrs;
-	std::map<unsigned,unsigned> environ = {
-		{ unsigned(PseudoOps::Trictl),		0u },
-		{ unsigned(PseudoOps::GpifReadyCfg5),	0u },
-		{ unsigned(PseudoOps::GpifReadyCfg7),	0u },
-		{ unsigned(PseudoOps::EpxGpifFlgSel),	0u },
-		{ unsigned(PseudoOps::Ep),		2u },
-		{ unsigned(PseudoOps::WaveForm),	0u },
-	};
-	unsigned& trictl = environ.at(unsigned(PseudoOps::Trictl));
-	unsigned& gpifreadycfg5 = environ.at(unsigned(PseudoOps::GpifReadyCfg5));
-	unsigned& gpifreadycfg7 = environ.at(unsigned(PseudoOps::GpifReadyCfg7));
-	unsigned& epxgpifflgsel= environ.at(unsigned(PseudoOps::EpxGpifFlgSel));
-	unsigned& waveformx= environ.at(unsigned(PseudoOps::WaveForm));
-	unsigned state = 0;
-
-	{
-		s_instr instr;
-
-		while ( parse(std::cin,instr) ) {
-			auto it = pseudotab.find(instr.stropcode);
-			if ( it != pseudotab.end() ) {
-				PseudoOps pseudoop = PseudoOps(it->second);
-				char *ep;
-				unsigned value = 0;
-
-				if ( instr.stroperands.size() != 1 ) {
-					std::cerr << "*** ERROR: Only one operand valid for pseudo op " << instr.stropcode << '\n';
-					exit(1);					
-				}
-				if ( pseudoop != PseudoOps::EpxGpifFlgSel ) {
-					value = strtoul(instr.stroperands[0].c_str(),&ep,10);
-					bool fail = false;
-
-					if ( pseudoop != PseudoOps::WaveForm ) {
-						fail = value > ( pseudoop != PseudoOps::Ep ? 1 : 8 );
-
-						if ( !fail && pseudoop == PseudoOps::Ep && (value & 1) )
-							fail = true;		// Only EP 2, 4, 6 or 8
-					} else	fail = false;
-
-					if ( (ep && *ep) || fail ) {
-						std::cerr << "*** ERROR: Invalid operand '" << instr.stroperands[0] << "' for " << instr.stropcode << '\n';
-						exit(1);
-					}
-				} else	{
-					auto it = flgsel.find(instr.stroperands[0]);
-					if ( it == flgsel.end() ) {
-						std::cerr << "*** ERROR: Operand of " << instr.stropcode << " must be PF, EF, or FF\n";
-						exit(1);
-					}
-					value = !!it->second;
-				}
-				environ[unsigned(pseudoop)] = value;
-				continue;
-			} else	{
-				instrs.push_back(instr);
-			}
-		}
+	if ( simopts.pflevel >= 0 && !(simopts.usbrate > 0.0) ) {
+		std::cerr << "*** ERROR: -L needs -F\n";
+		exit(1);
 	}
 
-	for ( auto& instr : instrs ) {
-		// Parse opcode:
-		for ( auto c : instr.stropcode ) {
-			switch ( c ) {
-			case 'J':
-				instr.opcode.bits.dp = 1;
-				break;
-			case 'S':
-				instr.opcode.bits.sgl = 1;
-				break;
-			case '+':
-				instr.opcode.bits.incad = 1;
-				break;
-			case 'G':
-				instr.opcode.bits.gint = 1;
-				break;
-			case 'N':
-				instr.opcode.bits.next = 1;
-				break;
-			case 'D':
-				instr.opcode.bits.data = 1;
-				break;
-			case 'Z':
-				break;
-			case '*':
-				if ( instr.opcode.bits.dp ) {
-					instr.branch.bits.reexecute = 1;
-					break;
-				}
-				// Fall thru
-			default:
-				{
-					std::stringstream ss;
+	if ( stats && (loadedpath || scan || specpath) ) {
+		std::cerr << "*** ERROR: --stats and --trace cannot be combined with -D, -X or -Y\n";
+		exit(1);
+	}
 
-					ss << "Unknown opcode '" << c << "'";
-					instr.error = ss.str();
-				}
-			}			
-		}
+	if ( simopts.replaypath && vcdpath ) {
+		std::cerr << "*** ERROR: -R and -V cannot be combined\n";
+		exit(1);
+	}
 
-		// Parse operands:
-		if ( instr.opcode.bits.dp ) {
-			// DP
-			if ( instr.stroperands.size() < 3 ) {
-				instr.error = "missing operand A func B";
-				continue;
-			}
-			std::string& opera = instr.stroperands[0];
-			std::string& func  = instr.stroperands[1];
-			std::string& operb = instr.stroperands[2];
-			auto& opermap = opertab.at(gpifreadycfg5).at(epxgpifflgsel).at(gpifreadycfg7);
+	if ( simopts.stimpath ) {
+		std::string err;
 
-			{
-				auto it = opermap.find(opera);
-				if ( it == opermap.end() ) {
-					std::stringstream ss;
-					ss << "Invalid operand A '" << opera << "'";
-					instr.error = ss.str();
-					continue;
-				}
-				instr.logfunc.bits.terma = it->second;
-			}
+		if ( !load_stimulus(simopts.stimpath,simopts.stimulus,err) ) {
+			std::cerr << "*** ERROR: " << err << '\n';
+			exit(1);
+		}
+	}
 
-			{
-				auto it = opermap.find(operb);
-				if ( it == opermap.end() ) {
-					std::stringstream ss;
-					ss << "Invalid operand B '" << operb << "'\n"
-						<< "  Must be one of: ";
-					for ( auto& pair : opermap )
-						ss << pair.first << ' ';
-					instr.error = ss.str();
-					continue;
-				}
-				instr.logfunc.bits.termb = it->second;
-			}
+	if ( specpath )
+		return synthesis(specpath);
+	if ( scan )
+		return firmscan(argc-optind,argv+optind);
 
-			{
-				auto it = functab.find(func);
+	std::ofstream vcd;
 
-				if ( it == functab.end() ) {
-					std::stringstream ss;
-					ss << "Invalid function '" << func << "'";
-					instr.error = ss.str();
-					continue;
-				}
-				instr.logfunc.bits.lfunc = it->second;
-			}
-
-			instr.branch.bits.branch0 = instr.branch.bits.branch1 = 7;	// Default to state 7
-			unsigned statex = 0;
-
-			for ( unsigned ox=3; ox<instr.stroperands.size(); ++ox ) {
-				std::string& operand = instr.stroperands[ox];
-				const auto& oemap = oetab.at(trictl);
-
-				if ( !operand.empty() && operand[0] == '$' ) {
-					char *cp = nullptr;
-					unsigned long state = strtoul(operand.c_str()+1,&cp,10);
-
-					if ( (cp && *cp) || state > 7 || (state != 7 && state > instrs.size()) ) {
-						std::stringstream ss;
-						ss << "invalid target state '" << operand << "'";
-						instr.error = ss.str();
-						break;
-					}
-
-					switch ( statex++ ) {
-					case 0:
-						instr.branch.bits.branch0 = state;
-						break;
-					case 1:
-						instr.branch.bits.branch1 = state;
-						break;
-					default:
-						{
-							std::stringstream ss;
-							ss << "Too many target states starting with '" << operand << "'";
-							instr.error = ss.str();
-						}
-					}
-					if ( !instr.error.empty() )
-						break;
-				} else	{
-					auto it = oemap.find(operand);
-					if ( it == oemap.end() ) {
-						std::stringstream ss;
-						ss << "invalid operand '" << operand << "' (TRICTL=" << trictl << ")\n"
-							<< "  Must be one of: ";
-						for ( auto& pair : oemap )
-							ss << pair.first << ' ';
-						instr.error = ss.str();
-						break;
-					}
-					unsigned shift = it->second;
-					instr.output.byte |= 1 << shift;
-				}
-			}
-			if ( instr.error.empty() && statex != 2 ) {
-				std::stringstream ss;
-				instr.error = "Branch0 and/or branch1 states were not specified.";
-			}
-		} else	{
-			// NDP
-			instr.branch.byte = 1;		// Default to a 1-count
-
-			for ( auto& operand : instr.stroperands ) {
-				if ( operand[0] >= '0' && operand[0] <= '9' ) {
-					// Count
-					char *ep;
-					unsigned count = strtoul(operand.c_str(),&ep,10);
-					std::stringstream ss;
-
-					if ( ep && *ep ) {
-						ss << "Invalid count '" << operand << "'";
-						instr.error = ss.str();
-					} else if ( count > 256 ) {
-						ss << "Invalid count value " << count;
-						instr.error = ss.str();
-					} else	{
-						if ( count == 256 )
-							count = 0u;
-						instr.branch.byte = count;
-					}
-				} else	{
-					// Bits
-					const auto& oemap = oetab.at(trictl);
-
-					auto it = oemap.find(operand);
-					if ( it == oemap.end() ) {
-						std::stringstream ss;
-						ss << "invalid operand '" << operand << "' (TRICTL=" << trictl << ")\n"
-							<< "  Must be one of: ";
-						for ( auto& pair : oemap )
-							ss << pair.first << ' ';
-						instr.error = ss.str();
-						break;
-					}
-					unsigned shift = it->second;
-					instr.output.byte |= 1 << shift;
-				}
-			}
+	if ( vcdpath ) {
+		vcd.open(vcdpath);
+		if ( !vcd ) {
+			std::cerr << "*** ERROR: " << strerror(errno) << ": Opening " << vcdpath << " for write\n";
+			exit(1);
 		}
+		simopts.vcd = &vcd;
 	}
 
-	auto revlookup = [&](unsigned ps) -> std::string {
-		for ( auto pair : pseudotab ) {
-			const std::string& op = pair.first;
-			const unsigned u = pair.second;
-			
-			if ( ps == u )
-				return op;
-		}
-		assert(0);
-	};
+	std::unique_ptr<Cache> cache;
 
-	std::cerr << ";\n;\tEnvironment in effect:\n"
-		<< ";\n";
-
-	for ( auto& pair : environ ) {
-		const unsigned ps = pair.first;
-		const unsigned value = pair.second;
-		const std::string& op = revlookup(ps);
-		const std::array<const char *,3> opers = { { "PF", "EF", "FF" } };
-
-		switch ( PseudoOps(ps) ) {
-		case PseudoOps::Trictl:
-		case PseudoOps::GpifReadyCfg5:
-		case PseudoOps::GpifReadyCfg7:
-		case PseudoOps::Ep:
-		case PseudoOps::WaveForm:
-			std::cerr << '\t' << op << '\t' << value << '\n';
-			break;
-		case PseudoOps::EpxGpifFlgSel:
-			std::cerr << '\t' << op << '\t' << opers[value] << '\n';
-			break;
-		}
-	}
-	std::cerr << ";\n";
-
-	for ( auto& instr : instrs ) {
-		std::cerr << '$' << state++ << "  ";
-
-		std::cerr.width(2);
-		std::cerr.fill('0');
-		std::cerr << std::uppercase << std::hex << unsigned(instr.branch.byte);
-
-		std::cerr.fill('0');
-		std::cerr.width(2);
-		std::cerr << std::hex << unsigned(instr.opcode.byte);
-
-		std::cerr.width(2);
-		std::cerr.fill('0');
-		std::cerr << std::hex << unsigned(instr.logfunc.byte);
-
-		std::cerr.fill('0');
-		std::cerr.width(2);
-		std::cerr << std::hex << unsigned(instr.output.byte);
-
-		std::cerr << '\t' << instr.stropcode << '\t';
-		for ( auto& operand : instr.stroperands )
-			std::cerr << operand << " ";
-		if ( !instr.strcomment.empty() )
-			std::cerr << "\t; " << instr.strcomment;
-		std::cerr << '\n';
-		if ( !instr.error.empty() )
-			std::cerr << "*** ERROR: " << instr.error << '\n';
-		if ( state > 7 ) {
-			std::cerr << "*** ERROR: Too many states. Limit is 6 states max.\n";
+	if ( cachedir ) {
+		cache.reset(new Cache(cachedir,cachemb << 20));
+		if ( !cache->ok() ) {
+			std::cerr << "*** ERROR: " << cache->error() << '\n';
 			exit(1);
 		}
+		opts.cache = cache.get();
 	}
 
-	instrs.resize(8);
+	std::unique_ptr<Stats> phases;
 
-	std::cout << "static unsigned char waveform" << waveformx << "[32] = { \n\t";
+	if ( stats ) {
+		phases.reset(new Stats(tracepath != nullptr));
+		opts.stats = phases.get();
+	}
 
-	for ( auto& instr : instrs ) {
-		std::cout << "0x";
-		std::cout.width(2);
-		std::cout.fill('0');
-		std::cout << std::uppercase << std::hex << unsigned(instr.branch.byte) << ',';
-	}			
-	std::cout << "\n\t";
+	// The stats and trace, once the work is done
+	auto finish = [&](int rc) {
+		if ( !phases )
+			return rc;
+		std::cerr << phases->report();
+		if ( tracepath ) {
+			std::ofstream trace(tracepath);
+
+			trace << phases->trace_json();
+			if ( !trace.good() ) {
+				std::cerr << "*** ERROR: " << strerror(errno) << ": Writing " << tracepath << '\n';
+				rc = 1;
+			}
+		}
+		return rc;
+	};
 
-	for ( auto& instr : instrs ) {
-		std::cout << "0x";
-		std::cout.fill('0');
-		std::cout.width(2);
-		std::cout << std::hex << unsigned(instr.opcode.byte) << ',';
-	}
-	std::cout << "\n\t";
+	if ( outdir ) {
+		int rc = batch(outdir,argc-optind,argv+optind,opts);
 
-	for ( auto& instr : instrs ) {
-		std::cout << "0x";
-		std::cout.fill('0');
-		std::cout.width(2);
-		std::cout << std::hex << unsigned(instr.output.byte) << ',';
+		if ( cache )
+			cache_report(*cache);
+		return finish(rc);
 	}
-	std::cout << "\n\t";
 
-	for ( auto& instr : instrs ) {
-		std::cout << "0x";
-		std::cout.width(2);
-		std::cout.fill('0');
-		std::cout << std::hex << unsigned(instr.logfunc.byte) << ',';
+	if ( optind < argc )
+		return finish(uncompile(argc-optind+1,argv+optind-1,opts));
+
+	std::vector<s_diagnostic> diags;
+	Source src(0);
+
+	if ( !src.ok() ) {
+		std::cerr << src.error() << ": Reading stdin\n";
+		return 1;
 	}
 
-	std::cout << "\n};\n\n";
+	if ( basepath )
+		return finish(compare(basepath,src.text(),opts,threshold));
+	if ( loadedpath )
+		return reload(loadedpath,src.text(),opts);
 
-	return 0;
+	bool ok = Assembler(opts).assemble(src.text(),std::cout,std::cerr,diags);
+
+	if ( cache )
+		cache_report(*cache);
+	return finish(ok ? 0 : 1);
 }
 
 static void
-decompile(unsigned waveformx,uint8_t data[32]) {
-	unsigned ux;
-	bool trictl = false;
-
-	std::cout << "; WaveForm " << waveformx << '\n';
-
-	for ( ux=0; ux<32-4; ux += 4 ) {
-		u_branch branch;
-		u_opcode opcode;
-		u_logfunc logfunc;
-		u_output output;
-		std::stringstream opc, oper;
-
-		branch.byte= data[ux+0];
-		opcode.byte = data[ux+1];
-		logfunc.byte = data[ux+2];
-		output.byte = data[ux+3];
-
-		if ( opcode.bits.dp == 1 )
-			opc << 'J';
-		if ( opcode.bits.sgl )
-			opc << 'S';
-		if ( opcode.bits.incad )
-			opc << '+';
-		if ( opcode.bits.gint )
-			opc << 'G';
-		if ( opcode.bits.next )
-			opc << 'N';
-		if ( opcode.bits.data )
-			opc << 'D';
-		if ( !opcode.byte )
-			opc << 'Z';
-		if ( opcode.bits.dp && branch.bits.reexecute )
-			opc << '*';
-
-		if ( output.bits1.oes3 || output.bits1.oes2 )
-			trictl = true;		// Assume TRICTL
-
-		auto outs = [&]() {
-			if ( trictl ) {
-				if ( output.bits1.oes3 )
-					oper << "OES3 ";
-				if ( output.bits1.oes2 )
-					oper << "OES2 ";
-				if ( output.bits1.oes1 )
-					oper << "OES1 ";
-				if ( output.bits1.oes0 )
-					oper << "OES0 ";
-				if ( output.bits1.ctl3 )
-					oper << "CTL3 ";
-				if ( output.bits1.ctl2 )
-					oper << "CTL2 ";
-				if ( output.bits1.ctl1 )
-					oper << "CTL1 ";
-				if ( output.bits1.ctl0 )
-					oper << "CTL0 ";
-			} else	{
-				if ( output.bits0.ctl5 )
-					oper << "CTL5 ";
-				if ( output.bits0.ctl4 )
-					oper << "CTL4 ";
-				if ( output.bits0.ctl3 )
-					oper << "CTL3 ";
-				if ( output.bits0.ctl2 )
-					oper << "CTL2 ";
-				if ( output.bits0.ctl1 )
-					oper << "CTL1 ";
-				if ( output.bits0.ctl0 )
-					oper << "CTL0 ";
-			}
-		};
-
-		if ( opcode.bits.dp == 0 ) {
-			// NDP
-			
-			if ( branch.byte == 0 )
-				oper << "256 ";
-			else	oper << unsigned(branch.byte) << ' ';
-			outs();
-
-		} else	{
-			auto aorb = [&](unsigned term) {
-				switch ( term ) {
-				case 0:
-					oper << "RDY0 ";
-					break;
-				case 1:
-					oper << "RDY1 ";
-					break;
-				case 2:
-					oper << "RDY2 ";
-					break;
-				case 3:
-					oper << "RDY3 ";
-					break;
-				case 4:
-					oper << "RDY4 ";
-					break;
-				case 5:
-					oper << "RDY5|TC ";
-					break;
-				case 6:
-					oper << "PF|EF|FF ";
-					break;
-				case 7:
-					oper << "INTRDY ";
-					break;
-				}
-			};
-			aorb(logfunc.bits.terma);
-			switch ( logfunc.bits.lfunc ) {
-			case 0b00:
-				oper << "AND ";
-				break;
-			case 0b01:
-				oper << "OR ";
-				break;
-			case 0b10:
-				oper << "XOR ";
-				break;
-			case 0b11:
-				oper << "/AND ";
-				break;
-			}
-			aorb(logfunc.bits.termb);
-			outs();
+cache_report(const Cache& cache) {
+	s_cachestats st = cache.stats();
 
-			oper << "$" << unsigned(branch.bits.branch0)
-				<< " $" << unsigned(branch.bits.branch1);
-		}
+	std::cerr << "; Cache: " << st.hits << " hits, " << st.misses << " misses, "
+		<< st.stores << " stored, " << st.evictions << " evicted\n";
+}
 
-		std::cout.width(2);
-		std::cout.fill('0');
-		std::cout << std::uppercase << std::hex << unsigned(branch.byte);
-		std::cout.width(2);
-		std::cout.fill('0');
-		std::cout << std::uppercase << std::hex << unsigned(opcode.byte);
-		std::cout.width(2);
-		std::cout.fill('0');
-		std::cout << std::uppercase << std::hex << unsigned(logfunc.byte);
-		std::cout.width(2);
-		std::cout.fill('0');
-		std::cout << std::uppercase << std::hex << unsigned(output.byte)
-			<< '\t' << opc.str()
-			<< '\t' << oper.str() << '\n';
+//////////////////////////////////////////////////////////////////////
+// Assemble the source to metrics and compare them with the baseline
+// file, writing the differences to stdout. Returns 1 on a regression
+// or error.
+//////////////////////////////////////////////////////////////////////
+
+static int
+compare(const char *basepath,std::string_view src,const s_options& opts,double threshold) {
+	std::vector<s_diagnostic> diags;
+	std::ostringstream metrics;
+	Source base(basepath);
+
+	if ( !base.ok() ) {
+		std::cerr << "*** ERROR: " << base.error() << '\n';
+		return 1;
 	}
+	if ( !Assembler(opts).assemble(src,metrics,std::cerr,diags) )
+		return 1;
+
+	s_comparison cmp = compare_metrics(base.text(),metrics.str(),threshold);
+
+	for ( auto& diag : cmp.diagnostics )
+		std::cerr << "*** ERROR: " << diag.text() << '\n';
+	std::cout << cmp.report;
+	return cmp.ok && cmp.regressions == 0 ? 0 : 1;
 }
 
-static void
-decompile(const char *path) {
-	std::ifstream gpif_c;
-	char buf[2048];
-	bool foundf = false;
-
-	gpif_c.open(path,std::ifstream::in);
-	if ( gpif_c.fail() ) {
-		fprintf(stderr,"%s: Opening %s for read\n",
-			strerror(errno),path);
-		exit(1);
-	}
+//////////////////////////////////////////////////////////////////////
+// Emit the patch from the set of loadedpath to the source, with the
+// report on stderr. Returns 1 on errors.
+//////////////////////////////////////////////////////////////////////
 
-	while ( gpif_c.good() ) {
-		if ( !gpif_c.getline(buf,sizeof buf).good() )
-			break;
-		if ( !strncmp(buf,"const char xdata WaveData[128] =",32) ) {
-			foundf = true;
-			break;
-		}
-	}
+static int
+reload(const char *loadedpath,std::string_view src,const s_options& opts) {
+	Source loaded(loadedpath);
 
-	if ( !foundf ) {
-		std::cerr << "Did not find line: 'const char xdata WaveData[128] =' in " << path << '\n';
-		gpif_c.close();
-		exit(1);
+	if ( !loaded.ok() ) {
+		std::cerr << "*** ERROR: " << loaded.error() << '\n';
+		return 1;
 	}
 
-	char ch;
+	s_reload patch = reload_patch(loaded.text(),src,opts.format);
 
-	foundf = false;
-	while ( gpif_c.good() ) {
-		ch = gpif_c.get();
-		if ( !gpif_c.good() )
-			break;
-		if ( ch == '{' ) {
-			foundf = true;
-			break;
+	for ( auto& diag : patch.diagnostics )
+		std::cerr << "*** ERROR: " << diag.text() << '\n';
+	if ( !patch.ok )
+		return 1;
+
+	std::cout << patch.output;
+	std::cerr << patch.report;
+	return 0;
+}
+
+static int
+uncompile(int argc,char **argv,const s_options& opts) {
+	const Decompiler dc(opts);
+	bool failed = false;
+
+	for ( int ax=1; ax < argc; ++ax ) {
+		std::vector<s_diagnostic> diags;
+
+		if ( !dc.decompile_file(argv[ax],std::cout,diags) ) {
+			for ( auto& diag : diags )
+				std::cerr << diag.text() << '\n';
+			failed = true;
 		}
 	}
 
-	if ( !foundf ) {
-		std::cerr << "Missing opening brace: " << path << '\n';
-		gpif_c.close();
-		exit(1);
+	return failed ? 1 : 0;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Batch mode: each file.wvf is assembled to outdir/file.c with its
+// listing in outdir/file.lst, and each file.c is decompiled to
+// outdir/file.dis. The files are spread over a pool of threads, one
+// per core. Errors are reported in the order the files were given.
+//////////////////////////////////////////////////////////////////////
+
+static int
+batch(const char *outdir,int nfiles,char **files,const s_options& opts) {
+	std::vector<std::vector<s_diagnostic>> errors(nfiles);
+	const Assembler as(opts);
+	const Decompiler dc(opts);
+	std::vector<std::string> outpaths(nfiles);
+	std::map<std::string,int> seen;
+	std::atomic<int> next(0);
+	unsigned nthreads = std::thread::hardware_concurrency();
+
+	static const std::map<OutFormat,std::string> exts = {
+		{ OutFormat::C,		".c" },
+		{ OutFormat::Bin,	".bin" },
+		{ OutFormat::Hex,	".hex" },
+		{ OutFormat::Regs,	".reg" },
+		{ OutFormat::Json,	".json" },
+	};
+	const std::string& ext = exts.at(opts.format);
+
+	auto is_c = [&](int fx) {
+		std::string path(files[fx]);
+
+		return path.size() > 2 && path.compare(path.size()-2,2,".c") == 0;
+	};
+
+	for ( int fx=0; fx < nfiles; ++fx ) {
+		std::string base(files[fx]);
+		std::string::size_type sx = base.rfind('/');
+
+		if ( sx != std::string::npos )
+			base.erase(0,sx+1);
+		sx = base.rfind('.');
+		if ( sx != std::string::npos && sx > 0 )
+			base.erase(sx);
+		outpaths[fx] = std::string(outdir) + '/' + base;
+
+		auto it = seen.find(outpaths[fx]);
+		if ( it != seen.end() ) {
+			errors[fx].push_back(s_diagnostic(std::string("Output name clashes with ") + files[it->second]));
+			continue;
+		}
+		seen[outpaths[fx]] = fx;
 	}
 
-	std::vector<uint8_t> raw;
-	std::stringstream sbuf;
+	auto worker = [&]() {
+		int fx;
 
-	while ( gpif_c.good() ) {
-		ch = gpif_c.get();
-		if ( ch == '/' ) {
-			if ((ch = gpif_c.get()) == '/' ) {
-				while ( gpif_c.good() && gpif_c.get() != '\n' )
-					;
-				continue;
-			} else if ( ch == '*' ) {
-				do	{
-					while ( gpif_c.good() && (ch = gpif_c.get()) != '*' )
-						;
-					if ( !gpif_c.good() )
-						break;
-					ch = gpif_c.get();
-				} while ( gpif_c.good() && ch != '/' );
-				if ( !gpif_c.good() )
-					break;
+		while ( (fx = next++) < nfiles ) {
+			if ( !errors[fx].empty() )
 				continue;
+
+			if ( is_c(fx) ) {
+				{
+					std::ofstream dis(outpaths[fx] + ".dis");
+
+					if ( !dis.good() )
+						errors[fx].push_back(s_diagnostic("Unable to create " + outpaths[fx] + ".dis"));
+					else	dc.decompile_file(files[fx],dis,errors[fx]);
+				}
+				if ( !errors[fx].empty() )
+					unlink((outpaths[fx] + ".dis").c_str());
+			} else	{
+				Source src(files[fx]);
+
+				if ( !src.ok() ) {
+					errors[fx].push_back(s_diagnostic(src.error()));
+					continue;			// Nothing is created
+				}
+				{
+					std::ofstream c(outpaths[fx] + ext,std::ios::binary), lst(outpaths[fx] + ".lst");
+
+					if ( !c.good() || !lst.good() )
+						errors[fx].push_back(s_diagnostic("Unable to create " + outpaths[fx] + ext + "/.lst"));
+					else	as.assemble(src.text(),c,lst,errors[fx]);
+				}
+				if ( !errors[fx].empty() )
+					unlink((outpaths[fx] + ext).c_str());	// Keep the listing
 			}
 		}
-		if ( ch == '}' )
-			break;
-		if ( strchr("\n\r\t\b ",ch) != nullptr )
+	};
+
+	std::vector<std::thread> pool;
+
+	if ( nthreads < 1 )
+		nthreads = 1;
+	for ( unsigned tx=0; tx < nthreads && tx < unsigned(nfiles); ++tx )
+		pool.emplace_back(worker);
+	for ( auto& thread : pool )
+		thread.join();
+
+	int failed = 0;
+
+	for ( int fx=0; fx < nfiles; ++fx ) {
+		if ( errors[fx].empty() )
 			continue;
+		++failed;
+		for ( auto& diag : errors[fx] )
+			std::cerr << files[fx] << ": " << diag.text() << '\n';
+	}
+	std::cerr << nfiles << " files, " << failed << " failed.\n";
+
+	return failed ? 1 : 0;
+}
 
-		if ( ch != ',' ) {
-			sbuf << ch;
-		} else	{
-			std::string data(sbuf.str());
-			sbuf.clear();
-			sbuf.str("");
+//////////////////////////////////////////////////////////////////////
+// Scan the firmware images named, and those found under directories,
+// on a pool of threads, one per core. Each image's tables go to stdout
+// and its errors to stderr, in the order found. Returns 1 on errors.
+//////////////////////////////////////////////////////////////////////
 
-			char *ep;
-			unsigned long udata = strtoul(data.c_str(),&ep,0);
+static bool
+is_firmware(const std::string& name) {
+	std::string::size_type sx = name.rfind('.');
 
-			if ( (ep && *ep != 0) || udata > 0xFF ) {
-				std::cerr << "Invalid data: '" << data << "'\n";
-				gpif_c.close();
-				exit(1);
-			}
-			raw.push_back(uint8_t(udata));
-		}
+	if ( sx == std::string::npos )
+		return false;
+
+	const char *ext = name.c_str() + sx;
+
+	return !strcasecmp(ext,".hex") || !strcasecmp(ext,".ihx") || !strcasecmp(ext,".bin");
+}
+
+static void
+find_firmware(const std::string& path,std::vector<std::string>& images) {
+	DIR *dp = opendir(path.c_str());
+
+	if ( !dp ) {
+		images.push_back(path);		// A file, or the error
+		return;
 	}
 
-	std::cout << raw.size() << " bytes.\n";
-	gpif_c.close();
-
-	switch ( raw.size() ) {
-	case 32:
-	case 64:
-	case 96:
-	case 128:
-		break;
-	default:
-		std::cerr << "Unusual data size! Extraction failed.\n";
-		exit(1);
+	std::vector<std::string> names;
+	struct dirent *ent;
+
+	while ( (ent = readdir(dp)) != nullptr )
+		if ( ent->d_name[0] != '.' )
+			names.push_back(ent->d_name);
+	closedir(dp);
+	std::sort(names.begin(),names.end());
+
+	for ( auto& name : names ) {
+		std::string sub = path + '/' + name;
+		struct stat st;
+
+		if ( stat(sub.c_str(),&st) != 0 )
+			continue;
+		if ( S_ISDIR(st.st_mode) )
+			find_firmware(sub,images);
+		else if ( S_ISREG(st.st_mode) && is_firmware(name) )
+			images.push_back(sub);
+	}
+}
+
+static int
+firmscan(int npaths,char **paths) {
+	std::vector<std::string> images;
+	std::atomic<size_t> next(0);
+	unsigned nthreads = std::thread::hardware_concurrency();
+
+	for ( int px=0; px < npaths; ++px )
+		find_firmware(paths[px],images);
+
+	if ( images.empty() ) {
+		std::cerr << "*** ERROR: -X needs firmware files or directories\n";
+		return 1;
 	}
 
-	uint8_t unpacked[32];
+	std::vector<s_firmscan> scans(images.size());
 
-	memset(unpacked,0,sizeof unpacked);
-	for ( unsigned ux=0; ux < raw.size(); ux += 32 ) {
-		unsigned lx = ux;		// Length index
-		unsigned opx = lx + 8;		// Opcode index
-		unsigned otx = opx + 8;		// Output index
-		unsigned lfx = otx + 8;		// Logical function index
+	auto worker = [&]() {
+		size_t ix;
 
-		for ( unsigned bx=0; bx < 32; ) {
-			unpacked[bx++] = raw[lx++];
-			unpacked[bx++] = raw[opx++];
-			unpacked[bx++] = raw[lfx++];
-			unpacked[bx++] = raw[otx++];
+		while ( (ix = next++) < images.size() )
+			scans[ix] = scan_firmware(images[ix].c_str());
+	};
+
+	std::vector<std::thread> pool;
+
+	if ( nthreads < 1 )
+		nthreads = 1;
+	for ( unsigned tx=0; tx < nthreads && tx < images.size(); ++tx )
+		pool.emplace_back(worker);
+	for ( auto& thread : pool )
+		thread.join();
+
+	unsigned long bytes = 0, tables = 0;
+	unsigned failed = 0;
+
+	for ( size_t ix=0; ix < images.size(); ++ix ) {
+		const s_firmscan& scan = scans[ix];
+
+		if ( !scan.ok ) {
+			++failed;
+			for ( auto& diag : scan.diagnostics )
+				std::cerr << images[ix] << ": " << diag.text() << '\n';
+			continue;
+		}
+		std::cout << "; " << images[ix] << ": " << scan.bytes << " bytes, "
+			<< scan.hits.size() << " waveform tables\n";
+		for ( auto& hit : scan.hits ) {
+			char addr[24];
+
+			snprintf(addr,sizeof addr,"0x%04lX",hit.address);
+			std::cout << "; " << addr << ": " << hit.size << " bytes\n" << hit.text;
 		}
-		decompile(ux/32,unpacked);
+		bytes += scan.bytes;
+		tables += scan.hits.size();
 	}
+	std::cerr << images.size() << " files, " << bytes << " bytes, "
+		<< tables << " waveform tables, " << failed << " failed.\n";
 
-	exit(0);
+	return failed ? 1 : 0;
 }
 
-static void
-uncompile(int argc,char **argv) {
+//////////////////////////////////////////////////////////////////////
+// Synthesize from the spec file, writing the source to stdout
+//////////////////////////////////////////////////////////////////////
+
+static int
+synthesis(const char *specpath) {
+	Source spec(specpath);
 
-	for ( int ax=1; ax < argc; ++ax )
-		decompile(argv[ax]);
+	if ( !spec.ok() ) {
+		std::cerr << "*** ERROR: " << spec.error() << '\n';
+		return 1;
+	}
+
+	s_synthesis result = synthesize(spec.text());
 
-	exit(0);
+	for ( auto& diag : result.diagnostics )
+		std::cerr << "*** ERROR: " << diag.text() << '\n';
+	if ( !result.ok )
+		return 1;
+
+	std::cout << result.source;
+	std::cerr << "; " << result.cycles << " cycles per transaction, " << result.states << " states, "
+		<< result.searched << " state sequences searched\n";
+	return 0;
 }
 
 // End ezusbcc.cpp
@@ -0,0 +1,404 @@
+//////////////////////////////////////////////////////////////////////
+// ezusbcc.hpp -- GPIF assembler and decompiler library (libezusbcc)
+///////////////////////////////////////////////////////////////////////
+//
+// The assembler and decompiler of the ezusbcc command, for programs
+// that run them in process. Everything works on memory buffers, and
+// nothing is written to stdout or stderr:
+//
+//	#include "ezusbcc.hpp"
+//
+//	ezusbcc::s_options opts;
+//	opts.format = ezusbcc::OutFormat::Bin;
+//
+//	ezusbcc::Assembler as(opts);
+//	ezusbcc::s_assembly result = as.assemble(source_text);
+//
+//	if ( !result.ok )
+//		for ( auto& diag : result.diagnostics )
+//			std::cerr << diag.text() << '\n';
+//
+// An Assembler or Decompiler holds only its options, so one object
+// may be shared by any number of threads.
+
+#ifndef EZUSBCC_HPP
+#define EZUSBCC_HPP
+
+#include <stdint.h>
+
+#include <iosfwd>
+#include <array>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+
+// Part of every cache key: bump it when the output or listing changes
+#define EZUSBCC_VERSION	"1.13"
+
+namespace ezusbcc {
+
+class Cache;
+class Stats;
+
+enum class OutFormat {
+	C,			// waveformN[32] or WaveData[128] (default)
+	Bin,			// Raw waveform memory bytes
+	Hex,			// Intel HEX at the waveform address
+	Regs,			// (address, value) register writes
+	Json,			// Metrics of each waveform
+};
+
+struct s_stimulus {
+	unsigned long	cycle;		// Takes effect at this IFCLK cycle
+	uint8_t		mask;		// Terms being changed
+	uint8_t		value;		// New values for terms in mask
+};
+
+struct s_simopts {
+	bool		simulate = false;
+	bool		trace = false;	// List every cycle
+	bool		wordwide = false; // 16-bit data bus, else .WORDWIDE
+	unsigned	transactions = 1;
+	double		ifclk = 0.0;	// MHz, else .IFCLK
+	const char	*stimpath = nullptr;
+	std::vector<s_stimulus> stimulus; // Loaded from stimpath
+	std::ostream	*vcd = nullptr;	// Receives a VCD of the run
+	double		usbrate = 0.0;	// Host MB/s of the EP FIFO, 0 for no FIFO
+	long		pflevel = -1;	// PF threshold in bytes, else half the FIFO
+	bool		pfbelow = false; // PF at or below pflevel, else at or above
+	unsigned	flgsel = 0;	// .EPXGPIFFLGSEL and .EPBUF of the section
+	unsigned	epbuf = 2;
+	const char	*replaypath = nullptr; // Captured inputs, VCD or CSV
+};
+
+struct s_options {
+	bool		optimize = false; // -O
+	bool		analyze = false; // -a
+	OutFormat	format = OutFormat::C; // -o
+	bool		init = false;	// -I
+	s_simopts	sim;
+	Cache		*cache = nullptr; // -C, else nothing is cached
+	unsigned	hostqueue = 0;	// -P: host requests queued, 0 for no plan
+	unsigned long	request = 16384; // Bytes per host request
+	Stats		*stats = nullptr; // --stats, else nothing is counted
+};
+
+//////////////////////////////////////////////////////////////////////
+// An error, tied to a source line and column when they are known
+//////////////////////////////////////////////////////////////////////
+
+struct s_diagnostic {
+	unsigned	line = 0;	// Source line, else 0
+	unsigned	column = 0;	// 1 based, else 0
+	std::string	message;
+
+	s_diagnostic() {}
+	s_diagnostic(const std::string& message,unsigned line = 0,unsigned column = 0)
+		: line(line), column(column), message(message) {}
+	s_diagnostic(const char *message,unsigned line = 0,unsigned column = 0)
+		: line(line), column(column), message(message) {}
+
+	// "line N: message", or the message alone
+	std::string text() const;
+};
+
+struct s_assembly {
+	bool		ok = false;	// No errors
+	std::string	output;		// C code, or the -o bin/hex/regs bytes
+	std::vector<uint8_t> image;	// Waveform memory bytes
+	unsigned	address = 0;	// Where image belongs (0xE400..)
+	std::string	listing;	// Listing, analysis and simulation
+	std::vector<s_diagnostic> diagnostics;
+};
+
+struct s_decompilation {
+	bool		ok = false;
+	std::string	text;		// Assembler form
+	std::vector<s_diagnostic> diagnostics;
+};
+
+//////////////////////////////////////////////////////////////////////
+// On-disk cache of assemblies. An entry is found by a hash of the
+// parsed tokens, the environment of each section, the options and
+// EZUSBCC_VERSION, so layout and comments on pseudo ops don't matter.
+// The least recently used entries are removed to stay within limit
+// bytes. One Cache may be shared by threads, and by processes.
+//////////////////////////////////////////////////////////////////////
+
+struct s_cachestats {
+	unsigned long	hits = 0;
+	unsigned long	misses = 0;
+	unsigned long	stores = 0;
+	unsigned long	evictions = 0;	// Entries removed for the limit
+};
+
+class Cache {
+	std::string	dir;
+	unsigned long	limit;		// Bytes, 0 for no limit
+	unsigned long	used = 0;	// Bytes held, as last counted
+	std::string	err;
+	std::mutex	mutex;		// Guards used
+	std::atomic<unsigned long> hits{0}, misses{0}, stores{0}, evictions{0};
+
+	void evict();
+
+public:	Cache(const std::string& dir,unsigned long limit = 64ul << 20);
+
+	Cache(const Cache&) = delete;
+	Cache& operator=(const Cache&) = delete;
+
+	bool ok() const {
+		return err.empty();
+	}
+
+	const std::string& error() const {
+		return err;
+	}
+
+	// The output, listing and image stored under key, else false
+	bool lookup(const std::string& key,s_assembly& entry);
+	void store(const std::string& key,const s_assembly& entry);
+
+	s_cachestats stats() const;
+};
+
+//////////////////////////////////////////////////////////////////////
+// Where the time goes. Given a Stats, the assembler and decompiler
+// add the wall time, calls, items and allocations of each phase to
+// it, and with trace keep each span as a Chrome trace event. The
+// allocations are those counted in thread_allocs by an operator new
+// that adds to it, as ezusbcc's does. One Stats may be shared by
+// threads.
+//////////////////////////////////////////////////////////////////////
+
+enum class Phase {
+	Tokenize,		// parse() of a line: lines
+	Pseudo,			// A pseudo op: pseudo ops
+	Encode,			// Opcodes and operands of a section: states
+	List,			// Listing of a section: states
+	Emit,			// C code or other output: sections
+	Scan,			// A gpif.c array: bytes
+	Unpack,			// A WaveData wave to text: waves
+};
+
+static const unsigned nphases = unsigned(Phase::Unpack) + 1;
+
+struct s_allocs {
+	unsigned long	count = 0;
+	unsigned long	bytes = 0;
+};
+
+extern thread_local s_allocs thread_allocs;
+
+struct s_phasestats {
+	unsigned long	calls = 0;
+	unsigned long	items = 0;
+	unsigned long	nanoseconds = 0;
+	unsigned long	allocs = 0;
+	unsigned long	allocbytes = 0;
+};
+
+struct s_traceevent {
+	const char	*name;
+	unsigned	tid;		// 1 for the first thread seen
+	uint64_t	start;		// Nanoseconds from the Stats' creation
+	uint64_t	duration;
+	unsigned long	items;
+};
+
+class Stats {
+	struct s_counters {
+		std::atomic<unsigned long> calls{0}, items{0}, nanoseconds{0}, allocs{0}, allocbytes{0};
+	};
+
+	bool		tracing;
+	std::chrono::steady_clock::time_point origin;
+	std::array<s_counters,nphases> counters;
+	std::mutex	mutex;		// Guards events
+	std::vector<s_traceevent> events;
+
+public:	Stats(bool trace = false);
+
+	Stats(const Stats&) = delete;
+	Stats& operator=(const Stats&) = delete;
+
+	// Nanoseconds since the Stats was created
+	uint64_t now() const {
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - origin).count();
+	}
+
+	void add(Phase phase,uint64_t nanoseconds,unsigned long items,const s_allocs& allocs);
+	void event(const char *name,uint64_t start,uint64_t end,unsigned long items = 0); // When tracing
+
+	bool trace() const {
+		return tracing;
+	}
+
+	s_phasestats phase(Phase phase) const;
+
+	// A table of the phases, and the events as Chrome trace JSON
+	std::string report() const;
+	std::string trace_json();
+};
+
+class Assembler {
+	s_options	opts;
+
+public:	Assembler(const s_options& opts = s_options()) : opts(opts) {}
+
+	s_assembly assemble(std::string_view src) const;
+
+	// Streams the output and listing, returning false on errors
+	bool assemble(std::string_view src,std::ostream& out,std::ostream& lst,std::vector<s_diagnostic>& diags) const;
+};
+
+class Decompiler {
+	s_options	opts;		// analyze adds the slot report
+
+public:	Decompiler(const s_options& opts = s_options()) : opts(opts) {}
+
+	// The WaveData[] (and FlowStates[]) of gpif.c source text
+	s_decompilation decompile(std::string_view gpif_c) const;
+
+	// Raw WaveData bytes (32 to 128), with optional FlowStates bytes
+	s_decompilation decompile(const uint8_t *wavedata,size_t size,
+		const uint8_t *flowstates = nullptr,size_t flowsize = 0) const;
+
+	// A gpif.c file, streaming the result
+	bool decompile_file(const char *path,std::ostream& out,std::vector<s_diagnostic>& diags) const;
+};
+
+//////////////////////////////////////////////////////////////////////
+// Duplicate waveforms of WaveData[], and the slots they need. Waves
+// are equivalent when they drive the same outputs and actions for
+// the same cycles under every RDY input. The selected waves (those
+// named by GPIFWFSELECT) that are equivalent share one slot, and the
+// slots kept are packed from 0, giving the compacted GPIFWFSELECT.
+//////////////////////////////////////////////////////////////////////
+
+struct s_waveslots {
+	unsigned	nwaves = 0;	// Waves in WaveData[], 1 to 4
+	std::array<int,4> identical;	// Same bytes as this lower wave, else -1
+	std::array<int,4> equivalent;	// Behaves as this lower wave, else -1
+	std::array<int,4> slot;		// Compacted slot, -1 when not selected
+	unsigned	nslots = 0;	// Slots still needed
+	unsigned	wfselect = 0xE4; // GPIFWFSELECT given
+	unsigned	compacted = 0xE4; // GPIFWFSELECT for the compacted slots
+};
+
+s_waveslots waveform_slots(const uint8_t *wavedata,size_t size,unsigned wfselect = 0xE4);
+
+//////////////////////////////////////////////////////////////////////
+// Synthesize the waveform with the fewest cycles per transaction that
+// meets a timing spec (see ezusbcc.cpp for its format), searching on
+// nthreads (0 for one per core). The source is ordinary assembler.
+//////////////////////////////////////////////////////////////////////
+
+struct s_synthesis {
+	bool		ok = false;
+	std::string	source;		// Assembler source
+	unsigned	cycles = 0;	// Per transaction, when not waiting
+	unsigned	states = 0;
+	unsigned long	searched = 0;	// State sequences evaluated
+	std::vector<s_diagnostic> diagnostics;
+};
+
+s_synthesis synthesize(std::string_view spec,unsigned nthreads = 0);
+
+//////////////////////////////////////////////////////////////////////
+// Compare the -o json metrics of a build with a baseline. The report
+// gives the MB/s, cycles and states of each changed waveform and its
+// changed states. A waveform that lost more than threshold percent of
+// its worst case MB/s, or that is gone, counts as a regression.
+//////////////////////////////////////////////////////////////////////
+
+struct s_comparison {
+	bool		ok = false;	// Both were read
+	unsigned	regressions = 0;
+	std::string	report;
+	std::vector<s_diagnostic> diagnostics;
+};
+
+s_comparison compare_metrics(std::string_view baseline,std::string_view current,double threshold = 0.0);
+
+//////////////////////////////////////////////////////////////////////
+// The patch that reloads the GPIF from one assembled set, as its
+// GpifInit() left it, to another: the waveform memory and register
+// bytes that differ, as a C table of spans with a GpifReload() that
+// copies them with the autopointers (format C), or as register
+// writes (format Regs). The report gives the bytes, the spans and
+// the estimated 8051 cycles, against those of a full GpifInit().
+//////////////////////////////////////////////////////////////////////
+
+struct s_reload {
+	bool		ok = false;
+	std::string	output;		// C code or register writes
+	std::string	report;
+	unsigned	changed = 0;	// Bytes that differ
+	unsigned	spans = 0;	// Autopointer runs
+	unsigned long	cycles = 0;	// Estimated 8051 cycles of GpifReload()
+	unsigned long	initcycles = 0;	// Of GpifInit() for the new set
+	std::vector<s_diagnostic> diagnostics;
+};
+
+s_reload reload_patch(std::string_view loaded,std::string_view src,OutFormat format = OutFormat::C);
+
+//////////////////////////////////////////////////////////////////////
+// A state as one word, branch << 24 | opcode << 16 | logfunc << 8 |
+// output, as the listing shows it. classify_states() gives for each
+// of n words why a decompile and assemble under env would not give
+// it back unchanged, as a mask of the State* reasons (0 when it
+// would). The words are done 8 at a time.
+//////////////////////////////////////////////////////////////////////
+
+enum : uint8_t {
+	StateReservedOpcode = 0x01,	// Opcode bits 7:6
+	StateReservedBranch = 0x02,	// DP branch bit 6
+	StateNdpLogfunc	= 0x04,		// NDP with a logfunc byte
+	StateNoTerm	= 0x08,		// DP term 7 (INTRDY) without .GPIFREADYCFG7 1
+	StateNoOutput	= 0x10,		// Output bits 7:6 without .TRICTL 1
+};
+
+struct s_stateenv {
+	unsigned	trictl = 0;	// The pseudo ops
+	unsigned	gpifreadycfg5 = 0;
+	unsigned	epxgpifflgsel = 0; // 0 PF, 1 EF, 2 FF
+	unsigned	gpifreadycfg7 = 0;
+};
+
+void classify_states(const uint32_t *words,size_t n,const s_stateenv& env,uint8_t *reasons);
+
+//////////////////////////////////////////////////////////////////////
+// Find the waveform tables in firmware: blocks of 1 to 4 waveforms
+// (32 to 128 bytes) whose states are all legal encodings and reach
+// idle state 7, each decompiled. scan_firmware() memory maps an Intel
+// HEX (.hex, .ihx) or binary image and scans it.
+//////////////////////////////////////////////////////////////////////
+
+struct s_firmhit {
+	unsigned long	address;	// Of the table in the image
+	unsigned	size;		// 32, 64, 96 or 128 bytes
+	std::string	text;		// Decompiled
+};
+
+struct s_firmscan {
+	bool		ok = false;
+	unsigned long	bytes = 0;	// Image bytes scanned
+	std::vector<s_firmhit> hits;
+	std::vector<s_diagnostic> diagnostics;
+};
+
+std::vector<s_firmhit> find_waveforms(const uint8_t *data,size_t size,unsigned long address = 0);
+s_firmscan scan_firmware(const char *path);
+
+// Read a simulation stimulus file, returning false with the message
+bool load_stimulus(const char *path,std::vector<s_stimulus>& stim,std::string& error);
+
+} // namespace ezusbcc
+
+#endif // EZUSBCC_HPP
+
+// End ezusbcc.hpp
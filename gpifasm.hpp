@@ -0,0 +1,489 @@
+//////////////////////////////////////////////////////////////////////
+// gpifasm.hpp -- Compile time GPIF assembler for EZ-USB
+///////////////////////////////////////////////////////////////////////
+//
+// A header only, constexpr version of the ezusbcc encoder, for host
+// side code that embeds waveform tables. The source format is the
+// same as for ezusbcc (see ezusbcc.cpp), including the pseudo ops
+// and .WAVEFORM sections:
+//
+//	#include "gpifasm.hpp"
+//
+//	constexpr auto fifowr = gpifasm::assemble_waveform(R"(
+//		D	3 CTL2 CTL0
+//		D	1 CTL2 CTL1 CTL0
+//		JN	RDY0 AND RDY0 CTL2 CTL1 CTL0 $7 $7
+//	)");
+//
+// assemble_waveform() returns the std::array<uint8_t,32> that ezusbcc
+// emits as waveformN[32] (rows of LenBr, Opcode, Output and LFun) for
+// a source with one section. assemble_wavedata() returns the complete
+// std::array<uint8_t,128> WaveData for waveforms 0 to 3.
+// The .FLOW pseudo ops are accepted, but the FlowStates[] bytes are
+// only produced by ezusbcc. So are the timing pseudo ops, which only
+// ezusbcc checks.
+//
+// When the result initializes a constexpr variable, all of the work
+// is done by the compiler. An error in the source stops the constant
+// evaluation, and the compiler reports the failing gpifasm::check()
+// call with its message. Evaluated at runtime, the same error throws
+// std::invalid_argument, giving the message and source line.
+//
+// The tables and state packing are those of gpiftab.hpp, which the
+// ezusbcc library uses as well. Requires C++14.
+
+#ifndef GPIFASM_HPP
+#define GPIFASM_HPP
+
+#if __cplusplus < 201402L
+#error "gpifasm.hpp requires C++14"
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <array>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#include "gpiftab.hpp"
+
+namespace gpifasm {
+
+//////////////////////////////////////////////////////////////////////
+// Any failed check is a compile time error in a constant expression,
+// or throws std::invalid_argument at runtime.
+//////////////////////////////////////////////////////////////////////
+
+constexpr void
+check(bool ok,const char *msg,unsigned line) {
+	if ( !ok )
+		throw std::invalid_argument(std::string(msg) + " (line " + std::to_string(line) + ")");
+}
+
+struct token {
+	const char	*p = nullptr;
+	size_t		n = 0;
+
+	constexpr bool empty() const {
+		return n == 0;
+	}
+
+	constexpr bool operator==(const char *s) const {
+		size_t ux = 0;
+
+		for ( ; ux < n; ++ux )
+			if ( s[ux] != p[ux] )
+				return false;
+		return s[ux] == 0;
+	}
+};
+
+//////////////////////////////////////////////////////////////////////
+// Settings from the pseudo ops that affect the encoding
+//////////////////////////////////////////////////////////////////////
+
+struct environ {
+	unsigned	trictl = 0;
+	unsigned	gpifreadycfg5 = 0;
+	unsigned	gpifreadycfg7 = 0;
+	unsigned	epxgpifflgsel = 0;	// 0=PF, 1=EF, 2=FF
+	unsigned	waveform = 0;
+};
+
+//////////////////////////////////////////////////////////////////////
+// Lookups in the tables of gpiftab.hpp, as libezusbcc builds its maps
+// from. Each returns -1 when the name is not valid in the environment.
+//////////////////////////////////////////////////////////////////////
+
+constexpr int
+term(token t,const environ& env) {
+	return gpiftab::term_code(t.p,t.n,env.gpifreadycfg5,env.epxgpifflgsel,env.gpifreadycfg7);
+}
+
+constexpr int
+output(token t,const environ& env) {
+	return gpiftab::output_bit(t.p,t.n,env.trictl);
+}
+
+constexpr int
+function(token t) {
+	return gpiftab::function_code(t.p,t.n);
+}
+
+//////////////////////////////////////////////////////////////////////
+// One encoded state, packed by the gpiftab.hpp sw_encode functions
+//////////////////////////////////////////////////////////////////////
+
+struct state {
+	uint8_t		branch = 0;
+	uint8_t		opcode = 0;
+	uint8_t		logfunc = 0;
+	uint8_t		output = 0;
+	unsigned	line = 0;		// Source line
+};
+
+struct section {
+	environ		env;
+	state		states[8] = {};
+	unsigned	nstates = 0;
+};
+
+struct image {
+	section		sections[4] = {};
+	unsigned	nsections = 0;
+};
+
+//////////////////////////////////////////////////////////////////////
+// Line oriented tokenizer over the source text
+//////////////////////////////////////////////////////////////////////
+
+class lexer {
+	const char	*p;
+	const char	*end;
+
+	constexpr void skip_blanks() {
+		while ( p < end && (*p == ' ' || *p == '\t' || *p == '\r') )
+			++p;
+	}
+
+public:	unsigned	line = 1;
+
+	constexpr lexer(const char *p,const char *end) : p(p), end(end) {}
+
+	constexpr bool done() const {
+		return p >= end;
+	}
+
+	// True when only a comment or nothing remains on the line
+	constexpr bool eol() {
+		skip_blanks();
+		return p >= end || *p == '\n' || *p == ';' || *p == 0;
+	}
+
+	constexpr token next() {
+		token t;
+
+		skip_blanks();
+		t.p = p;
+		while ( p < end && *p != ' ' && *p != '\t' && *p != '\r'
+		  && *p != '\n' && *p != ';' && *p != 0 )
+			++p;
+		t.n = p - t.p;
+		return t;
+	}
+
+	constexpr void next_line() {
+		while ( p < end && *p != '\n' && *p != 0 )
+			++p;
+		if ( p < end && *p == '\n' ) {
+			++p;
+			++line;
+		} else	p = end;
+	}
+};
+
+//////////////////////////////////////////////////////////////////////
+// A decimal or 0x hex number up to 0xFFFF, as ezusbcc takes them
+//////////////////////////////////////////////////////////////////////
+
+constexpr unsigned
+number(token t,unsigned line) {
+	unsigned long value = 0;
+
+	check(!t.empty(),"Missing number",line);
+	check(gpiftab::number(t.p,t.n,value,0xFFFF),"Invalid number",line);
+	return unsigned(value);
+}
+
+//////////////////////////////////////////////////////////////////////
+// Apply a pseudo op to env, returning false if t is not one
+//////////////////////////////////////////////////////////////////////
+
+constexpr bool
+pseudo_op(token t,lexer& lex,environ& env,bool& waveform) {
+	unsigned value = 0;
+
+	waveform = false;
+	if ( t.empty() || t.p[0] != '.' )
+		return false;
+
+	// Flow state settings are registers, not waveform memory
+	if ( t == ".FLOWSTATE" || t == ".FLOWLOGIC" || t == ".FLOWEQ0CTL" || t == ".FLOWEQ1CTL"
+	  || t == ".FLOWHOLDOFF" || t == ".FLOWSTB" || t == ".FLOWSTBEDGE" || t == ".FLOWSTBHPERIOD" ) {
+		check(!lex.eol(),"Missing operand for pseudo op",lex.line);
+		while ( !lex.eol() )
+			lex.next();
+		return true;
+	}
+
+	// Timing constraints are checked by ezusbcc
+	if ( t == ".MINPULSE" || t == ".SETUP" || t == ".HOLD" ) {
+		check(!lex.eol(),"Missing operand for pseudo op",lex.line);
+		while ( !lex.eol() )
+			lex.next();
+		return true;
+	}
+
+	token arg = lex.next();
+
+	check(!arg.empty() && lex.eol(),"Only one operand valid for pseudo op",lex.line);
+
+	if ( t == ".EPXGPIFFLGSEL" ) {
+		int sel = gpiftab::flag_code(arg.p,arg.n);
+
+		check(sel >= 0,"Operand of .EPXGPIFFLGSEL must be PF, EF, or FF",lex.line);
+		env.epxgpifflgsel = sel;
+		return true;
+	}
+
+	value = number(arg,lex.line);
+	if ( t == ".TRICTL" || t == ".GPIFREADYCFG5" || t == ".GPIFREADYCFG7"
+	  || t == ".WORDWIDE" || t == ".ASYNC" || t == ".AUTOCOMMIT" ) {
+		check(value <= 1,"Invalid operand for pseudo op",lex.line);
+		if ( t == ".TRICTL" )
+			env.trictl = value;
+		else if ( t == ".GPIFREADYCFG5" )
+			env.gpifreadycfg5 = value;
+		else if ( t == ".GPIFREADYCFG7" )
+			env.gpifreadycfg7 = value;
+	} else if ( t == ".EP" ) {
+		check(value <= 8 && !(value & 1),"Invalid operand for .EP",lex.line);
+	} else if ( t == ".EPBUF" ) {
+		check(value >= 2 && value <= 4,"Invalid operand for .EPBUF",lex.line);
+	} else if ( t == ".IFCLK" ) {
+		check(value == 30 || value == 48,"Invalid operand for .IFCLK",lex.line);
+	} else if ( t == ".IDLECTL" ) {
+		check(value <= 0xFF,"Invalid operand for .IDLECTL",lex.line);
+	} else	{
+		check(t == ".WAVEFORM","Unknown pseudo op",lex.line);
+		env.waveform = value;
+		waveform = true;
+	}
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Encode one state from its opcode and operands
+//////////////////////////////////////////////////////////////////////
+
+constexpr state
+encode(token opc,lexer& lex,const environ& env) {
+	state st;
+	unsigned statex = 0;
+
+	bool reexecute = false;
+
+	st.line = lex.line;
+	for ( size_t ux=0; ux < opc.n; ++ux ) {
+		const int bit = gpiftab::opcode_bit(opc.p[ux]);
+
+		if ( bit >= 0 ) {
+			st.opcode |= bit;
+		} else	{
+			check(opc.p[ux] == '*' && (st.opcode & gpiftab::SwDp),"Unknown opcode",lex.line);
+			reexecute = true;
+		}
+	}
+
+	if ( !(st.opcode & gpiftab::SwDp) ) {
+		st.branch = 1;			// Default to a 1-count
+		while ( !lex.eol() ) {
+			token t = lex.next();
+
+			if ( t.p[0] >= '0' && t.p[0] <= '9' ) {
+				unsigned count = number(t,lex.line);
+
+				check(count <= 256,"Invalid count value",lex.line);
+				st.branch = uint8_t(count);	// 256 is 0
+			} else	{
+				int bit = output(t,env);
+
+				check(bit >= 0,"Invalid output operand",lex.line);
+				st.output |= 1 << bit;
+			}
+		}
+		return st;
+	}
+
+	check(!lex.eol(),"missing operand A func B",lex.line);
+	int a = term(lex.next(),env);
+	check(a >= 0,"Invalid operand A",lex.line);
+	check(!lex.eol(),"missing operand A func B",lex.line);
+	int f = function(lex.next());
+	check(f >= 0,"Invalid function",lex.line);
+	check(!lex.eol(),"missing operand A func B",lex.line);
+	int b = term(lex.next(),env);
+	check(b >= 0,"Invalid operand B",lex.line);
+
+	st.logfunc = gpiftab::sw_encode_logfunc(a,f,b);
+
+	unsigned branch0 = 7, branch1 = 7;	// Default to state 7
+
+	while ( !lex.eol() ) {
+		token t = lex.next();
+
+		if ( t.p[0] == '$' ) {
+			token n;
+
+			n.p = t.p + 1;
+			n.n = t.n - 1;
+			unsigned target = number(n,lex.line);
+
+			check(target <= 7,"invalid target state",lex.line);
+			check(statex < 2,"Too many target states",lex.line);
+			if ( statex++ == 0 )
+				branch0 = target;
+			else	branch1 = target;
+		} else	{
+			int bit = output(t,env);
+
+			check(bit >= 0,"Invalid output operand",lex.line);
+			st.output |= 1 << bit;
+		}
+	}
+	check(statex == 2,"Branch0 and/or branch1 states were not specified.",lex.line);
+	st.branch = gpiftab::sw_encode_branch(branch0,branch1,reexecute);
+	return st;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Assemble all sections of the source. As for ezusbcc, each .WAVEFORM
+// after the first starts a new section, and the pseudo ops before the
+// first .WAVEFORM are the defaults for every section.
+//////////////////////////////////////////////////////////////////////
+
+constexpr image
+assemble(const char *src,size_t n) {
+	image im;
+	lexer lex(src,src + n);
+	environ defaults;
+	bool named = false;
+
+	im.nsections = 1;
+	while ( !lex.done() ) {
+		if ( !lex.eol() ) {
+			section *sec = &im.sections[im.nsections-1];
+			token opc = lex.next();
+			bool waveform = false;
+			environ env = sec->env;
+
+			if ( pseudo_op(opc,lex,env,waveform) ) {
+				if ( waveform ) {
+					if ( named ) {
+						check(im.nsections < 4,"Too many .WAVEFORM sections",lex.line);
+						sec = &im.sections[im.nsections++];
+						sec->env = defaults;
+					}
+					named = true;
+					sec->env.waveform = env.waveform;
+				} else	{
+					if ( !named )
+						defaults = env;
+					sec->env = env;
+				}
+			} else	{
+				check(sec->nstates < 7,"Too many states. Limit is 7 states max.",lex.line);
+				sec->states[sec->nstates++] = encode(opc,lex,sec->env);
+			}
+		}
+		lex.next_line();
+	}
+
+	for ( unsigned sx=0; sx < im.nsections; ++sx ) {
+		const section& sec = im.sections[sx];
+
+		for ( unsigned ux=0; ux < sec.nstates; ++ux ) {
+			const state& st = sec.states[ux];
+
+			if ( st.opcode & gpiftab::SwDp ) {
+				unsigned b0 = st.branch & 7, b1 = st.branch >> 3 & 7;
+
+				check((b0 == 7 || b0 <= sec.nstates) && (b1 == 7 || b1 <= sec.nstates),
+					"invalid target state",st.line);
+			}
+		}
+		for ( unsigned ux=0; ux < sx; ++ux )
+			check(im.sections[ux].env.waveform != sec.env.waveform,
+				"Each .WAVEFORM must be a different waveform 0 to 3",0);
+		check(im.nsections == 1 || sec.env.waveform <= 3,
+			"Each .WAVEFORM must be a different waveform 0 to 3",0);
+	}
+	return im;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Lay out a section as rows of LenBr, Opcode, Output and LFun
+//////////////////////////////////////////////////////////////////////
+
+constexpr uint8_t
+row_byte(const section& sec,size_t ux) {
+	const state& st = sec.states[ux % 8];
+
+	switch ( ux / 8 ) {
+	case 0:
+		return st.branch;
+	case 1:
+		return st.opcode;
+	case 2:
+		return st.output;
+	default:
+		return st.logfunc;
+	}
+}
+
+constexpr uint8_t
+wavedata_byte(const image& im,size_t ux) {
+	for ( unsigned sx=0; sx < im.nsections; ++sx )
+		if ( im.sections[sx].env.waveform == ux / 32 )
+			return row_byte(im.sections[sx],ux % 32);
+	return 0;
+}
+
+template<size_t... I>
+constexpr std::array<uint8_t,32>
+waveform_array(const image& im,std::index_sequence<I...>) {
+	return {{ row_byte(im.sections[0],I)... }};
+}
+
+template<size_t... I>
+constexpr std::array<uint8_t,128>
+wavedata_array(const image& im,std::index_sequence<I...>) {
+	return {{ wavedata_byte(im,I)... }};
+}
+
+constexpr std::array<uint8_t,32>
+assemble_waveform(const char *src,size_t n) {
+	image im = assemble(src,n);
+
+	check(im.nsections == 1,"Source has more than one .WAVEFORM section",0);
+	return waveform_array(im,std::make_index_sequence<32>());
+}
+
+constexpr std::array<uint8_t,128>
+assemble_wavedata(const char *src,size_t n) {
+	image im = assemble(src,n);
+
+	for ( unsigned sx=0; sx < im.nsections; ++sx )
+		check(im.sections[sx].env.waveform <= 3,"Waveform must be 0 to 3",0);
+	return wavedata_array(im,std::make_index_sequence<128>());
+}
+
+template<size_t N>
+constexpr std::array<uint8_t,32>
+assemble_waveform(const char (&src)[N]) {
+	return assemble_waveform(src,N - 1);
+}
+
+template<size_t N>
+constexpr std::array<uint8_t,128>
+assemble_wavedata(const char (&src)[N]) {
+	return assemble_wavedata(src,N - 1);
+}
+
+} // namespace gpifasm
+
+#endif // GPIFASM_HPP
+
+// End gpifasm.hpp
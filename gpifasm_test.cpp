@@ -0,0 +1,124 @@
+//////////////////////////////////////////////////////////////////////
+// gpifasm_test.cpp -- Check gpifasm.hpp against ezusbcc
+///////////////////////////////////////////////////////////////////////
+//
+// The static_asserts hold the bytes that ezusbcc gives for the test
+// sources, so a gpifasm.hpp that encodes them differently doesn't
+// compile. At run time, the waveformN[32] ezusbcc wrote for a source
+// is read from stdin and compared with gpifasm's, for any source:
+//
+//	$ ./ezusbcc <testwave.wvf 2>/dev/null | ./gpifasm_test testwave.wvf
+//
+// Built as C++14, the oldest standard gpifasm.hpp supports.
+
+#include <stdio.h>
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+#include "gpifasm.hpp"
+
+// std::array's == isn't constexpr before C++20
+constexpr bool
+same(const std::array<uint8_t,32>& a,const std::array<uint8_t,32>& b) {
+	for ( size_t bx=0; bx < a.size(); ++bx )
+		if ( a[bx] != b[bx] )
+			return false;
+	return true;
+}
+
+// testwave.wvf
+constexpr auto testwave = gpifasm::assemble_waveform(R"(
+	.TRICTL		1		; Assume TRICTL=1
+	.EP		4		; Assume for Endpoint 4
+	.WAVEFORM 	7		; Name this waveform7
+	.EPXGPIFFLGSEL	EF
+	SG+DN				; Simple NDP
+	J	RDY1 AND RDY1 $1 $0	; DP example
+	S+GDN	1 OE3 OE1 CTL3 CTL2
+	Z
+	JS+GDN*	RDY0 AND RDY4 $1 $3
+	JSG	RDY0 XOR RDY2 OE3 CTL2 $1 $7
+	JSG	RDY0 /AND EF OE3 CTL1 $1 $5
+)");
+
+static_assert(same(testwave,std::array<uint8_t,32>{ {
+	0x01,0x01,0x01,0x01,0x99,0x39,0x29,0x00,
+	0x3E,0x01,0x3E,0x00,0x3F,0x31,0x31,0x00,
+	0x00,0x00,0xAC,0x00,0x00,0x84,0x82,0x00,
+	0x00,0x09,0x00,0x00,0x04,0x82,0xC6,0x00,
+} }),"testwave.wvf differs from ezusbcc");
+
+// testintrdy.wvf: INTRDY with PF, and hex numbers
+constexpr auto testintrdy = gpifasm::assemble_waveform(R"(
+	.EPXGPIFFLGSEL	PF
+	.GPIFREADYCFG7	1
+	.IDLECTL	0x07
+	.WAVEFORM	2
+	D	0x03 CTL2 CTL0
+	D	0x1 CTL2 CTL1 CTL0
+	JN	INTRDY AND PF CTL2 CTL1 CTL0 $7 $0x7
+)");
+
+static_assert(same(testintrdy,std::array<uint8_t,32>{ {
+	0x03,0x01,0x3F,0x00,0x00,0x00,0x00,0x00,
+	0x02,0x02,0x05,0x00,0x00,0x00,0x00,0x00,
+	0x05,0x07,0x07,0x00,0x00,0x00,0x00,0x00,
+	0x00,0x00,0x3E,0x00,0x00,0x00,0x00,0x00,
+} }),"testintrdy.wvf differs from ezusbcc");
+
+//////////////////////////////////////////////////////////////////////
+// The waveformN[32] of a source as ezusbcc writes it
+//////////////////////////////////////////////////////////////////////
+
+static std::string
+waveform_c(const std::string& src) {
+	const gpifasm::image im = gpifasm::assemble(src.data(),src.size());
+	const std::array<uint8_t,32> bytes = gpifasm::assemble_waveform(src.data(),src.size());
+	std::ostringstream out;
+	char hex[8];
+
+	out << "static unsigned char waveform" << im.sections[0].env.waveform << "[32] = { \n";
+	for ( unsigned bx=0; bx < bytes.size(); ++bx ) {
+		snprintf(hex,sizeof hex,"0x%02X,",bytes[bx]);
+		out << (bx % 8 ? "" : "\t") << hex << (bx % 8 == 7 ? "\n" : "");
+	}
+	out << "};\n\n";
+	return out.str();
+}
+
+int
+main(int argc,char **argv) {
+	if ( argc != 2 ) {
+		std::cerr << "Usage: ezusbcc <source.wvf | " << argv[0] << " source.wvf\n";
+		return 1;
+	}
+
+	std::ifstream in(argv[1]);
+	std::stringstream src, expected;
+
+	if ( !in ) {
+		std::cerr << argv[1] << ": Unable to open\n";
+		return 1;
+	}
+	src << in.rdbuf();
+	expected << std::cin.rdbuf();
+
+	try	{
+		const std::string got = waveform_c(src.str());
+
+		if ( got != expected.str() ) {
+			std::cerr << argv[1] << ": gpifasm.hpp gives\n" << got << "but ezusbcc gives\n" << expected.str();
+			return 1;
+		}
+	} catch ( const std::invalid_argument& e ) {
+		std::cerr << argv[1] << ": " << e.what() << '\n';
+		return 1;
+	}
+	std::cout << argv[1] << ": gpifasm.hpp matches ezusbcc\n";
+	return 0;
+}
+
+// End gpifasm_test.cpp
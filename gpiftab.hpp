@@ -0,0 +1,271 @@
+//////////////////////////////////////////////////////////////////////
+// gpiftab.hpp -- GPIF state encoding tables shared by libezusbcc and
+// gpifasm.hpp
+///////////////////////////////////////////////////////////////////////
+//
+// The names of the DP terms, outputs, logic functions and FIFO flags
+// in each environment, the opcode letters, the numbers of the source
+// and the packing of a state's bytes. libezusbcc builds its lookup
+// maps from these, and gpifasm.hpp uses them in constant expressions,
+// so the two assemblers can't disagree.
+//
+// Requires C++14.
+
+#ifndef GPIFTAB_HPP
+#define GPIFTAB_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace gpiftab {
+
+//////////////////////////////////////////////////////////////////////
+// Length n name p equal to the C string s
+//////////////////////////////////////////////////////////////////////
+
+constexpr bool
+same(const char *p,size_t n,const char *s) {
+	size_t ux = 0;
+
+	for ( ; ux < n; ++ux )
+		if ( s[ux] != p[ux] )
+			return false;
+	return s[ux] == 0;
+}
+
+//////////////////////////////////////////////////////////////////////
+// The name of DP term code 0 to 7, else nullptr when the environment
+// gives it none: RDY5 is TC with .GPIFREADYCFG5 1, 6 is the flag of
+// .EPXGPIFFLGSEL (0 PF, 1 EF, 2 FF), and INTRDY needs .GPIFREADYCFG7 1
+//////////////////////////////////////////////////////////////////////
+
+constexpr const char *
+flag_name(unsigned epxgpifflgsel) {
+	return epxgpifflgsel == 0 ? "PF" : epxgpifflgsel == 1 ? "EF" : epxgpifflgsel == 2 ? "FF" : nullptr;
+}
+
+constexpr const char *
+term_name(unsigned code,unsigned gpifreadycfg5,unsigned epxgpifflgsel,unsigned gpifreadycfg7) {
+	switch ( code ) {
+	case 0:
+		return "RDY0";
+	case 1:
+		return "RDY1";
+	case 2:
+		return "RDY2";
+	case 3:
+		return "RDY3";
+	case 4:
+		return "RDY4";
+	case 5:
+		return gpifreadycfg5 ? "TC" : "RDY5";
+	case 6:
+		return flag_name(epxgpifflgsel);
+	case 7:
+		return gpifreadycfg7 ? "INTRDY" : nullptr;
+	default:
+		return nullptr;
+	}
+}
+
+//////////////////////////////////////////////////////////////////////
+// The name of output bit 0 to 7: CTL0 to CTL5, or with .TRICTL 1,
+// CTL0 to CTL3 and OE0 to OE3. nullptr for bits without one.
+//////////////////////////////////////////////////////////////////////
+
+constexpr const char *
+output_name(unsigned bit,unsigned trictl) {
+	switch ( bit ) {
+	case 0:
+		return "CTL0";
+	case 1:
+		return "CTL1";
+	case 2:
+		return "CTL2";
+	case 3:
+		return "CTL3";
+	case 4:
+		return trictl ? "OE0" : "CTL4";
+	case 5:
+		return trictl ? "OE1" : "CTL5";
+	case 6:
+		return trictl ? "OE2" : nullptr;
+	case 7:
+		return trictl ? "OE3" : nullptr;
+	default:
+		return nullptr;
+	}
+}
+
+constexpr const char *
+function_name(unsigned code) {
+	return code == 0 ? "AND" : code == 1 ? "OR" : code == 2 ? "XOR" : code == 3 ? "/AND" : nullptr;
+}
+
+//////////////////////////////////////////////////////////////////////
+// The reverse lookups, each -1 when the name is not valid
+//////////////////////////////////////////////////////////////////////
+
+constexpr int
+term_code(const char *p,size_t n,unsigned gpifreadycfg5,unsigned epxgpifflgsel,unsigned gpifreadycfg7) {
+	for ( unsigned code=0; code < 8; ++code ) {
+		const char *name = term_name(code,gpifreadycfg5,epxgpifflgsel,gpifreadycfg7);
+
+		if ( name && same(p,n,name) )
+			return code;
+	}
+	return -1;
+}
+
+constexpr int
+output_bit(const char *p,size_t n,unsigned trictl) {
+	for ( unsigned bit=0; bit < 8; ++bit ) {
+		const char *name = output_name(bit,trictl);
+
+		if ( name && same(p,n,name) )
+			return bit;
+	}
+	return -1;
+}
+
+constexpr int
+function_code(const char *p,size_t n) {
+	for ( unsigned code=0; code < 4; ++code )
+		if ( same(p,n,function_name(code)) )
+			return code;
+	return -1;
+}
+
+constexpr int
+flag_code(const char *p,size_t n) {
+	for ( unsigned sel=0; sel < 3; ++sel )
+		if ( same(p,n,flag_name(sel)) )
+			return sel;
+	return -1;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Opcode bits, and the bit of each letter of an opcode (Z for none).
+// The '*' of a re-executed DP state is in the branch byte, so like
+// any other letter it gives -1.
+//////////////////////////////////////////////////////////////////////
+
+enum : unsigned {
+	SwDp	= 0x01,
+	SwData	= 0x02,
+	SwNext	= 0x04,
+	SwIncad	= 0x08,
+	SwGint	= 0x10,
+	SwSgl	= 0x20,
+};
+
+constexpr int
+opcode_bit(char c) {
+	switch ( c ) {
+	case 'J':
+		return SwDp;
+	case 'D':
+		return SwData;
+	case 'N':
+		return SwNext;
+	case '+':
+		return SwIncad;
+	case 'G':
+		return SwGint;
+	case 'S':
+		return SwSgl;
+	case 'Z':
+		return 0;
+	default:
+		return -1;
+	}
+}
+
+//////////////////////////////////////////////////////////////////////
+// A decimal or 0x hex number, false unless it is all digits or the
+// value exceeds limit
+//////////////////////////////////////////////////////////////////////
+
+constexpr bool
+number(const char *p,size_t n,unsigned long& value,unsigned long limit = ~0ul) {
+	unsigned base = 10;
+	size_t ux = 0;
+
+	value = 0;
+	if ( n > 2 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X') ) {
+		base = 16;
+		ux = 2;
+	}
+	if ( ux >= n )
+		return false;
+	for ( ; ux < n; ++ux ) {
+		const char c = p[ux];
+		unsigned digit = 0;
+
+		if ( c >= '0' && c <= '9' )
+			digit = c - '0';
+		else if ( base == 16 && c >= 'a' && c <= 'f' )
+			digit = c - 'a' + 10;
+		else if ( base == 16 && c >= 'A' && c <= 'F' )
+			digit = c - 'A' + 10;
+		else	return false;
+		if ( value > (limit - digit) / base )
+			return false;
+		value = value * base + digit;
+	}
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////
+// State words: the 4 bytes of a state as one uint32_t, in the order
+// they are listed (branch, opcode, logfunc, output). The fields are
+// packed with explicit shifts and masks, which unlike the bitfields
+// of libezusbcc's unions don't depend on the compiler's layout.
+// ezverify checks that the two agree.
+//////////////////////////////////////////////////////////////////////
+
+constexpr uint32_t
+sw_pack(unsigned branch,unsigned opcode,unsigned logfunc,unsigned output) {
+	return uint32_t(branch & 0xFF) << 24 | uint32_t(opcode & 0xFF) << 16
+		| uint32_t(logfunc & 0xFF) << 8 | uint32_t(output & 0xFF);
+}
+
+constexpr unsigned sw_branch(uint32_t w)  { return w >> 24; }
+constexpr unsigned sw_opcode(uint32_t w)  { return (w >> 16) & 0xFF; }
+constexpr unsigned sw_logfunc(uint32_t w) { return (w >> 8) & 0xFF; }
+constexpr unsigned sw_output(uint32_t w)  { return w & 0xFF; }
+
+constexpr uint8_t
+sw_encode_branch(unsigned branch0,unsigned branch1,bool reexecute) {
+	return (branch0 & 7) | (branch1 & 7) << 3 | unsigned(reexecute) << 7;
+}
+
+constexpr uint8_t
+sw_encode_opcode(bool dp,bool data,bool next,bool incad,bool gint,bool sgl) {
+	return (dp ? SwDp : 0) | (data ? SwData : 0) | (next ? SwNext : 0)
+		| (incad ? SwIncad : 0) | (gint ? SwGint : 0) | (sgl ? SwSgl : 0);
+}
+
+constexpr uint8_t
+sw_encode_logfunc(unsigned terma,unsigned lfunc,unsigned termb) {
+	return (termb & 7) | (terma & 7) << 3 | (lfunc & 3) << 6;
+}
+
+constexpr unsigned sw_branch0(uint32_t w)   { return (w >> 24) & 7; }
+constexpr unsigned sw_branch1(uint32_t w)   { return (w >> 27) & 7; }
+constexpr bool	   sw_reexecute(uint32_t w) { return (w >> 31) & 1; }
+constexpr bool	   sw_dp(uint32_t w)	    { return (w >> 16) & 1; }
+constexpr unsigned sw_termb(uint32_t w)	    { return (w >> 8) & 7; }
+constexpr unsigned sw_terma(uint32_t w)	    { return (w >> 11) & 7; }
+constexpr unsigned sw_lfunc(uint32_t w)	    { return (w >> 14) & 3; }
+
+static_assert(sw_branch0(sw_pack(sw_encode_branch(5,3,true),0,0,0)) == 5
+	&& sw_branch1(sw_pack(sw_encode_branch(5,3,true),0,0,0)) == 3
+	&& sw_terma(sw_pack(0,0,sw_encode_logfunc(6,2,1),0)) == 6
+	&& sw_lfunc(sw_pack(0,0,sw_encode_logfunc(6,2,1),0)) == 2,"State word fields");
+
+} // namespace gpiftab
+
+#endif // GPIFTAB_HPP
+
+// End gpiftab.hpp
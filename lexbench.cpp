@@ -0,0 +1,259 @@
+//////////////////////////////////////////////////////////////////////
+// lexbench.cpp -- Compare the istream parse() with the mmap Lexer
+///////////////////////////////////////////////////////////////////////
+//
+// Generates a machine written source of the given size (default 16
+// MB) in a temporary file, then tokenizes it with the istream based
+// parse() that ezusbcc used to have, and with the Lexer of lexer.hpp.
+// The Lexer is also timed under libezusbcc's parse() into s_instr,
+// and with the states kept in a vector per .WAVEFORM the way the
+// assembler keeps them. Reports MB/s, lines/s and heap allocations
+// per line for each.
+//
+// Some comments and tokens of the source (banner lines of dashes)
+// are longer than a short std::string holds in place, so that copying
+// them costs the istream parser an allocation, as on real sources.
+//
+//	$ ./lexbench [megabytes]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <new>
+
+#include "libezusbcc.hpp"
+
+using namespace ezusbcc;
+
+static unsigned long n_allocs = 0;
+
+void *
+operator new(size_t size) {
+	void *p = malloc(size ? size : 1);
+
+	if ( !p )
+		throw std::bad_alloc();
+	++n_allocs;
+	return p;
+}
+
+void
+operator delete(void *p) noexcept {
+	free(p);
+}
+
+void
+operator delete(void *p,size_t) noexcept {
+	free(p);
+}
+
+//////////////////////////////////////////////////////////////////////
+// The former istream based parse() of ezusbcc.cpp
+//////////////////////////////////////////////////////////////////////
+
+struct s_oldinstr {
+	std::string		stropcode;
+	std::vector<std::string> stroperands;
+	std::string		strcomment;
+
+	void clear() {
+		stropcode.clear();
+		stroperands.clear();
+		strcomment.clear();
+	};
+};
+
+static bool
+oldparse(std::istream& istr,s_oldinstr& instr) {
+	std::stringstream ss;
+	char pk;
+
+	instr.clear();
+
+	for (;;) {
+		if ( istr.eof() )
+			return false;
+		istr >> instr.stropcode;
+		if ( instr.stropcode[0] != ';' && !instr.stropcode.empty() )
+			break;
+		while ( !istr.eof() && istr.get() != '\n' )
+			;
+	}
+
+	while ( !istr.eof() && (pk = istr.peek()) != '\n' ) {
+		std::string token;
+
+		istr >> token;
+		if ( token[0] != ';' ) {
+			instr.stroperands.push_back(token);
+		} else	{
+			while ( (pk = istr.peek()) != '\n' ) {
+				ss << pk;
+				istr.get();
+			}
+			if ( ss.tellp() > 0 )
+				instr.strcomment = ss.str();
+			break;
+		}
+	}
+
+	while ( !istr.eof() ) {
+		if ( istr.get() == '\n' )
+			break;
+	}
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Write a source of about mbytes MB, returning its line count
+//////////////////////////////////////////////////////////////////////
+
+static unsigned long
+generate(const char *path,unsigned mbytes) {
+	static const char *lines[] = {
+		"; Sweep step %lu\n",
+		"\t.WAVEFORM\t%lu\t\t; Slot\n",
+		"\t.TRICTL\t\t0\n",
+		"\tZ\t%lu CTL2 CTL1 CTL0\t; Idle levels\n",
+		"\tD\t%lu CTL1\n",
+		"\tJ\tRDY0 AND RDY1 CTL2 CTL1 CTL0 $%lu $7\t; Wait for ready\n",
+		"\tS+GDN\t1 CTL3 CTL2\n",
+		";------------------------------------------------------------\n",
+		"; Strobe CTL3 once the FIFO has room for another packet\n",
+		"\tJ\tRDY0 AND RDY1 CTL2 $%lu $7\t; Hold off while the host drains the FIFO\n",
+		"\t.EPXGPIFFLGSEL\tPF\t\t; Programmable flag of the endpoint\n",
+	};
+	const size_t nlines = sizeof lines / sizeof lines[0];
+	const unsigned long target = mbytes * 1024ul * 1024ul;
+	unsigned long size = 0, count = 0;
+	FILE *f = fopen(path,"w");
+
+	if ( !f ) {
+		perror(path);
+		exit(1);
+	}
+	while ( size < target ) {
+		int n = fprintf(f,lines[count % nlines],(count / nlines) % 6 + 1);
+
+		size += n;
+		++count;
+	}
+	fclose(f);
+	return count;
+}
+
+static void
+report(const char *what,double secs,unsigned long bytes,unsigned long lines,unsigned long allocs) {
+	printf("%-8s %8.3f s %9.1f MB/s %12.0f lines/s %8.2f allocs/line\n",
+		what,secs,bytes / secs / 1e6,lines / secs,double(allocs) / lines);
+}
+
+int
+main(int argc,char **argv) {
+	unsigned mbytes = argc > 1 ? strtoul(argv[1],nullptr,10) : 16;
+	char path[] = "/tmp/lexbenchXXXXXX";
+	int fd = mkstemp(path);
+
+	if ( fd < 0 || mbytes == 0 ) {
+		std::cerr << "Usage: " << argv[0] << " [megabytes]\n";
+		return 1;
+	}
+	close(fd);
+
+	unsigned long nlines = generate(path,mbytes);
+	unsigned long bytes = mbytes * 1024ul * 1024ul;
+	unsigned long tokens = 0, oldtokens = 0, allocs;
+
+	printf("%u MB, %lu lines\n",mbytes,nlines);
+
+	{
+		auto t0 = std::chrono::steady_clock::now();
+		std::ifstream istr(path);
+		s_oldinstr instr;
+
+		allocs = n_allocs;
+		while ( oldparse(istr,instr) )
+			oldtokens += 1 + instr.stroperands.size();
+		allocs = n_allocs - allocs;
+
+		std::chrono::duration<double> secs = std::chrono::steady_clock::now() - t0;
+		report("istream",secs.count(),bytes,nlines,allocs);
+	}
+
+	{
+		auto t0 = std::chrono::steady_clock::now();
+		Source src(path);
+		Lexer lex(src.text());
+		s_token tok;
+
+		allocs = n_allocs;
+		while ( !lex.eof() ) {
+			while ( lex.token(tok) )
+				++tokens;
+			lex.comment();
+			lex.next_line();
+		}
+		allocs = n_allocs - allocs;
+
+		std::chrono::duration<double> secs = std::chrono::steady_clock::now() - t0;
+		report("mmap",secs.count(),bytes,nlines,allocs);
+	}
+
+	{
+		auto t0 = std::chrono::steady_clock::now();
+		Source src(path);
+		Lexer lex(src.text());
+		s_instr instr;
+		unsigned long parsed = 0;
+
+		allocs = n_allocs;
+		while ( parse(lex,instr) )
+			parsed += 1 + instr.stroperands.size();
+		allocs = n_allocs - allocs;
+
+		std::chrono::duration<double> secs = std::chrono::steady_clock::now() - t0;
+		report("parse",secs.count(),bytes,nlines,allocs);
+		if ( parsed != tokens ) {
+			std::cerr << "Parsed token count differs: " << parsed << " vs " << tokens << '\n';
+			return 1;
+		}
+	}
+
+	{
+		auto t0 = std::chrono::steady_clock::now();
+		Source src(path);
+		Lexer lex(src.text());
+		s_instr instr;
+		std::vector<s_instr> instrs;
+
+		allocs = n_allocs;
+		while ( parse(lex,instr) ) {
+			if ( instr.stropcode == ".WAVEFORM" )
+				instrs.clear();
+			else if ( instr.stropcode[0] != '.' )
+				instrs.push_back(instr);
+		}
+		allocs = n_allocs - allocs;
+
+		std::chrono::duration<double> secs = std::chrono::steady_clock::now() - t0;
+		report("collect",secs.count(),bytes,nlines,allocs);
+	}
+
+	unlink(path);
+
+	if ( tokens != oldtokens ) {
+		std::cerr << "Token counts differ: " << oldtokens << " vs " << tokens << '\n';
+		return 1;
+	}
+	return 0;
+}
+
+// End lexbench.cpp
@@ -0,0 +1,181 @@
+//////////////////////////////////////////////////////////////////////
+// lexer.hpp -- Zero copy tokenizer for ezusbcc sources
+///////////////////////////////////////////////////////////////////////
+//
+// The Source is memory mapped when it is a regular file, and read
+// into one buffer otherwise (a pipe on stdin, for example). The Lexer
+// hands out std::string_view tokens into that text, each with its
+// source line and column, so no memory is allocated per line. The
+// views remain valid for the life of the Source.
+
+#ifndef LEXER_HPP
+#define LEXER_HPP
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#include <string>
+#include <string_view>
+
+struct s_token {
+	std::string_view text;
+	unsigned	line = 0;
+	unsigned	column = 0;	// 1 based
+};
+
+//////////////////////////////////////////////////////////////////////
+// Input text, mapped or read from a file descriptor
+//////////////////////////////////////////////////////////////////////
+
+class Source {
+	void		*map = MAP_FAILED;
+	size_t		mapsize = 0;
+	std::string	buf;		// When it could not be mapped
+	std::string	err;
+
+	void load(int fd) {
+		struct stat st;
+
+		if ( fstat(fd,&st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 ) {
+			map = mmap(nullptr,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+			if ( map != MAP_FAILED ) {
+				mapsize = st.st_size;
+				return;
+			}
+		}
+
+		char chunk[65536];
+		ssize_t rc;
+
+		while ( (rc = read(fd,chunk,sizeof chunk)) != 0 ) {
+			if ( rc < 0 ) {
+				if ( errno == EINTR )
+					continue;
+				err = strerror(errno);
+				return;
+			}
+			buf.append(chunk,rc);
+		}
+	}
+
+public:	Source(int fd) {
+		load(fd);
+	}
+
+	Source(const char *path) {
+		int fd = open(path,O_RDONLY);
+
+		if ( fd < 0 ) {
+			err = std::string(strerror(errno)) + ": Opening " + path + " for read";
+			return;
+		}
+		load(fd);
+		close(fd);
+	}
+
+	Source(const Source&) = delete;
+	Source& operator=(const Source&) = delete;
+
+	~Source() {
+		if ( map != MAP_FAILED )
+			munmap(map,mapsize);
+	}
+
+	bool ok() const {
+		return err.empty();
+	}
+
+	const std::string& error() const {
+		return err;
+	}
+
+	std::string_view text() const {
+		if ( map != MAP_FAILED )
+			return std::string_view(static_cast<const char *>(map),mapsize);
+		return std::string_view(buf);
+	}
+};
+
+//////////////////////////////////////////////////////////////////////
+// Line oriented tokenizer. Tokens are separated by blanks, and a ';'
+// starts a comment running to the end of the line.
+//////////////////////////////////////////////////////////////////////
+
+class Lexer {
+	const char	*p;
+	const char	*end;
+	const char	*bol;		// Beginning of the current line
+	unsigned	lineno = 1;
+
+	void skip_blanks() {
+		while ( p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\f' || *p == '\v') )
+			++p;
+	}
+
+public:	Lexer(std::string_view src) : p(src.data()), end(src.data() + src.size()), bol(src.data()) {}
+
+	bool eof() const {
+		return p >= end;
+	}
+
+	// Next token on the current line, else false at a comment or EOL
+	bool token(s_token& tok) {
+		skip_blanks();
+		if ( p >= end || *p == '\n' || *p == ';' )
+			return false;
+
+		const char *start = p;
+
+		while ( p < end && *p != ' ' && *p != '\t' && *p != '\r'
+		  && *p != '\f' && *p != '\v' && *p != '\n' && *p != ';' )
+			++p;
+		tok.text = std::string_view(start,p - start);
+		tok.line = lineno;
+		tok.column = start - bol + 1;
+		return true;
+	}
+
+	// The comment text after ';' on the current line, if any
+	std::string_view comment() {
+		skip_blanks();
+		if ( p >= end || *p != ';' )
+			return std::string_view();
+
+		const char *start = ++p;
+
+		while ( p < end && *p != '\n' )
+			++p;
+
+		const char *last = p;
+
+		if ( last > start && last[-1] == '\r' )
+			--last;
+		return std::string_view(start,last - start);
+	}
+
+	// Skip whatever remains of the line, returning false at EOF
+	bool next_line() {
+		const void *nl = p < end ? memchr(p,'\n',end - p) : nullptr;
+
+		if ( !nl ) {
+			p = end;
+			return false;
+		}
+		p = bol = static_cast<const char *>(nl) + 1;
+		++lineno;
+		return p < end;
+	}
+
+	unsigned line() const {
+		return lineno;
+	}
+};
+
+#endif // LEXER_HPP
+
+// End lexer.hpp
@@ -0,0 +1,5578 @@
+//////////////////////////////////////////////////////////////////////
+// libezusbcc.cpp -- GPIF assembler and decompiler library
+///////////////////////////////////////////////////////////////////////
+//
+// The assembler, optimizer, analyzer, simulator and decompiler behind
+// the ezusbcc command (see ezusbcc.cpp for the source format, and
+// ezusbcc.hpp for the API). The listing and output go to the streams
+// given, errors are returned as diagnostics, and nothing here exits.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <assert.h>
+#include <math.h>
+#include <dirent.h>
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <sstream>
+#include <iomanip>
+#include <map>
+#include <array>
+#include <algorithm>
+#include <string_view>
+#include <thread>
+
+#include "libezusbcc.hpp"
+
+namespace ezusbcc {
+
+const std::map<std::string,int,std::less<>> pseudotab = {
+	{ ".TRICTL",		int(PseudoOps::Trictl) },
+	{ ".GPIFREADYCFG5",	int(PseudoOps::GpifReadyCfg5) },
+	{ ".GPIFREADYCFG7",	int(PseudoOps::GpifReadyCfg7) },
+	{ ".EPXGPIFFLGSEL",	int(PseudoOps::EpxGpifFlgSel) },
+	{ ".EP",		int(PseudoOps::Ep) },
+	{ ".WAVEFORM",		int(PseudoOps::WaveForm) },
+	{ ".IFCLK",		int(PseudoOps::IfClk) },
+	{ ".WORDWIDE",		int(PseudoOps::WordWide) },
+	{ ".ASYNC",		int(PseudoOps::Async) },
+	{ ".IDLECTL",		int(PseudoOps::IdleCtl) },
+	{ ".FLOWSTATE",		int(PseudoOps::FlowState) },
+	{ ".FLOWLOGIC",		int(PseudoOps::FlowLogic) },
+	{ ".FLOWEQ0CTL",	int(PseudoOps::FlowEq0Ctl) },
+	{ ".FLOWEQ1CTL",	int(PseudoOps::FlowEq1Ctl) },
+	{ ".FLOWHOLDOFF",	int(PseudoOps::FlowHoldOff) },
+	{ ".FLOWSTB",		int(PseudoOps::FlowStb) },
+	{ ".FLOWSTBEDGE",	int(PseudoOps::FlowStbEdge) },
+	{ ".FLOWSTBHPERIOD",	int(PseudoOps::FlowStbHPeriod) },
+	{ ".MINPULSE",		int(PseudoOps::MinPulse) },
+	{ ".SETUP",		int(PseudoOps::Setup) },
+	{ ".HOLD",		int(PseudoOps::Hold) },
+	{ ".EPBUF",		int(PseudoOps::EpBuf) },
+	{ ".AUTOCOMMIT",	int(PseudoOps::AutoCommit) },
+};
+
+//////////////////////////////////////////////////////////////////////
+// Lookup maps of the names in gpiftab.hpp, by environment
+//////////////////////////////////////////////////////////////////////
+
+static std::map<std::string,int,std::less<>>
+make_flgsel() {
+	std::map<std::string,int,std::less<>> m;
+
+	for ( unsigned sel=0; sel < 3; ++sel )
+		m[flag_name(sel)] = sel;
+	return m;
+}
+
+const std::map<std::string,int,std::less<>> flgsel = make_flgsel();
+
+static const std::map<std::string,int,std::less<>> stbedgetab = {
+	{ "NONE",	0 },
+	{ "RISING",	1 },
+	{ "FALLING",	2 },
+	{ "BOTH",	3 },
+};
+
+
+static std::map<unsigned,t_namemap>
+make_oetab() {
+	std::map<unsigned,t_namemap> m;
+
+	for ( unsigned trictl=0; trictl < 2; ++trictl )		// TRICTL=0, 1
+		for ( unsigned bit=0; bit < 8; ++bit )
+			if ( const char *name = output_name(bit,trictl) )
+				m[trictl][name] = bit;
+	return m;
+}
+
+const std::map<unsigned,t_namemap> oetab = make_oetab();
+
+static t_namemap
+make_functab() {
+	t_namemap m;
+
+	for ( unsigned code=0; code < 4; ++code )
+		m[function_name(code)] = code;
+	return m;
+}
+
+static const t_namemap functab = make_functab();
+
+static std::map<unsigned,std::map<unsigned,std::map<unsigned,t_namemap>>>
+make_opertab() {
+	std::map<unsigned,std::map<unsigned,std::map<unsigned,t_namemap>>> m;
+
+	for ( unsigned cfg5=0; cfg5 < 2; ++cfg5 )
+		for ( unsigned sel=0; sel < 3; ++sel )
+			for ( unsigned cfg7=0; cfg7 < 2; ++cfg7 )
+				for ( unsigned code=0; code < 8; ++code )
+					if ( const char *name = term_name(code,cfg5,sel,cfg7) )
+						m[cfg5][sel][cfg7][name] = code;
+	return m;
+}
+
+const std::map<unsigned/*GpifReadyCfg5*/,
+	std::map<unsigned/*EPxGPIFFLGSEL*/,
+	std::map<unsigned/*GPIFREADYCFG.7*/,
+	t_namemap
+	>>> opertab = make_opertab();
+
+//////////////////////////////////////////////////////////////////////
+// sw_reasons() of n words, 8 lanes at a time with the compiler's
+// vector extensions (SSE2, AVX2 or NEON as the target allows). The
+// tail is done one word at a time.
+//////////////////////////////////////////////////////////////////////
+
+typedef uint32_t v8u32 __attribute__((vector_size(32)));
+
+void
+classify_states(const uint32_t *words,size_t n,const s_stateenv& env,uint8_t *reasons) {
+	const uint32_t noterm = env.gpifreadycfg7 ? 8 : 7;	// First term without a name
+	const uint32_t outmask = env.trictl ? 0x00 : 0xC0;
+	size_t wx = 0;
+
+	for ( ; wx + 8 <= n; wx += 8 ) {
+		v8u32 w, why;
+
+		memcpy(&w,words + wx,sizeof w);
+
+		v8u32 dp = (w >> 16) & 1;
+		v8u32 lf = (w >> 8) & 0xFF;
+		v8u32 ta = (w >> 11) & 7, tb = (w >> 8) & 7;
+
+		why = (v8u32)((w & 0x00C00000) != 0) & uint32_t(StateReservedOpcode);
+		why |= (v8u32)((w & 0x40000000) != 0) & dp * uint32_t(StateReservedBranch);
+		why |= (v8u32)(lf != 0) & (dp ^ 1) * uint32_t(StateNdpLogfunc);
+		why |= (v8u32)((ta >= noterm) | (tb >= noterm)) & dp * uint32_t(StateNoTerm);
+		why |= (v8u32)((w & outmask) != 0) & uint32_t(StateNoOutput);
+
+		for ( unsigned lx=0; lx < 8; ++lx )
+			reasons[wx + lx] = why[lx];
+	}
+	for ( ; wx < n; ++wx )
+		reasons[wx] = sw_reasons(words[wx],env);
+}
+
+//////////////////////////////////////////////////////////////////////
+// Parse the next line holding an opcode or pseudo op. The strings in
+// instr are views into the lexer's source text.
+//////////////////////////////////////////////////////////////////////
+
+bool
+parse(Lexer& lex,s_instr& instr) {
+	s_token tok;
+
+	instr.clear();
+
+	for (;;) {
+		if ( lex.eof() )
+			return false;
+		if ( lex.token(tok) )
+			break;
+		lex.next_line();		// Blank or comment line
+	}
+
+	instr.stropcode = tok.text;
+	instr.line = tok.line;
+	instr.column = tok.column;
+
+	while ( lex.token(tok) )
+		instr.stroperands.push_back(tok.text);
+	instr.strcomment = lex.comment();
+	lex.next_line();
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Convert a decimal (or 0x hex) view, returning false unless it is
+// all digits
+//////////////////////////////////////////////////////////////////////
+
+static bool
+to_unsigned(std::string_view sv,unsigned long& value) {
+	return number(sv.data(),sv.size(),value);
+}
+
+static s_diagnostic
+where(const s_instr& instr,const std::string& msg) {
+	return s_diagnostic(msg,instr.line,instr.column);
+}
+
+//////////////////////////////////////////////////////////////////////
+// A waveform using NEXT (without SGL) is taken to be a FIFO write,
+// where DATA drives the bus. Otherwise DATA samples the bus.
+//////////////////////////////////////////////////////////////////////
+
+static bool
+is_write(const std::vector<s_instr>& instrs) {
+	for ( auto& instr : instrs )
+		if ( instr.opcode.bits.next && !instr.opcode.bits.sgl )
+			return true;
+	return false;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Data items moved by the actions of a state: DATA samples for reads,
+// NEXT for FIFO writes.
+//////////////////////////////////////////////////////////////////////
+
+static unsigned
+transfers(const s_instr& instr,bool write) {
+	return write ? instr.opcode.bits.next : instr.opcode.bits.data;
+}
+
+//////////////////////////////////////////////////////////////////////
+// GPIF Simulation
+//////////////////////////////////////////////////////////////////////
+
+static const std::map<std::string,unsigned> simterms = {
+	{ "RDY0",   0 },
+	{ "RDY1",   1 },
+	{ "RDY2",   2 },
+	{ "RDY3",   3 },
+	{ "RDY4",   4 },
+	{ "RDY5",   5 },
+	{ "TC",     5 },		// Shares term 5 with RDY5
+	{ "PF",     6 },		// Selected FIFO flag
+	{ "EF",     6 },
+	{ "FF",     6 },
+	{ "INTRDY", 7 },
+};
+
+struct s_section {
+	std::map<unsigned,unsigned> environ;	// Pseudo op settings
+	std::map<unsigned,s_instr> flowterms;	// .FLOWLOGIC and .FLOWEQnCTL
+	std::vector<s_instr> timing;		// .MINPULSE, .SETUP and .HOLD
+	std::vector<s_instr> instrs;		// States
+	std::array<uint8_t,9> flow = { { 0 } };	// FlowStates[] block
+};
+
+struct s_simcycle {
+	unsigned	state;		// State executing this cycle
+	unsigned	next;		// State of the following cycle
+	u_opcode	opcode;		// Opcode of that state
+	u_output	output;		// Pins driven this cycle
+	uint8_t		rdy;		// Term inputs 0..7
+	bool		action;		// Opcode actions take effect
+	bool		xfer;		// A data item moved
+	unsigned	fill;		// EP FIFO bytes after this cycle
+};
+
+//////////////////////////////////////////////////////////////////////
+// Read the stimulus file:
+//
+//	; Comment
+//	cycle	TERM=value ...		; Comment
+//
+// Values hold until changed by a later line. Cycles count from the
+// start of the run, across all transactions. Returns false with the
+// message in error.
+//////////////////////////////////////////////////////////////////////
+
+bool
+load_stimulus(const char *path,std::vector<s_stimulus>& stim,std::string& error) {
+	std::ifstream istr(path);
+	std::string line;
+	unsigned lno = 0;
+
+	if ( istr.fail() ) {
+		error = std::string(strerror(errno)) + ": Opening " + path + " for read";
+		return false;
+	}
+
+	while ( std::getline(istr,line) ) {
+		std::string::size_type cx = line.find(';');
+		std::stringstream ss;
+		std::string token;
+		s_stimulus st = { 0, 0, 0 };
+		char *ep;
+
+		++lno;
+		if ( cx != std::string::npos )
+			line.erase(cx);
+		ss.str(line);
+		if ( !(ss >> token) )
+			continue;
+
+		st.cycle = strtoul(token.c_str(),&ep,10);
+		if ( ep && *ep ) {
+			error = std::string(path) + ':' + std::to_string(lno) + ": Invalid cycle '" + token + "'";
+			return false;
+		}
+
+		while ( ss >> token ) {
+			std::string::size_type ex = token.find('=');
+			std::string term = token.substr(0,ex);
+			auto it = simterms.find(term);
+
+			if ( ex == std::string::npos || it == simterms.end()
+			  || (token.substr(ex+1) != "0" && token.substr(ex+1) != "1") ) {
+				error = std::string(path) + ':' + std::to_string(lno) + ": Invalid stimulus '" + token + "'";
+				return false;
+			}
+			st.mask |= 1 << it->second;
+			if ( token[ex+1] == '1' )
+				st.value |= 1 << it->second;
+		}
+		if ( !stim.empty() && st.cycle < stim.back().cycle ) {
+			error = std::string(path) + ':' + std::to_string(lno) + ": Cycles must be in ascending order";
+			return false;
+		}
+		stim.push_back(st);
+	}
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Cycle by cycle execution of the encoded states. The waveform starts
+// in state 0 and the transaction ends when it branches into the idle
+// state 7. An NDP state occupies its count of IFCLK cycles (0 = 256),
+// and its actions take effect in the last cycle of the interval. A DP
+// state decides in one cycle, branching to branch1 when the logic
+// function is true, else to branch0. Looping on itself repeats the
+// actions only when the re-execute bit is set.
+//////////////////////////////////////////////////////////////////////
+
+class GpifSim {
+	const std::vector<s_instr>& instrs;
+	bool		write;		// Transfers counted by NEXT, else DATA
+	unsigned	state = 0;
+	unsigned	remaining = 0;	// NDP cycles left in interval
+	bool		entered = true;	// First cycle in state
+
+public:	GpifSim(const std::vector<s_instr>& instrs,bool write)
+		: instrs(instrs), write(write) {};
+
+	void start() {
+		state = 0;
+		entered = true;
+	}
+
+	bool step(uint8_t rdy,s_simcycle& cyc);
+};
+
+bool
+GpifSim::step(uint8_t rdy,s_simcycle& cyc) {
+	const s_instr& instr = instrs[state];
+	unsigned next;
+
+	cyc.state = state;
+	cyc.opcode = instr.opcode;
+	cyc.output = instr.output;
+	cyc.rdy = rdy;
+
+	if ( instr.opcode.bits.dp ) {
+		bool a = (rdy >> instr.logfunc.bits.terma) & 1;
+		bool b = (rdy >> instr.logfunc.bits.termb) & 1;
+		bool f;
+
+		switch ( u_logfunc::e_logfunc(instr.logfunc.bits.lfunc) ) {
+		case u_logfunc::e_logfunc::a_and_b:
+			f = a && b;
+			break;
+		case u_logfunc::e_logfunc::a_or_b:
+			f = a || b;
+			break;
+		case u_logfunc::e_logfunc::a_xor_b:
+			f = a != b;
+			break;
+		default:
+			f = !a && b;
+		}
+		cyc.action = entered;
+		next = f ? instr.branch.bits.branch1 : instr.branch.bits.branch0;
+		entered = next != state || instr.branch.bits.reexecute;
+	} else	{
+		if ( entered )
+			remaining = instr.branch.byte ? instr.branch.byte : 256u;
+		cyc.action = --remaining == 0;
+		next = cyc.action ? state + 1 : state;
+		entered = cyc.action;
+	}
+
+	cyc.xfer = cyc.action && transfers(instr,write);
+	cyc.next = state = next;
+	return state >= 7;
+}
+
+//////////////////////////////////////////////////////////////////////
+// An endpoint FIFO between the GPIF and the host. A write waveform
+// drains an OUT endpoint that the host fills, and a read waveform
+// fills an IN endpoint that the host drains. The host moves whole
+// 512-byte packets at its rate, saving at most one packet of credit
+// while it waits on the FIFO. The flags follow the fill each cycle.
+//////////////////////////////////////////////////////////////////////
+
+class FifoSim {
+	bool		write;		// The GPIF drains, the host fills
+	unsigned	size;		// Bytes
+	unsigned	level;		// PF threshold
+	bool		below;		// PF at or below level, else at or above
+	double		rate;		// Host bytes per IFCLK cycle
+	double		credit = 0.0;	// Host bytes due
+
+public:	static const unsigned packet = 512;
+
+	unsigned	fill = 0;
+	unsigned long	hoststalls = 0;	// Cycles the host waited on the FIFO
+	unsigned long	hostbytes = 0;
+	unsigned long	errors = 0;	// GPIF transfers from empty or to full
+
+	FifoSim(bool write,unsigned size,unsigned level,bool below,double rate)
+		: write(write), size(size), level(level), below(below), rate(rate) {};
+
+	// The FIFOFLAG term for .EPXGPIFFLGSEL PF, EF or FF
+	bool flag(unsigned flgsel) const {
+		switch ( flgsel ) {
+		case 1:
+			return fill == 0;
+		case 2:
+			return fill == size;
+		default:
+			return below ? fill <= level : fill >= level;
+		}
+	}
+
+	void gpif(unsigned bytes);
+	void host();
+};
+
+void
+FifoSim::gpif(unsigned bytes) {
+	if ( write ) {
+		if ( fill < bytes )
+			++errors;
+		else	fill -= bytes;
+	} else	{
+		if ( fill + bytes > size )
+			++errors;
+		else	fill += bytes;
+	}
+}
+
+void
+FifoSim::host() {
+	credit = std::min(credit + rate,double(packet));
+	if ( credit < packet )
+		return;
+
+	if ( write ? size - fill < packet : fill < packet ) {
+		++hoststalls;
+		return;
+	}
+	if ( write )
+		fill += packet;
+	else	fill -= packet;
+	hostbytes += packet;
+	credit -= packet;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Run opts.transactions transactions, with the report to lst. False
+// when the PF level is beyond the FIFO, or a transaction does not
+// reach the idle state 7.
+//////////////////////////////////////////////////////////////////////
+
+static bool
+simulate(const std::vector<s_instr>& instrs,const s_simopts& opts,std::ostream& lst,
+  std::vector<s_diagnostic>& errors,std::vector<s_simcycle> *record = nullptr) {
+	static const unsigned long max_cycles = 1000000ul;	// Per transaction
+	const std::vector<s_stimulus>& stim = opts.stimulus;
+	std::array<unsigned long,8> statecycles, flagwaits;
+	unsigned long cycle = 0, bytes = 0, mincyc = 0, maxcyc = 0;
+	unsigned long fillsum = 0, minfill = ~0ul, maxfill = 0;
+	unsigned sx = 0, completed = 0;
+	uint8_t rdy = 0;
+	bool write = is_write(instrs);
+	const bool cosim = opts.usbrate > 0.0;
+	const unsigned fifosize = opts.epbuf * FifoSim::packet;
+	const unsigned level = opts.pflevel >= 0 ? unsigned(opts.pflevel) : fifosize / 2;
+
+	if ( opts.pflevel > long(fifosize) ) {
+		std::string msg = "PF level " + std::to_string(opts.pflevel) + " exceeds the "
+			+ std::to_string(fifosize) + " byte FIFO (.EPBUF " + std::to_string(opts.epbuf) + ")";
+
+		lst << "*** ERROR: " << msg << '\n';
+		errors.push_back(msg);
+		return false;
+	}
+
+	statecycles.fill(0);
+	flagwaits.fill(0);
+
+	GpifSim sim(instrs,write);
+	FifoSim fifo(write,fifosize,level,opts.pfbelow,opts.usbrate / opts.ifclk);
+	s_simcycle cyc;
+
+	if ( opts.trace )
+		lst << ";\n;\tCycle\tState\tOutput\tRDY\tAction" << (cosim ? "\tFIFO\n" : "\n");
+
+	for ( ; completed < opts.transactions; ++completed ) {
+		unsigned long start = cycle;
+		bool idle;
+
+		sim.start();
+		do	{
+			for ( ; sx < stim.size() && stim[sx].cycle <= cycle; ++sx )
+				rdy = (rdy & ~stim[sx].mask) | stim[sx].value;
+
+			if ( cosim )
+				rdy = (rdy & ~0x40) | fifo.flag(opts.flgsel) << 6;
+
+			idle = sim.step(rdy,cyc);
+			++statecycles[cyc.state];
+			if ( cyc.xfer )
+				bytes += opts.wordwide ? 2 : 1;
+
+			if ( cosim ) {
+				const u_logfunc& lf = instrs[cyc.state].logfunc;
+
+				if ( cyc.xfer )
+					fifo.gpif(opts.wordwide ? 2 : 1);
+				fifo.host();
+
+				// Looping on FIFOFLAG without moving data
+				if ( cyc.opcode.bits.dp && cyc.next == cyc.state && !cyc.xfer
+				  && (lf.bits.terma == 6 || lf.bits.termb == 6) )
+					++flagwaits[cyc.state];
+				fillsum += fifo.fill;
+				minfill = std::min(minfill,(unsigned long)fifo.fill);
+				maxfill = std::max(maxfill,(unsigned long)fifo.fill);
+			}
+			cyc.fill = fifo.fill;
+			if ( record )
+				record->push_back(cyc);
+
+			if ( opts.trace ) {
+				lst << ";\t" << std::dec << cycle
+					<< "\t$" << cyc.state << '\t';
+				lst.width(2);
+				lst.fill('0');
+				lst << std::uppercase << std::hex << unsigned(cyc.output.byte) << '\t';
+				lst.width(2);
+				lst.fill('0');
+				lst << unsigned(cyc.rdy) << '\t'
+					<< (cyc.action ? (cyc.xfer ? "XFER" : "ACT") : "");
+				if ( cosim )
+					lst << '\t' << std::dec << cyc.fill;
+				lst << '\n';
+			}
+			++cycle;
+		} while ( !idle && cycle - start < max_cycles );
+
+		if ( !idle ) {
+			std::string msg = "Transaction " + std::to_string(completed)
+				+ " did not reach idle state 7 within "
+				+ std::to_string(max_cycles) + " cycles.";
+
+			lst << std::dec << "*** ERROR: " << msg << '\n';
+			errors.push_back(msg);
+			return false;
+		}
+
+		unsigned long used = cycle - start;
+
+		if ( completed == 0 || used < mincyc )
+			mincyc = used;
+		if ( used > maxcyc )
+			maxcyc = used;
+	}
+
+	lst << std::dec << std::nouppercase << std::fixed << std::setprecision(3);
+	lst << ";\n;\tSimulation (IFCLK " << opts.ifclk << " MHz, "
+		<< (opts.wordwide ? 16 : 8) << "-bit bus, FIFO "
+		<< (write ? "write" : "read") << "):\n;\n";
+
+	lst << ";\tTransactions\t" << completed << '\n'
+		<< ";\tCycles\t\t" << cycle << '\n';
+
+	if ( completed > 0 ) {
+		double cpt = double(cycle) / completed;
+
+		lst << ";\tPer transaction\t" << mincyc << " min, "
+			<< maxcyc << " max, " << cpt << " avg cycles\n"
+			<< ";\tBytes\t\t" << bytes << " (" << double(bytes) / completed
+			<< " per transaction)\n";
+	}
+	if ( cycle > 0 )
+		lst << ";\tThroughput\t" << double(bytes) * opts.ifclk / cycle
+			<< " MB/s\n";
+
+	lst << ";\n;\tState\tCycles\n";
+	for ( unsigned ux=0; ux<7; ++ux )
+		if ( statecycles[ux] > 0 )
+			lst << ";\t$" << ux << '\t' << statecycles[ux] << '\n';
+	lst << ";\n";
+
+	if ( !cosim || cycle == 0 )
+		return true;
+
+	static const char *flags[] = { "PF", "EF", "FF" };
+	const double us = cycle / opts.ifclk;
+	unsigned long waits = 0;
+
+	for ( auto n : flagwaits )
+		waits += n;
+
+	lst << ";\tFIFO (EP " << (write ? "OUT" : "IN") << ", " << opts.epbuf << " x "
+		<< FifoSim::packet << " bytes, host " << opts.usbrate << " MB/s, "
+		<< flags[opts.flgsel] << " on FIFOFLAG, PF at " << (opts.pfbelow ? "<= " : ">= ")
+		<< level << " bytes):\n;\n"
+		<< ";\tFill\t\t" << minfill << " min, " << maxfill << " max, "
+		<< double(fillsum) / cycle << " avg bytes\n"
+		<< ";\tFlag wait\t" << waits << " cycles, " << waits / opts.ifclk << " us ("
+		<< 100.0 * waits / cycle << "%)\n";
+	for ( unsigned ux=0; ux<7; ++ux )
+		if ( flagwaits[ux] > 0 )
+			lst << ";\t  $" << ux << "\t\t" << flagwaits[ux] << " cycles\n";
+	lst << ";\tHost stalls\t" << fifo.hoststalls << " cycles, " << fifo.hoststalls / opts.ifclk
+		<< " us (" << 100.0 * fifo.hoststalls / cycle << "%), FIFO "
+		<< (write ? "full" : "without a packet") << '\n'
+		<< ";\tHost\t\t" << fifo.hostbytes << " bytes, " << fifo.hostbytes / us << " MB/s\n"
+		<< ";\tSustained\t" << std::min(double(bytes),double(fifo.hostbytes)) / us << " MB/s\n";
+	if ( fifo.errors > 0 )
+		lst << ";\t*** " << fifo.errors << (write ? " underruns: NEXT with the FIFO empty\n"
+			: " overruns: DATA with the FIFO full\n");
+	lst << ";\n";
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////
+// A capture of the DP inputs, streamed through a fixed buffer so that
+// captures of any size can be replayed. A CSV capture starts with a
+// header naming its columns, of which RDY0..RDY5, TC, PF, EF, FF,
+// FIFOFLAG, INTRDY and TIME are used, then has one row per IFCLK
+// cycle. A VCD capture is sampled at each rising edge of its IFCLK
+// signal, with the values changed at that time, or else every IFCLK
+// period from time 0. The first signal of each name is used, in any
+// scope.
+//////////////////////////////////////////////////////////////////////
+
+class Capture {
+	static const int none = -1;		// Column or signal not used
+	static const int clock = -2;		// IFCLK
+	static const int stamp = -3;		// TIME column
+
+	FILE		*f = nullptr;
+	std::vector<char> buf;
+	size_t		head = 0, tail = 0;	// Unread bytes of buf
+	std::string	line;			// Current line
+	size_t		pos = 0;		// Next token of line
+	unsigned long	lno = 0;
+	std::string	path;
+	std::string	err;
+
+	bool		vcd = false;
+	std::vector<int> columns;		// CSV: term of each column
+	bool		timed = false;		// CSV: has a TIME column
+	unsigned long	rows = 0;
+	std::map<std::string,int> ids;		// VCD: term of each identifier
+	double		scale = 1.0;		// VCD: ps per time unit
+	double		period;			// ps per IFCLK cycle
+	bool		clocked = false;	// VCD: has IFCLK
+	bool		clk = false;
+	bool		rose = false;		// IFCLK rose at now
+	bool		ready = false;		// A clocked sample at edge
+	double		edge = 0.0;
+	bool		done = false;		// End of the VCD
+	unsigned long long now = 0;		// VCD: time of cur
+	double		limit = 0.0;		// Grid samples before this ps
+	double		grid = 0.0;		// Next grid sample, ps
+	uint8_t		cur = 0;		// Inputs as of now
+
+	bool getline();
+	bool token(std::string& tok);
+	bool skip_to_end();
+	bool fail(const std::string& message);
+	bool header_csv();
+	bool header_vcd();
+	bool next_csv(uint8_t& rdy,double& when);
+
+public:	Capture(const char *path,double ifclk);
+	~Capture();
+
+	bool ok() const {
+		return err.empty();
+	}
+
+	const std::string& error() const {
+		return err;
+	}
+
+	// The inputs of the next IFCLK cycle and when they were sampled,
+	// else false at the end or on an error
+	bool next(uint8_t& rdy,double& when);
+
+	// when as text: ns into a VCD, a CSV TIME, or a CSV row
+	std::string timestamp(double when) const;
+};
+
+Capture::Capture(const char *path,double ifclk) : buf(1 << 20), path(path), period(1e6 / ifclk) {
+	const size_t len = strlen(path);
+
+	if ( !(f = fopen(path,"r")) ) {
+		err = std::string(strerror(errno)) + ": Opening " + path + " for read";
+		return;
+	}
+	vcd = len > 4 && strcasecmp(path + len - 4,".vcd") == 0;
+	if ( vcd )
+		header_vcd();
+	else	header_csv();
+}
+
+Capture::~Capture() {
+	if ( f )
+		fclose(f);
+}
+
+bool
+Capture::fail(const std::string& message) {
+	if ( err.empty() )
+		err = path + ':' + std::to_string(lno) + ": " + message;
+	return false;
+}
+
+// Read the next line into line, without its newline
+bool
+Capture::getline() {
+	line.clear();
+	pos = 0;
+	for (;;) {
+		if ( head == tail ) {
+			head = 0;
+			tail = f ? fread(buf.data(),1,buf.size(),f) : 0;
+			if ( tail == 0 ) {
+				if ( f && ferror(f) )
+					fail(strerror(errno));
+				if ( line.empty() )
+					return false;
+				++lno;
+				return true;
+			}
+		}
+
+		const char *nl = static_cast<const char *>(memchr(buf.data() + head,'\n',tail - head));
+		const size_t end = nl ? nl - buf.data() : tail;
+
+		line.append(buf.data() + head,end - head);
+		head = nl ? end + 1 : end;
+		if ( nl ) {
+			if ( !line.empty() && line.back() == '\r' )
+				line.pop_back();
+			++lno;
+			return true;
+		}
+	}
+}
+
+// The next blank separated token, across lines
+bool
+Capture::token(std::string& tok) {
+	for (;;) {
+		while ( pos < line.size() && isspace(uint8_t(line[pos])) )
+			++pos;
+		if ( pos < line.size() )
+			break;
+		if ( !getline() )
+			return false;
+	}
+
+	const size_t start = pos;
+
+	while ( pos < line.size() && !isspace(uint8_t(line[pos])) )
+		++pos;
+	tok.assign(line,start,pos - start);
+	return true;
+}
+
+bool
+Capture::skip_to_end() {
+	std::string tok;
+
+	while ( token(tok) )
+		if ( tok == "$end" )
+			return true;
+	return fail("Missing $end");
+}
+
+// The term of a signal or column name, in any case
+static int
+capture_term(std::string name) {
+	for ( auto& ch : name )
+		ch = toupper(uint8_t(ch));
+	if ( name == "FIFOFLAG" )
+		return 6;
+
+	auto it = simterms.find(name);
+
+	return it != simterms.end() ? int(it->second) : -1;
+}
+
+bool
+Capture::header_csv() {
+	bool used = false;
+
+	while ( getline() ) {
+		size_t sx = 0;
+
+		while ( sx < line.size() && isspace(uint8_t(line[sx])) )
+			++sx;
+		if ( sx == line.size() || line[sx] == '#' || line[sx] == ';' )
+			continue;
+
+		std::stringstream ss(line);
+		std::string name;
+
+		while ( std::getline(ss,name,',') ) {
+			name.erase(0,name.find_first_not_of(" \t\""));
+			name.erase(name.find_last_not_of(" \t\"") + 1);
+
+			int term = capture_term(name);
+
+			if ( term < 0 && strcasecmp(name.c_str(),"TIME") == 0 ) {
+				term = stamp;
+				timed = true;
+			}
+			used = used || term >= 0;
+			columns.push_back(term);
+		}
+		if ( !used )
+			return fail("No RDY or flag columns in the header");
+		return true;
+	}
+	return fail("No header");
+}
+
+bool
+Capture::next_csv(uint8_t& rdy,double& when) {
+	while ( getline() ) {
+		const char *p = line.c_str();
+
+		while ( isspace(uint8_t(*p)) )
+			++p;
+		if ( !*p || *p == '#' || *p == ';' )
+			continue;
+
+		when = rows++;
+		rdy = 0;
+		for ( size_t cx=0; cx < columns.size() && *p; ++cx ) {
+			char *ep;
+			const double value = strtod(p,&ep);
+
+			if ( ep == p )
+				return fail("Invalid value in column " + std::to_string(cx + 1));
+			if ( columns[cx] == stamp )
+				when = value;
+			else if ( columns[cx] >= 0 && value != 0.0 )
+				rdy |= 1 << columns[cx];
+			p = ep;
+			while ( isspace(uint8_t(*p)) )
+				++p;
+			if ( *p == ',' )
+				++p;
+		}
+		return true;
+	}
+	return false;
+}
+
+bool
+Capture::header_vcd() {
+	std::string tok;
+
+	while ( token(tok) ) {
+		if ( tok == "$enddefinitions" )
+			return skip_to_end();
+
+		if ( tok == "$timescale" ) {
+			std::string text, unit;
+
+			while ( token(tok) && tok != "$end" )
+				text += tok;
+
+			char *ep;
+			double n = strtod(text.c_str(),&ep);
+			static const std::map<std::string,double> units = {
+				{ "s", 1e12 }, { "ms", 1e9 }, { "us", 1e6 }, { "ns", 1e3 }, { "ps", 1.0 }, { "fs", 1e-3 }
+			};
+			auto it = units.find(ep);
+
+			if ( it == units.end() || !(n > 0.0) )
+				return fail("Invalid $timescale '" + text + "'");
+			scale = n * it->second;
+		} else if ( tok == "$var" ) {
+			std::vector<std::string> fields;
+
+			while ( token(tok) && tok != "$end" )
+				fields.push_back(tok);
+			if ( fields.size() < 4 )
+				return fail("Invalid $var");
+
+			// $var type width id name [index] $end
+			const std::string& id = fields[2], & name = fields[3];
+			int term = strcasecmp(name.c_str(),"IFCLK") == 0 ? clock : capture_term(name);
+			bool seen = false;
+
+			for ( auto& pair : ids )
+				seen = seen || (pair.second == term && term != none);
+			if ( fields[1] != "1" || seen || ids.count(id) )
+				term = none;
+			if ( term == clock )
+				clocked = true;
+			ids[id] = term;
+		} else if ( tok[0] == '$' ) {
+			if ( !skip_to_end() )
+				return false;
+		}
+	}
+	return fail("Missing $enddefinitions");
+}
+
+bool
+Capture::next(uint8_t& rdy,double& when) {
+	if ( !err.empty() )
+		return false;
+	if ( !vcd )
+		return next_csv(rdy,when);
+
+	std::string tok;
+
+	for (;;) {
+		// Samples are taken once a time has all of its changes
+		if ( ready ) {
+			ready = false;
+			rdy = cur;
+			when = edge;
+			return true;
+		}
+		if ( !clocked && grid < limit ) {
+			rdy = cur;
+			when = grid;
+			grid += period;
+			return true;
+		}
+		if ( done )
+			return false;
+
+		const bool more = token(tok);
+
+		if ( !more || tok[0] == '#' ) {
+			unsigned long long t = more ? strtoull(tok.c_str() + 1,nullptr,10) : now;
+
+			if ( t < now )
+				return fail("Time goes backwards");
+			ready = rose;
+			rose = false;
+			edge = now * scale;
+			limit = more ? t * scale : std::nextafter(now * scale,HUGE_VAL);
+			now = t;
+			done = !more;
+			continue;
+		}
+		if ( tok[0] == '$' ) {
+			if ( tok == "$comment" && !skip_to_end() )
+				return false;
+			continue;		// $dumpvars, $end and the like
+		}
+
+		std::string id;
+		char value;
+
+		if ( tok[0] == 'b' || tok[0] == 'B' || tok[0] == 'r' || tok[0] == 'R' ) {
+			value = tok.back();
+			if ( !token(id) )
+				return fail("Missing identifier");
+		} else	{
+			value = tok[0];
+			id = tok.substr(1);
+		}
+
+		auto it = ids.find(id);
+
+		if ( it == ids.end() )
+			return fail("Unknown identifier '" + id + "'");
+		if ( it->second == clock ) {
+			rose = rose || (value == '1' && !clk);
+			clk = value == '1';
+		} else if ( it->second >= 0 ) {
+			cur = (cur & ~(1 << it->second)) | (value == '1') << it->second;
+		}
+	}
+}
+
+std::string
+Capture::timestamp(double when) const {
+	std::ostringstream ss;
+
+	ss << std::fixed << std::setprecision(3);
+	if ( vcd )
+		ss << when / 1000.0 << " ns";
+	else if ( timed )
+		ss << "time " << when;
+	else	ss << "row " << std::setprecision(0) << when + 1;
+	return ss.str();
+}
+
+//////////////////////////////////////////////////////////////////////
+// Run the waveform against a capture, one IFCLK cycle per sample,
+// starting each transaction as soon as the last one reaches idle. An
+// idle cycle is one where a DP state waits on itself without moving
+// data. The longest waits are listed with when they started.
+//////////////////////////////////////////////////////////////////////
+
+struct s_wait {
+	unsigned long	cycles;
+	unsigned	state;
+	double		when;		// Capture time of the first cycle
+};
+
+static bool
+replay(const std::vector<s_instr>& instrs,const s_simopts& opts,std::ostream& lst,std::vector<s_diagnostic>& errors) {
+	static const size_t nlongest = 5;
+	const bool write = is_write(instrs);
+	Capture cap(opts.replaypath,opts.ifclk);
+	GpifSim sim(instrs,write);
+	s_simcycle cyc;
+	std::vector<s_wait> longest;
+	s_wait wait = { 0, 0, 0.0 };
+	unsigned long cycle = 0, bytes = 0, completed = 0, idle = 0;
+	uint8_t rdy;
+	double when;
+
+	auto waited = [&]() {
+		if ( wait.cycles == 0 )
+			return;
+		auto it = std::find_if(longest.begin(),longest.end(),
+			[&](const s_wait& w) { return w.cycles < wait.cycles; });
+
+		longest.insert(it,wait);
+		if ( longest.size() > nlongest )
+			longest.pop_back();
+		wait.cycles = 0;
+	};
+
+	sim.start();
+	while ( cap.next(rdy,when) ) {
+		const bool ended = sim.step(rdy,cyc);
+
+		++cycle;
+		if ( cyc.xfer )
+			bytes += opts.wordwide ? 2 : 1;
+
+		if ( cyc.opcode.bits.dp && cyc.next == cyc.state && !cyc.xfer ) {
+			if ( wait.cycles++ == 0 ) {
+				wait.state = cyc.state;
+				wait.when = when;
+			}
+			++idle;
+		} else	waited();
+
+		if ( ended ) {
+			++completed;
+			sim.start();
+		}
+	}
+	waited();
+
+	if ( !cap.ok() ) {
+		lst << "*** ERROR: " << cap.error() << '\n';
+		errors.push_back(cap.error());
+		return false;
+	}
+
+	lst << std::dec << std::nouppercase << std::fixed << std::setprecision(3);
+	lst << ";\n;\tReplay of " << opts.replaypath << " (IFCLK " << opts.ifclk << " MHz, "
+		<< (opts.wordwide ? 16 : 8) << "-bit bus, FIFO "
+		<< (write ? "write" : "read") << "):\n;\n"
+		<< ";\tCycles\t\t" << cycle << '\n'
+		<< ";\tTransactions\t" << completed << '\n'
+		<< ";\tBytes\t\t" << bytes << '\n';
+	if ( cycle > 0 )
+		lst << ";\tThroughput\t" << double(bytes) * opts.ifclk / cycle << " MB/s\n"
+			<< ";\tIdle\t\t" << idle << " cycles (" << 100.0 * idle / cycle << "%)\n";
+	if ( !longest.empty() ) {
+		lst << ";\n;\tLongest waits:\n";
+		for ( auto& w : longest )
+			lst << ";\t  " << w.cycles << " cycles in $" << w.state << " from "
+				<< cap.timestamp(w.when) << '\n';
+	}
+	lst << ";\n";
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Value Change Dump of the simulated cycles, for GTKWave and the like.
+// Each section is a scope of its own, starting at time 0, with the
+// IFCLK, the state number, the CTL and OE pins (a CTL is z while its
+// OE is off), the DATA drive, the NEXT and INCAD strobes in the cycle
+// they take effect, GPIFADR counted from 0, and the DP inputs. The
+// timescale is 1 ps, so that a 20.833 ns IFCLK keeps its period.
+//////////////////////////////////////////////////////////////////////
+
+struct s_vcdrun {
+	unsigned	waveform;	// .WAVEFORM
+	bool		trictl;		// OEn/CTLn outputs, else CTL0..5
+	double		ifclk;		// MHz
+	uint8_t		idlectl;	// Outputs in idle state 7
+	std::vector<s_simcycle> cycles;
+};
+
+struct s_vcdvar {
+	std::string	id;
+	unsigned	width;
+	std::string	name;
+	std::string	last;		// Last value dumped
+};
+
+static std::string
+vcd_id(unsigned n) {
+	std::string id;
+
+	do	{
+		id += char('!' + n % 94);
+		n /= 94;
+	} while ( n > 0 );
+	return id;
+}
+
+static std::string
+vcd_bits(unsigned value,unsigned width) {
+	std::string bits(width,'0');
+
+	for ( unsigned bx=0; bx < width; ++bx )
+		if ( (value >> bx) & 1 )
+			bits[width - 1 - bx] = '1';
+	return bits;
+}
+
+static void
+emit_vcd(std::ostream& vcd,std::vector<s_vcdrun>& runs) {
+	static const char *rdynames[8] = { "RDY0", "RDY1", "RDY2", "RDY3", "RDY4", "RDY5", "FIFOFLAG", "INTRDY" };
+	std::vector<std::vector<s_vcdvar>> vars(runs.size());
+	std::vector<std::pair<unsigned long long,std::string>> events;
+	unsigned nvars = 0;
+
+	vcd << "$version ezusbcc " << EZUSBCC_VERSION << " $end\n"
+		<< "$timescale 1ps $end\n"
+		<< "$scope module gpif $end\n";
+
+	for ( unsigned rx=0; rx < runs.size(); ++rx ) {
+		s_vcdrun& run = runs[rx];
+		std::vector<s_vcdvar>& v = vars[rx];
+
+		auto var = [&](unsigned width,const std::string& name) {
+			v.push_back(s_vcdvar{vcd_id(nvars++),width,name,""});
+		};
+
+		var(1,"IFCLK");
+		var(3,"STATE");
+		for ( unsigned cx=0; cx < (run.trictl ? 4u : 6u); ++cx )
+			var(1,"CTL" + std::to_string(cx));
+		for ( unsigned ox=0; ox < (run.trictl ? 4u : 0u); ++ox )
+			var(1,"OE" + std::to_string(ox));
+		var(1,"DATA");
+		var(1,"NEXT");
+		var(1,"INCAD");
+		var(9,"GPIFADR");
+		for ( auto name : rdynames )
+			var(1,name);
+
+		vcd << "$comment IFCLK " << run.ifclk << " MHz $end\n"
+			<< "$scope module waveform" << run.waveform << " $end\n";
+		for ( auto& vv : v )
+			vcd << "$var wire " << vv.width << ' ' << vv.id << ' ' << vv.name << " $end\n";
+		vcd << "$upscope $end\n";
+
+		// Values in the order declared, dumping those that changed
+		auto dump = [&](unsigned long long t,unsigned clk,unsigned state,uint8_t output,
+		  bool data,bool next,bool incad,unsigned adr,uint8_t rdy) {
+			std::string changes;
+			unsigned vx = 0;
+
+			auto put = [&](const std::string& value) {
+				s_vcdvar& vv = v[vx++];
+
+				if ( value == vv.last )
+					return;
+				vv.last = value;
+				if ( vv.width == 1 )
+					changes += value + vv.id + '\n';
+				else	changes += 'b' + value + ' ' + vv.id + '\n';
+			};
+
+			put(clk ? "1" : "0");
+			put(vcd_bits(state,3));
+			for ( unsigned cx=0; cx < (run.trictl ? 4u : 6u); ++cx ) {
+				if ( run.trictl && !((output >> (cx + 4)) & 1) )
+					put("z");
+				else	put((output >> cx) & 1 ? "1" : "0");
+			}
+			for ( unsigned ox=0; ox < (run.trictl ? 4u : 0u); ++ox )
+				put((output >> (ox + 4)) & 1 ? "1" : "0");
+			put(data ? "1" : "0");
+			put(next ? "1" : "0");
+			put(incad ? "1" : "0");
+			put(vcd_bits(adr,9));
+			for ( unsigned tx=0; tx < 8; ++tx )
+				put((rdy >> tx) & 1 ? "1" : "0");
+			if ( !changes.empty() )
+				events.emplace_back(t,std::move(changes));
+		};
+
+		auto ps = [&](unsigned long cycle) {
+			return (unsigned long long)llround(cycle * 1e6 / run.ifclk);
+		};
+
+		unsigned adr = 0;
+		uint8_t rdy = 0;
+
+		for ( unsigned long cx=0; cx < run.cycles.size(); ++cx ) {
+			const s_simcycle& cyc = run.cycles[cx];
+			bool incad = cyc.action && cyc.opcode.bits.incad;
+
+			rdy = cyc.rdy;
+			dump(ps(cx),1,cyc.state,cyc.output.byte,cyc.opcode.bits.data,
+				cyc.action && cyc.opcode.bits.next,incad,adr,rdy);
+			dump((ps(cx) + ps(cx + 1)) / 2,0,cyc.state,cyc.output.byte,cyc.opcode.bits.data,
+				cyc.action && cyc.opcode.bits.next,incad,adr,rdy);
+			if ( incad )
+				adr = (adr + 1) & 0x1FF;
+		}
+		dump(ps(run.cycles.size()),1,7,run.idlectl,false,false,false,adr,rdy);
+		run.cycles.clear();
+	}
+
+	vcd << "$upscope $end\n"
+		<< "$enddefinitions $end\n";
+
+	std::stable_sort(events.begin(),events.end(),[](const auto& a,const auto& b) {
+		return a.first < b.first;
+	});
+
+	for ( size_t ex=0; ex < events.size(); ++ex ) {
+		if ( ex == 0 || events[ex].first != events[ex-1].first )
+			vcd << '#' << events[ex].first << '\n';
+		vcd << events[ex].second;
+	}
+}
+
+//////////////////////////////////////////////////////////////////////
+// Peephole optimization of the encoded states
+//////////////////////////////////////////////////////////////////////
+
+//////////////////////////////////////////////////////////////////////
+// Return the target of a DP state when its branch does not depend
+// upon the inputs, else -1:
+//
+//	A XOR A and /A AND A are always false (branch0)
+//	$n $n goes to state n either way
+//////////////////////////////////////////////////////////////////////
+
+static int
+dp_unconditional(const s_instr& instr) {
+	const auto& br = instr.branch.bits;
+	const auto& lf = instr.logfunc.bits;
+
+	if ( br.branch0 == br.branch1 )
+		return br.branch0;
+	if ( lf.terma == lf.termb
+	  && (lf.lfunc == unsigned(u_logfunc::e_logfunc::a_xor_b)
+	   || lf.lfunc == unsigned(u_logfunc::e_logfunc::na_and_b)) )
+		return br.branch0;
+	return -1;
+}
+
+//////////////////////////////////////////////////////////////////////
+// IFCLK cycles for one pass through the state (NDP count or 1 for DP)
+//////////////////////////////////////////////////////////////////////
+
+static unsigned
+interval(const s_instr& instr) {
+	if ( instr.opcode.bits.dp )
+		return 1;
+	return instr.branch.byte ? instr.branch.byte : 256u;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Text for operands and opcodes made up by the optimizer. The s_instr
+// strings are views, so these are kept in static tables that outlive
+// every source.
+//////////////////////////////////////////////////////////////////////
+
+static std::string_view
+count_text(unsigned count) {
+	static const std::vector<std::string> texts = []() {
+		std::vector<std::string> v;
+
+		for ( unsigned ux=0; ux <= 256; ++ux )
+			v.push_back(std::to_string(ux));
+		return v;
+	}();
+
+	return texts.at(count);
+}
+
+static std::string_view
+target_text(unsigned state) {
+	static const std::array<const char *,8> texts = { {
+		"$0", "$1", "$2", "$3", "$4", "$5", "$6", "$7"
+	} };
+
+	return texts.at(state);
+}
+
+static std::string_view
+ndp_opcode_text(u_opcode opcode) {
+	static const std::vector<std::string> texts = []() {
+		std::vector<std::string> v;
+
+		for ( unsigned ux=0; ux < 32; ++ux ) {
+			std::string opc;
+
+			if ( ux & 1 )
+				opc += 'S';
+			if ( ux & 2 )
+				opc += '+';
+			if ( ux & 4 )
+				opc += 'G';
+			if ( ux & 8 )
+				opc += 'N';
+			if ( ux & 16 )
+				opc += 'D';
+			v.push_back(opc.empty() ? "Z" : opc);
+		}
+		return v;
+	}();
+	const auto& bits = opcode.bits;
+
+	return texts[bits.sgl | bits.incad << 1 | bits.gint << 2 | bits.next << 3 | bits.data << 4];
+}
+
+static void
+set_count(s_instr& instr,unsigned count) {
+	auto& opers = instr.stroperands;
+
+	for ( auto it = opers.begin(); it != opers.end(); ) {
+		if ( !it->empty() && (*it)[0] >= '0' && (*it)[0] <= '9' )
+			it = opers.erase(it);
+		else	++it;
+	}
+	opers.insert(opers.begin(),count_text(count));
+	instr.branch.byte = count == 256 ? 0 : count;
+}
+
+static void
+set_targets(s_instr& instr,unsigned branch0,unsigned branch1) {
+	unsigned statex = 0;
+
+	instr.branch.bits.branch0 = branch0;
+	instr.branch.bits.branch1 = branch1;
+	for ( auto& operand : instr.stroperands )
+		if ( !operand.empty() && operand[0] == '$' )
+			operand = target_text(statex++ == 0 ? branch0 : branch1);
+}
+
+//////////////////////////////////////////////////////////////////////
+// Returns the states reachable from state 0, else an empty vector
+// when a reachable state continues past the last state given (into
+// the zeroed filler states).
+//////////////////////////////////////////////////////////////////////
+
+static std::vector<bool>
+reachable(const std::vector<s_instr>& instrs) {
+	std::vector<bool> reached(instrs.size(),false);
+	std::vector<unsigned> todo = { 0 };
+
+	while ( !todo.empty() ) {
+		unsigned sx = todo.back();
+
+		todo.pop_back();
+		if ( sx == 7 || reached[sx] )
+			continue;
+		reached[sx] = true;
+
+		const s_instr& instr = instrs[sx];
+		std::vector<unsigned> succ;
+
+		if ( !instr.opcode.bits.dp ) {
+			succ.push_back(sx+1);
+		} else	{
+			int target = dp_unconditional(instr);
+
+			if ( target >= 0 ) {
+				succ.push_back(target);
+			} else	{
+				succ.push_back(instr.branch.bits.branch0);
+				succ.push_back(instr.branch.bits.branch1);
+			}
+		}
+		for ( auto nx : succ ) {
+			if ( nx != 7 && nx >= instrs.size() )
+				return std::vector<bool>();
+			todo.push_back(nx);
+		}
+	}
+	return reached;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Optimize the states between encoding and emission:
+//
+//   1. A DP state that always branches to the following state
+//	becomes a 1-count NDP state.
+//   2. States not reachable from state 0 are dropped.
+//   3. Adjacent NDP states with equal opcode and outputs are merged
+//	into one, with the counts summed (split at 256). The second
+//	state must not be a branch target, and the opcode must not
+//	act once per interval (DATA samples, NEXT, INCAD or GINT).
+//   4. The $n branch targets are renumbered.
+//
+// Nothing is changed when there are errors, or when the result would
+// move an NDP state that falls into the idle state 7.
+//////////////////////////////////////////////////////////////////////
+
+static void
+optimize(std::vector<s_instr>& instrs,std::ostream& lst) {
+	const unsigned before_states = instrs.size();
+	unsigned before_cycles = 0, after_cycles = 0;
+	bool write = is_write(instrs);
+
+	for ( auto& instr : instrs )
+		if ( !instr.error.empty() )
+			return;
+
+	lst << ";\n;\tOptimization:\n";
+	if ( instrs.empty() || instrs.size() > 7 ) {
+		lst << ";\tNot optimized: state count must be 1 to 7.\n";
+		return;
+	}
+
+	std::vector<s_instr> work(instrs);
+
+	for ( auto& instr : work )
+		before_cycles += interval(instr);
+
+	// 1. Unconditional DP to the next state becomes NDP
+	for ( unsigned sx=0; sx+1 < work.size(); ++sx ) {
+		s_instr& instr = work[sx];
+
+		if ( !instr.opcode.bits.dp || dp_unconditional(instr) != int(sx+1) )
+			continue;
+
+		instr.stropcode = ndp_opcode_text(instr.opcode);
+		instr.stroperands.erase(instr.stroperands.begin(),instr.stroperands.begin()+3);
+		for ( auto it = instr.stroperands.begin(); it != instr.stroperands.end(); ) {
+			if ( !it->empty() && (*it)[0] == '$' )
+				it = instr.stroperands.erase(it);
+			else	++it;
+		}
+		instr.opcode.bits.dp = 0;
+		instr.logfunc.byte = 0;
+		set_count(instr,1);
+	}
+
+	// 2. Drop unreachable states
+	std::vector<bool> reached = reachable(work);
+
+	if ( reached.empty() ) {
+		lst << ";\tNot optimized: a state continues past the last state.\n";
+		return;
+	}
+
+	std::vector<bool> target(work.size(),false);
+
+	for ( unsigned sx=0; sx < work.size(); ++sx ) {
+		const s_instr& instr = work[sx];
+
+		if ( reached[sx] && instr.opcode.bits.dp ) {
+			if ( instr.branch.bits.branch0 < work.size() )
+				target[instr.branch.bits.branch0] = true;
+			if ( instr.branch.bits.branch1 < work.size() )
+				target[instr.branch.bits.branch1] = true;
+		}
+	}
+
+	// 3. Merge adjacent NDP states
+	std::vector<s_instr> out;
+	std::vector<unsigned> last;		// Last old state covered by out[x]
+	std::vector<unsigned> renum(8,7u);	// Old to new state numbers
+
+	for ( unsigned sx=0; sx < work.size(); ++sx ) {
+		if ( !reached[sx] )
+			continue;
+
+		s_instr& instr = work[sx];	// Moved into out: work is not used again
+
+		if ( !out.empty() && last.back() + 1 == sx && !target[sx] ) {
+			s_instr& prev = out.back();
+			u_opcode acts = instr.opcode;
+
+			if ( write )
+				acts.bits.data = 0;	// Driving the bus is not an action
+
+			if ( !instr.opcode.bits.dp && !prev.opcode.bits.dp
+			  && prev.opcode.byte == instr.opcode.byte
+			  && prev.output.byte == instr.output.byte
+			  && !acts.bits.data && !acts.bits.next
+			  && !acts.bits.incad && !acts.bits.gint ) {
+				unsigned count = interval(prev) + interval(instr);
+
+				if ( count <= 256 ) {
+					set_count(prev,count);
+					last.back() = sx;
+					renum[sx] = out.size() - 1;
+					continue;
+				}
+				set_count(prev,256);
+				out.push_back(std::move(instr));
+				set_count(out.back(),count - 256);
+				last.push_back(sx);
+				renum[sx] = out.size() - 1;
+				continue;
+			}
+		}
+		out.push_back(std::move(instr));
+		last.push_back(sx);
+		renum[sx] = out.size() - 1;
+	}
+
+	// 4. Renumber and check that each NDP state still falls through
+	for ( unsigned nx=0; nx < out.size(); ++nx ) {
+		s_instr& instr = out[nx];
+
+		if ( instr.opcode.bits.dp ) {
+			set_targets(instr,renum[instr.branch.bits.branch0],renum[instr.branch.bits.branch1]);
+		} else if ( renum[last[nx] + 1] != nx + 1 ) {
+			lst << ";\tNot optimized: state $" << last[nx]
+				<< " must remain in front of $" << last[nx] + 1 << ".\n";
+			return;
+		}
+	}
+
+	for ( auto& instr : out )
+		after_cycles += interval(instr);
+
+	instrs = std::move(out);
+	lst << ";\tBefore\t" << before_states << " states, " << before_cycles << " cycles\n"
+		<< ";\tAfter\t" << instrs.size() << " states, " << after_cycles << " cycles\n";
+}
+
+//////////////////////////////////////////////////////////////////////
+// Static cycle analysis
+//////////////////////////////////////////////////////////////////////
+
+struct s_path {
+	std::vector<unsigned> states;	// States visited, ending before 7
+	unsigned	cycles = 0;	// IFCLK cycles
+	unsigned	xfers = 0;	// Data items moved
+	unsigned	rdywaits = 0;	// DP decisions on RDY pins
+};
+
+//////////////////////////////////////////////////////////////////////
+// Return true if the DP state tests a RDY pin (as opposed to TC, the
+// FIFO flag or INTRDY), which is synchronized in .ASYNC mode.
+//////////////////////////////////////////////////////////////////////
+
+static bool
+tests_rdy(const s_instr& instr,unsigned gpifreadycfg5) {
+	auto pin = [&](unsigned term) {
+		return term < 5 || (term == 5 && !gpifreadycfg5);
+	};
+
+	return instr.opcode.bits.dp
+		&& (pin(instr.logfunc.bits.terma) || pin(instr.logfunc.bits.termb));
+}
+
+//////////////////////////////////////////////////////////////////////
+// Enumerate every path from state 0 to the idle state 7 that visits
+// a state no more than once. Loops back into the path are waits on
+// the inputs and are left out, so these are the paths taken when no
+// RDY is stalling.
+//////////////////////////////////////////////////////////////////////
+
+static void
+walk_paths(const std::vector<s_instr>& instrs,bool write,unsigned gpifreadycfg5,
+  s_path& path,std::vector<s_path>& paths) {
+	unsigned sx = path.states.back();
+	const s_instr& instr = instrs[sx];
+	std::vector<unsigned> succ;
+
+	path.cycles += interval(instr);
+	path.xfers += transfers(instr,write);
+	path.rdywaits += tests_rdy(instr,gpifreadycfg5);
+
+	if ( !instr.opcode.bits.dp ) {
+		succ.push_back(sx+1);
+	} else	{
+		int target = dp_unconditional(instr);
+
+		succ.push_back(target >= 0 ? target : instr.branch.bits.branch0);
+		if ( target < 0 && instr.branch.bits.branch1 != instr.branch.bits.branch0 )
+			succ.push_back(instr.branch.bits.branch1);
+	}
+
+	for ( auto nx : succ ) {
+		if ( nx >= 7 ) {
+			paths.push_back(path);
+		} else if ( std::find(path.states.begin(),path.states.end(),nx) == path.states.end() ) {
+			path.states.push_back(nx);
+			walk_paths(instrs,write,gpifreadycfg5,path,paths);
+			path.states.pop_back();
+		}
+	}
+
+	path.cycles -= interval(instr);
+	path.xfers -= transfers(instr,write);
+	path.rdywaits -= tests_rdy(instr,gpifreadycfg5);
+}
+
+//////////////////////////////////////////////////////////////////////
+// Report best and worst case cycles per transaction from the 8
+// encoded states. In .ASYNC mode the RDY pins pass through a 2 stage
+// synchronizer, so the worst case adds 2 cycles for each DP state on
+// the path that tests a RDY pin.
+//////////////////////////////////////////////////////////////////////
+
+static void
+analyze(const std::vector<s_instr>& instrs,const std::map<unsigned,unsigned>& environ,std::ostream& lst) {
+	const double ifclk = environ.at(unsigned(PseudoOps::IfClk));
+	const bool wordwide = environ.at(unsigned(PseudoOps::WordWide));
+	const bool async = environ.at(unsigned(PseudoOps::Async));
+	const unsigned gpifreadycfg5 = environ.at(unsigned(PseudoOps::GpifReadyCfg5));
+	const bool write = is_write(instrs);
+	std::vector<s_path> paths;
+	s_path path;
+
+	path.states.push_back(0);
+	walk_paths(instrs,write,gpifreadycfg5,path,paths);
+
+	lst << std::dec << std::nouppercase << std::fixed << std::setprecision(3)
+		<< ";\n;\tAnalysis (IFCLK " << ifclk << " MHz, "
+		<< (wordwide ? 16 : 8) << "-bit bus, "
+		<< (async ? "async" : "sync") << ", FIFO "
+		<< (write ? "write" : "read") << "):\n;\n";
+
+	if ( paths.empty() ) {
+		lst << ";\tState 0 never reaches idle state 7 without waiting.\n;\n";
+		return;
+	}
+
+	auto worst_cycles = [&](const s_path& p) {
+		return p.cycles + (async ? 2 * p.rdywaits : 0);
+	};
+	const s_path *best = &paths[0], *worst = &paths[0];
+
+	for ( auto& p : paths ) {
+		if ( p.cycles < best->cycles )
+			best = &p;
+		if ( worst_cycles(p) > worst_cycles(*worst) )
+			worst = &p;
+	}
+
+	auto report = [&](const char *what,const s_path& p,unsigned cycles) {
+		lst << ";\t" << what << '\t' << cycles << " cycles\t";
+		for ( auto sx : p.states )
+			lst << '$' << sx << ' ';
+		lst << "\n;\t\t\t" << p.xfers << " bytes (8-bit), "
+			<< 2 * p.xfers << " bytes (16-bit), "
+			<< double(p.xfers * (wordwide ? 2 : 1)) * ifclk / cycles << " MB/s\n";
+	};
+
+	report("Best case",*best,best->cycles);
+	report("Worst case",*worst,worst_cycles(*worst));
+	lst << ";\tPaths\t\t" << paths.size() << '\n';
+
+	for ( unsigned sx=0; sx<7; ++sx ) {
+		const s_instr& instr = instrs[sx];
+
+		if ( !instr.opcode.bits.dp )
+			continue;
+		if ( instr.branch.bits.branch0 != sx && instr.branch.bits.branch1 != sx )
+			continue;
+		if ( instr.branch.bits.reexecute && transfers(instr,write) )
+			lst << ";\tBurst\t\t$" << sx << " re-executes, "
+				<< (wordwide ? 2 : 1) * ifclk << " MB/s while looping\n";
+		else	lst << ";\tWait\t\t$" << sx << " loops until its inputs change\n";
+	}
+	lst << ";\n";
+}
+
+//////////////////////////////////////////////////////////////////////
+// Predict the sustained MB/s of a FIFO waveform streaming through its
+// .EP to or from the host, and name the stage that limits it:
+//
+//	GPIF waveform	Bytes per transaction at the best case cycles
+//	EP buffering	The GPIF stalls once the .EPBUF x 512-byte
+//			buffers fill (or drain) while the host is idle
+//	Commit		Firmware commits each packet, unless .AUTOCOMMIT
+//	USB bulk	13 x 512-byte high speed packets per microframe
+//	Host queue	With one request queued, a microframe is lost
+//			between requests
+//
+// A read waveform feeds an IN endpoint, and a write waveform (one that
+// uses NEXT) drains an OUT endpoint. Returns false when .EPBUF is not
+// possible for .EP.
+//////////////////////////////////////////////////////////////////////
+
+static bool
+plan_transfers(const std::vector<s_instr>& instrs,const std::map<unsigned,unsigned>& environ,
+  const s_options& opts,std::ostream& lst,std::vector<s_diagnostic>& errors) {
+	static const double packet = 512.0;		// High speed bulk packet
+	static const double microframe = 125.0;		// us
+	static const double commit_us = 80 / 48.0;	// 20 8051 instructions at 48 MHz
+	const double ifclk = environ.at(unsigned(PseudoOps::IfClk));
+	const bool wordwide = environ.at(unsigned(PseudoOps::WordWide));
+	const unsigned ep = environ.at(unsigned(PseudoOps::Ep));
+	const unsigned epbuf = environ.at(unsigned(PseudoOps::EpBuf));
+	const bool autocommit = environ.at(unsigned(PseudoOps::AutoCommit));
+	const bool write = is_write(instrs);
+	const double request = opts.request;
+	const char *autoname = write ? "AUTOOUT" : "AUTOIN";
+	std::vector<s_path> paths;
+	s_path path;
+
+	if ( (ep == 4 || ep == 8) && epbuf > 2 ) {
+		lst << "*** ERROR: EP" << ep << " is only double buffered (.EPBUF 2)\n";
+		errors.push_back("EP" + std::to_string(ep) + " is only double buffered (.EPBUF 2)");
+		return false;
+	}
+
+	path.states.push_back(0);
+	walk_paths(instrs,write,environ.at(unsigned(PseudoOps::GpifReadyCfg5)),path,paths);
+
+	lst << std::dec << std::nouppercase << std::fixed << std::setprecision(3)
+		<< ";\n;\tTransfer plan (EP" << ep << (write ? " OUT, " : " IN, ")
+		<< epbuf << " x 512-byte buffers, " << (autocommit ? autoname : "firmware commit")
+		<< ", host queue " << opts.hostqueue << " x " << opts.request << " bytes):\n;\n";
+
+	const s_path *best = nullptr;
+
+	for ( auto& p : paths )
+		if ( p.xfers > 0 && (!best || p.xfers * best->cycles > best->xfers * p.cycles) )
+			best = &p;
+	if ( !best ) {
+		lst << ";\tNo path from state 0 to idle moves data without waiting.\n;\n";
+		return true;
+	}
+
+	// Rates are in bytes per us, or MB/s
+	const double gpif = best->xfers * (wordwide ? 2 : 1) * ifclk / best->cycles;
+	const double usb = 13 * packet / microframe;
+	const double gap = opts.hostqueue > 1 ? 0.0 : microframe;	// Host idle per request
+	const double fill = epbuf * packet / gpif;			// Buffers hide this much
+	std::vector<std::pair<const char *,double>> stages = {
+		{ "GPIF waveform",	gpif },
+		{ "EP buffering",	request / (request / gpif + std::max(0.0,gap - fill)) },
+		{ "Commit",		autocommit ? 0.0 : packet / commit_us },
+		{ "USB bulk",		usb },
+		{ "Host queue",		request / (request / usb + gap) },
+	};
+	const std::pair<const char *,double> *limit = nullptr;
+
+	for ( auto& stage : stages ) {
+		if ( stage.second <= 0.0 )
+			continue;
+		lst << ";\t" << stage.first << (strlen(stage.first) < 8 ? "\t\t" : "\t") << std::setw(8) << std::setfill(' ') << stage.second << " MB/s\n";
+		if ( !limit || stage.second < limit->second )
+			limit = &stage;
+	}
+	lst << ";\tSustained\t" << std::setw(8) << limit->second << " MB/s, limited by "
+		<< limit->first << "\n;\n";
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Check the .MINPULSE, .SETUP and .HOLD constraints of a section on
+// every path from state 0 to idle, taking each DP decision without
+// waiting (waits only lengthen pulses and data). Each path is laid
+// out cycle by cycle from idle to idle, with CTLn asserted when it
+// differs from its .IDLECTL level:
+//
+//	.MINPULSE CTLn ns	Each asserted run of CTLn lasts >= ns
+//	.SETUP	CTLn ns		DATA states run >= ns before CTLn asserts
+//	.HOLD	CTLn ns		DATA states run >= ns after CTLn releases
+//
+// .SETUP and .HOLD apply to the paths that have DATA states. The
+// smallest slack of each constraint is listed, and a negative slack
+// is an error, naming the path.
+//////////////////////////////////////////////////////////////////////
+
+static void
+check_timing(const s_section& section,std::ostream& lst,std::vector<s_diagnostic>& errors) {
+	const std::map<unsigned,unsigned>& environ = section.environ;
+	const std::vector<s_instr>& instrs = section.instrs;
+	const double ifclk = environ.at(unsigned(PseudoOps::IfClk));
+	const double period = 1000.0 / ifclk;
+	const unsigned idle = environ.at(unsigned(PseudoOps::IdleCtl));
+	const auto& oemap = oetab.at(environ.at(unsigned(PseudoOps::Trictl)));
+	std::vector<s_path> paths;
+	s_path path;
+
+	path.states.push_back(0);
+	walk_paths(instrs,is_write(instrs),environ.at(unsigned(PseudoOps::GpifReadyCfg5)),path,paths);
+
+	lst << std::dec << std::nouppercase << std::fixed << std::setprecision(3)
+		<< ";\n;\tTiming (IFCLK " << ifclk << " MHz, " << period << " ns per cycle):\n;\n";
+
+	if ( paths.empty() ) {
+		lst << ";\tState 0 never reaches idle state 7 without waiting.\n;\n";
+		return;
+	}
+
+	for ( auto& constraint : section.timing ) {
+		const std::string name(constraint.stropcode);
+		auto it = oemap.find(constraint.stroperands[0]);
+		std::string nstext(constraint.stroperands[1]);
+		char *ep = nullptr;
+		const double ns = strtod(nstext.c_str(),&ep);
+
+		lst << ";\t" << name << '\t' << constraint.stroperands[0] << ' ' << nstext << "\t";
+		if ( it == oemap.end() ) {
+			lst << "*** ERROR\n";
+			errors.push_back(where(constraint,"Invalid output '" + std::string(constraint.stroperands[0]) + "' for " + name));
+			continue;
+		}
+		if ( (ep && *ep) || !(ns >= 0.0) ) {
+			lst << "*** ERROR\n";
+			errors.push_back(where(constraint,"Invalid ns '" + nstext + "' for " + name));
+			continue;
+		}
+
+		const unsigned bit = it->second;
+		bool applies = false;
+		double slack = 0.0;
+		const s_path *worst = nullptr;
+
+		for ( auto& p : paths ) {
+			std::vector<bool> asserted, data;
+
+			for ( auto sx : p.states ) {
+				const s_instr& instr = instrs[sx];
+
+				for ( unsigned cx = interval(instr); cx > 0; --cx ) {
+					asserted.push_back((instr.output.byte ^ idle) >> bit & 1);
+					data.push_back(instr.opcode.bits.data);
+				}
+			}
+
+			const int ncycles = asserted.size();
+			const bool hasdata = std::find(data.begin(),data.end(),true) != data.end();
+
+			auto is_asserted = [&](int cx) {
+				return cx >= 0 && cx < ncycles && asserted[cx];
+			};
+			auto is_data = [&](int cx) {
+				return cx >= 0 && cx < ncycles && data[cx];
+			};
+			auto measure = [&](double value) {
+				if ( !applies || value - ns < slack ) {
+					slack = value - ns;
+					worst = &p;
+				}
+				applies = true;
+			};
+
+			for ( int cx=0; cx <= ncycles; ++cx ) {
+				bool rises = is_asserted(cx) && !is_asserted(cx-1);
+				bool falls = !is_asserted(cx) && is_asserted(cx-1);
+				int run = 0;
+
+				if ( name == ".MINPULSE" && rises ) {
+					while ( is_asserted(cx+run) )
+						++run;
+					measure(run * period);
+				} else if ( name == ".SETUP" && rises && hasdata ) {
+					while ( is_data(cx-1-run) )
+						++run;
+					measure(run * period);
+				} else if ( name == ".HOLD" && falls && hasdata ) {
+					while ( is_data(cx+run) )
+						++run;
+					measure(run * period);
+				}
+			}
+		}
+
+		if ( !applies ) {
+			lst << "not on any path\n";
+			continue;
+		}
+
+		std::ostringstream states;
+
+		for ( auto sx : worst->states )
+			states << " $" << sx;
+		lst << std::setfill(' ') << std::setw(9) << slack << " ns slack\t" << states.str().substr(1) << '\n';
+
+		if ( slack < 0.0 ) {
+			std::ostringstream msg;
+
+			msg << std::fixed << std::setprecision(3) << name << ' ' << constraint.stroperands[0] << ' ' << nstext
+				<< " ns violated by " << -slack << " ns on path" << states.str();
+			lst << "*** ERROR: " << msg.str() << '\n';
+			errors.push_back(where(constraint,msg.str()));
+		}
+	}
+	lst << ";\n";
+}
+
+//////////////////////////////////////////////////////////////////////
+// Encode the opcodes and operands of the states, subject to environ.
+// Problems are noted in each instr.error.
+//////////////////////////////////////////////////////////////////////
+
+void
+encode(std::vector<s_instr>& instrs,const std::map<unsigned,unsigned>& environ) {
+	const unsigned trictl = environ.at(unsigned(PseudoOps::Trictl));
+	const unsigned gpifreadycfg5 = environ.at(unsigned(PseudoOps::GpifReadyCfg5));
+	const unsigned gpifreadycfg7 = environ.at(unsigned(PseudoOps::GpifReadyCfg7));
+	const unsigned epxgpifflgsel = environ.at(unsigned(PseudoOps::EpxGpifFlgSel));
+
+	for ( auto& instr : instrs ) {
+		// Parse opcode:
+		for ( auto c : instr.stropcode ) {
+			const int bit = opcode_bit(c);
+
+			if ( bit >= 0 ) {
+				instr.opcode.byte |= bit;
+			} else if ( c == '*' && instr.opcode.bits.dp ) {
+				instr.branch.bits.reexecute = 1;
+			} else	{
+				std::stringstream ss;
+
+				ss << "Unknown opcode '" << c << "'";
+				instr.error = ss.str();
+			}
+		}
+
+		// Parse operands:
+		if ( instr.opcode.bits.dp ) {
+			// DP
+			if ( instr.stroperands.size() < 3 ) {
+				instr.error = "missing operand A func B";
+				continue;
+			}
+			std::string_view opera = instr.stroperands[0];
+			std::string_view func  = instr.stroperands[1];
+			std::string_view operb = instr.stroperands[2];
+			auto& opermap = opertab.at(gpifreadycfg5).at(epxgpifflgsel).at(gpifreadycfg7);
+
+			{
+				auto it = opermap.find(opera);
+				if ( it == opermap.end() ) {
+					std::stringstream ss;
+					ss << "Invalid operand A '" << opera << "'";
+					instr.error = ss.str();
+					continue;
+				}
+				instr.logfunc.bits.terma = it->second;
+			}
+
+			{
+				auto it = opermap.find(operb);
+				if ( it == opermap.end() ) {
+					std::stringstream ss;
+					ss << "Invalid operand B '" << operb << "'\n"
+						<< "  Must be one of: ";
+					for ( auto& pair : opermap )
+						ss << pair.first << ' ';
+					instr.error = ss.str();
+					continue;
+				}
+				instr.logfunc.bits.termb = it->second;
+			}
+
+			{
+				auto it = functab.find(func);
+
+				if ( it == functab.end() ) {
+					std::stringstream ss;
+					ss << "Invalid function '" << func << "'";
+					instr.error = ss.str();
+					continue;
+				}
+				instr.logfunc.bits.lfunc = it->second;
+			}
+
+			instr.branch.bits.branch0 = instr.branch.bits.branch1 = 7;	// Default to state 7
+			unsigned statex = 0;
+
+			for ( unsigned ox=3; ox<instr.stroperands.size(); ++ox ) {
+				std::string_view operand = instr.stroperands[ox];
+				const auto& oemap = oetab.at(trictl);
+
+				if ( !operand.empty() && operand[0] == '$' ) {
+					unsigned long state = 0;
+
+					if ( !to_unsigned(operand.substr(1),state) || state > 7 || (state != 7 && state > instrs.size()) ) {
+						std::stringstream ss;
+						ss << "invalid target state '" << operand << "'";
+						instr.error = ss.str();
+						break;
+					}
+
+					switch ( statex++ ) {
+					case 0:
+						instr.branch.bits.branch0 = state;
+						break;
+					case 1:
+						instr.branch.bits.branch1 = state;
+						break;
+					default:
+						{
+							std::stringstream ss;
+							ss << "Too many target states starting with '" << operand << "'";
+							instr.error = ss.str();
+						}
+					}
+					if ( !instr.error.empty() )
+						break;
+				} else	{
+					auto it = oemap.find(operand);
+					if ( it == oemap.end() ) {
+						std::stringstream ss;
+						ss << "invalid operand '" << operand << "' (TRICTL=" << trictl << ")\n"
+							<< "  Must be one of: ";
+						for ( auto& pair : oemap )
+							ss << pair.first << ' ';
+						instr.error = ss.str();
+						break;
+					}
+					unsigned shift = it->second;
+					instr.output.byte |= 1 << shift;
+				}
+			}
+			if ( instr.error.empty() && statex != 2 ) {
+				std::stringstream ss;
+				instr.error = "Branch0 and/or branch1 states were not specified.";
+			}
+		} else	{
+			// NDP
+			instr.branch.byte = 1;		// Default to a 1-count
+
+			for ( auto& operand : instr.stroperands ) {
+				if ( operand[0] >= '0' && operand[0] <= '9' ) {
+					// Count
+					unsigned long count = 0;
+					std::stringstream ss;
+
+					if ( !to_unsigned(operand,count) ) {
+						ss << "Invalid count '" << operand << "'";
+						instr.error = ss.str();
+					} else if ( count > 256 ) {
+						ss << "Invalid count value " << count;
+						instr.error = ss.str();
+					} else	{
+						if ( count == 256 )
+							count = 0u;
+						instr.branch.byte = count;
+					}
+				} else	{
+					// Bits
+					const auto& oemap = oetab.at(trictl);
+
+					auto it = oemap.find(operand);
+					if ( it == oemap.end() ) {
+						std::stringstream ss;
+						ss << "invalid operand '" << operand << "' (TRICTL=" << trictl << ")\n"
+							<< "  Must be one of: ";
+						for ( auto& pair : oemap )
+							ss << pair.first << ' ';
+						instr.error = ss.str();
+						break;
+					}
+					unsigned shift = it->second;
+					instr.output.byte |= 1 << shift;
+				}
+			}
+		}
+	}
+}
+
+//////////////////////////////////////////////////////////////////////
+// Encode the 9-byte FlowStates[] block of a section: FLOWSTATE,
+// FLOWLOGIC, FLOWEQ0CTL, FLOWEQ1CTL, FLOWHOLDOFF, FLOWSTB,
+// FLOWSTBEDGE, FLOWSTBHPERIOD and a reserved 0. FLOWLOGIC has the
+// layout of a DP state's LFun byte, and FLOWEQnCTL of its Output.
+// The block stays zeroed without a .FLOWSTATE. Returns false with
+// the diagnostic in error.
+//////////////////////////////////////////////////////////////////////
+
+static bool
+encode_flow(s_section& section,s_diagnostic& error) {
+	const std::map<unsigned,unsigned>& environ = section.environ;
+	const unsigned flowstate = environ.at(unsigned(PseudoOps::FlowState));
+	const unsigned trictl = environ.at(unsigned(PseudoOps::Trictl));
+	auto& opermap = opertab.at(environ.at(unsigned(PseudoOps::GpifReadyCfg5)))
+		.at(environ.at(unsigned(PseudoOps::EpxGpifFlgSel)))
+		.at(environ.at(unsigned(PseudoOps::GpifReadyCfg7)));
+	const auto& oemap = oetab.at(trictl);
+	auto& flow = section.flow;
+
+	flow.fill(0);
+	if ( flowstate > 6 )
+		return true;			// No flow state
+	if ( flowstate >= section.instrs.size() ) {
+		error = ".FLOWSTATE " + std::to_string(flowstate) + " is not a state of this waveform";
+		return false;
+	}
+
+	flow[0] = 0x80 | flowstate;		// FSE
+	flow[4] = environ.at(unsigned(PseudoOps::FlowHoldOff));
+	flow[5] = environ.at(unsigned(PseudoOps::FlowStb));
+	flow[6] = environ.at(unsigned(PseudoOps::FlowStbEdge));
+	flow[7] = environ.at(unsigned(PseudoOps::FlowStbHPeriod));
+
+	auto it = section.flowterms.find(unsigned(PseudoOps::FlowLogic));
+	if ( it != section.flowterms.end() ) {
+		const s_instr& instr = it->second;
+		auto ita = opermap.find(instr.stroperands[0]);
+		auto itf = functab.find(instr.stroperands[1]);
+		auto itb = opermap.find(instr.stroperands[2]);
+		u_logfunc logfunc;
+
+		if ( ita == opermap.end() || itf == functab.end() || itb == opermap.end() ) {
+			error = where(instr,"Invalid .FLOWLOGIC, must be A OP B");
+			return false;
+		}
+		logfunc.byte = 0;
+		logfunc.bits.terma = ita->second;
+		logfunc.bits.lfunc = itf->second;
+		logfunc.bits.termb = itb->second;
+		flow[1] = logfunc.byte;
+	}
+
+	for ( unsigned fx=0; fx<2; ++fx ) {
+		auto it = section.flowterms.find(unsigned(fx ? PseudoOps::FlowEq1Ctl : PseudoOps::FlowEq0Ctl));
+
+		if ( it == section.flowterms.end() )
+			continue;
+		for ( auto& operand : it->second.stroperands ) {
+			if ( operand == "0" )
+				continue;		// No outputs high
+
+			auto ito = oemap.find(operand);
+			if ( ito == oemap.end() ) {
+				error = where(it->second,"invalid operand '" + std::string(operand)
+					+ "' (TRICTL=" + std::to_string(trictl) + ")");
+				return false;
+			}
+			flow[2 + fx] |= 1 << ito->second;
+		}
+	}
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////
+// List the environment and the encoded states to lst. Returns false
+// when there are too many states.
+//////////////////////////////////////////////////////////////////////
+
+static bool
+list(const std::vector<s_instr>& instrs,const std::map<unsigned,unsigned>& environ,
+  std::ostream& lst,std::vector<s_diagnostic>& errors) {
+	unsigned state = 0;
+
+	auto revlookup = [&](unsigned ps) -> std::string {
+		for ( auto pair : pseudotab ) {
+			const std::string& op = pair.first;
+			const unsigned u = pair.second;
+			
+			if ( ps == u )
+				return op;
+		}
+		assert(0);
+	};
+
+	lst << ";\n;\tEnvironment in effect:\n"
+		<< ";\n";
+
+	for ( auto& pair : environ ) {
+		const unsigned ps = pair.first;
+		const unsigned value = pair.second;
+		const std::string& op = revlookup(ps);
+		const std::array<const char *,3> opers = { { "PF", "EF", "FF" } };
+
+		switch ( PseudoOps(ps) ) {
+		case PseudoOps::Trictl:
+		case PseudoOps::GpifReadyCfg5:
+		case PseudoOps::GpifReadyCfg7:
+		case PseudoOps::Ep:
+		case PseudoOps::WaveForm:
+		case PseudoOps::IfClk:
+		case PseudoOps::WordWide:
+		case PseudoOps::Async:
+		case PseudoOps::IdleCtl:
+			lst << '\t' << op << '\t' << value << '\n';
+			break;
+		case PseudoOps::EpxGpifFlgSel:
+			lst << '\t' << op << '\t' << opers[value] << '\n';
+			break;
+		case PseudoOps::FlowState:
+		case PseudoOps::FlowHoldOff:
+		case PseudoOps::FlowStb:
+		case PseudoOps::FlowStbHPeriod:
+			if ( environ.at(unsigned(PseudoOps::FlowState)) < 7 )
+				lst << '\t' << op << '\t' << value << '\n';
+			break;
+		case PseudoOps::FlowStbEdge:
+			if ( environ.at(unsigned(PseudoOps::FlowState)) < 7 ) {
+				for ( auto& pair : stbedgetab )
+					if ( unsigned(pair.second) == value )
+						lst << '\t' << op << '\t' << pair.first << '\n';
+			}
+			break;
+		case PseudoOps::EpBuf:			// Shown when not the default
+		case PseudoOps::AutoCommit:
+			if ( environ.at(unsigned(PseudoOps::EpBuf)) != 2 || !environ.at(unsigned(PseudoOps::AutoCommit)) )
+				lst << '\t' << op << '\t' << value << '\n';
+			break;
+		case PseudoOps::FlowLogic:		// Kept in s_section::flowterms
+		case PseudoOps::FlowEq0Ctl:
+		case PseudoOps::FlowEq1Ctl:
+		case PseudoOps::MinPulse:		// Kept in s_section::timing
+		case PseudoOps::Setup:
+		case PseudoOps::Hold:
+			break;
+		}
+	}
+	lst << ";\n";
+
+	for ( auto& instr : instrs ) {
+		lst << '$' << state++ << "  ";
+
+		lst.width(2);
+		lst.fill('0');
+		lst << std::uppercase << std::hex << unsigned(instr.branch.byte);
+
+		lst.fill('0');
+		lst.width(2);
+		lst << std::hex << unsigned(instr.opcode.byte);
+
+		lst.width(2);
+		lst.fill('0');
+		lst << std::hex << unsigned(instr.logfunc.byte);
+
+		lst.fill('0');
+		lst.width(2);
+		lst << std::hex << unsigned(instr.output.byte);
+
+		lst << '\t' << instr.stropcode << '\t';
+		for ( auto& operand : instr.stroperands )
+			lst << operand << " ";
+		if ( !instr.strcomment.empty() )
+			lst << "\t; " << instr.strcomment;
+		lst << '\n';
+		if ( !instr.error.empty() ) {
+			lst << "*** ERROR: " << instr.error << '\n';
+			errors.push_back(where(instr,"$" + std::to_string(state-1) + ": " + instr.error));
+		}
+		if ( state > 7 ) {
+			lst << "*** ERROR: Too many states. Limit is 6 states max.\n";
+			errors.push_back("Too many states. Limit is 6 states max.");
+			return false;
+		}
+	}
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Emit one waveform as a 32-byte C array
+//////////////////////////////////////////////////////////////////////
+
+static void
+emit_waveform(std::ostream& out,unsigned waveformx,const std::vector<s_instr>& instrs) {
+	out << "static unsigned char waveform" << waveformx << "[32] = { \n\t";
+
+	for ( auto& instr : instrs ) {
+		out << "0x";
+		out.width(2);
+		out.fill('0');
+		out << std::uppercase << std::hex << unsigned(instr.branch.byte) << ',';
+	}			
+	out << "\n\t";
+
+	for ( auto& instr : instrs ) {
+		out << "0x";
+		out.fill('0');
+		out.width(2);
+		out << std::hex << unsigned(instr.opcode.byte) << ',';
+	}
+	out << "\n\t";
+
+	for ( auto& instr : instrs ) {
+		out << "0x";
+		out.fill('0');
+		out.width(2);
+		out << std::hex << unsigned(instr.output.byte) << ',';
+	}
+	out << "\n\t";
+
+	for ( auto& instr : instrs ) {
+		out << "0x";
+		out.width(2);
+		out.fill('0');
+		out << std::hex << unsigned(instr.logfunc.byte) << ',';
+	}
+
+	out << "\n};\n\n";
+}
+
+//////////////////////////////////////////////////////////////////////
+// Metrics of one section as a JSON object, for -o json: its states
+// and encoded bytes, the best and worst case cycles and bytes per
+// transaction (as for -a) and the worst case MB/s. Each state gives
+// its encoded bytes (branch, opcode, logfunc, output) and source text
+// for compare_metrics().
+//////////////////////////////////////////////////////////////////////
+
+static std::string
+json_string(std::string_view text) {
+	std::string quoted("\"");
+
+	for ( char ch : text ) {
+		if ( ch == '"' || ch == '\\' )
+			quoted += '\\';
+		if ( (unsigned char)ch >= ' ' )
+			quoted += ch;
+	}
+	return quoted + '"';
+}
+
+static std::string
+wave_metrics(const s_section& section,unsigned nstates) {
+	const std::map<unsigned,unsigned>& environ = section.environ;
+	const std::vector<s_instr>& instrs = section.instrs;
+	const double ifclk = environ.at(unsigned(PseudoOps::IfClk));
+	const unsigned width = environ.at(unsigned(PseudoOps::WordWide)) ? 2 : 1;
+	const bool async = environ.at(unsigned(PseudoOps::Async));
+	std::vector<s_path> paths;
+	s_path path;
+	std::ostringstream json;
+
+	path.states.push_back(0);
+	walk_paths(instrs,is_write(instrs),environ.at(unsigned(PseudoOps::GpifReadyCfg5)),path,paths);
+
+	auto worst_cycles = [&](const s_path& p) {
+		return p.cycles + (async ? 2 * p.rdywaits : 0);
+	};
+	const s_path *best = nullptr, *worst = nullptr;
+
+	for ( auto& p : paths ) {
+		if ( !best || p.cycles < best->cycles )
+			best = &p;
+		if ( !worst || worst_cycles(p) > worst_cycles(*worst) )
+			worst = &p;
+	}
+
+	json << std::fixed << std::setprecision(3)
+		<< "{\"waveform\":" << environ.at(unsigned(PseudoOps::WaveForm))
+		<< ",\"states\":" << nstates
+		<< ",\"bytes\":" << nstates * 4
+		<< ",\"paths\":" << paths.size()
+		<< ",\"cycles_best\":" << (best ? best->cycles : 0)
+		<< ",\"cycles_worst\":" << (worst ? worst_cycles(*worst) : 0)
+		<< ",\"bytes_best\":" << (best ? best->xfers * width : 0)
+		<< ",\"bytes_worst\":" << (worst ? worst->xfers * width : 0)
+		<< ",\"mbps\":" << (worst ? worst->xfers * width * ifclk / worst_cycles(*worst) : 0.0)
+		<< ",\"state\":[";
+
+	for ( unsigned sx=0; sx < nstates; ++sx ) {
+		const s_instr& instr = instrs[sx];
+		char code[12];
+		std::string text(instr.stropcode);
+
+		for ( auto& operand : instr.stroperands )
+			text += ' ' + std::string(operand);
+		snprintf(code,sizeof code,"%02X%02X%02X%02X",unsigned(instr.branch.byte),
+			unsigned(instr.opcode.byte),unsigned(instr.logfunc.byte),unsigned(instr.output.byte));
+		json << (sx ? "," : "") << "{\"code\":\"" << code << "\",\"text\":" << json_string(text) << '}';
+	}
+	json << "]}";
+	return json.str();
+}
+
+static void
+emit_metrics(std::ostream& out,const std::vector<std::string>& metrics) {
+	out << "{\"ezusbcc\":\"" << EZUSBCC_VERSION << "\",\"waveforms\":[\n";
+	for ( size_t mx=0; mx < metrics.size(); ++mx )
+		out << metrics[mx] << (mx + 1 < metrics.size() ? ",\n" : "\n");
+	out << "]}\n";
+}
+
+//////////////////////////////////////////////////////////////////////
+// Emit all four waveform slots as the 128-byte WaveData[] that
+// GpifInit() copies into waveform memory at 0xE400. Each wave has
+// rows of LenBr, Opcode, Output and LFun bytes for states 0 to 7.
+// Slots without a section are left zeroed.
+//////////////////////////////////////////////////////////////////////
+
+static void
+emit_wavedata(std::ostream& out,const std::vector<s_section>& sections) {
+	static const std::array<const char *,4> rows = { {
+		"/* LenBr */", "/* Opcode*/", "/* Output*/", "/* LFun  */"
+	} };
+	std::array<const s_section *,4> slots = { { nullptr, nullptr, nullptr, nullptr } };
+
+	for ( auto& section : sections )
+		slots[section.environ.at(unsigned(PseudoOps::WaveForm))] = &section;
+
+	out << "const char xdata WaveData[128] =\n{\n";
+	for ( unsigned wx=0; wx<4; ++wx ) {
+		out << "// Wave " << wx << '\n';
+		for ( unsigned rx=0; rx<4; ++rx ) {
+			out << rows[rx];
+			for ( unsigned sx=0; sx<8; ++sx ) {
+				unsigned byte = 0;
+
+				if ( slots[wx] ) {
+					const s_instr& instr = slots[wx]->instrs[sx];
+
+					switch ( rx ) {
+					case 0:
+						byte = instr.branch.byte;
+						break;
+					case 1:
+						byte = instr.opcode.byte;
+						break;
+					case 2:
+						byte = instr.output.byte;
+						break;
+					default:
+						byte = instr.logfunc.byte;
+					}
+				}
+				out << " 0x";
+				out.width(2);
+				out.fill('0');
+				out << std::uppercase << std::hex << byte << ',';
+			}
+			out << '\n';
+		}
+	}
+	out << "};\n\n";
+}
+
+//////////////////////////////////////////////////////////////////////
+// Flow state registers, in FlowStates[] order from 0xE6C6
+//////////////////////////////////////////////////////////////////////
+
+static const std::array<const char *,8> flownames = { {
+	"FLOWSTATE", "FLOWLOGIC", "FLOWEQ0CTL", "FLOWEQ1CTL",
+	"FLOWHOLDOFF", "FLOWSTB", "FLOWSTBEDGE", "FLOWSTBHPERIOD"
+} };
+
+static const unsigned flowstate_addr = 0xE6C6;
+
+// The first section with a .FLOWSTATE, else nullptr
+static const s_section *
+first_flow(const std::vector<s_section>& sections) {
+	for ( auto& section : sections )
+		if ( section.flow[0] )
+			return &section;
+	return nullptr;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Emit the 9-byte flow state blocks, as FlowStates[36] for all four
+// slots like the Cypress gpif.c, or as flowstatesN[9] beside a
+// single waveformN[32].
+//////////////////////////////////////////////////////////////////////
+
+static void
+emit_flowstates(std::ostream& out,const std::vector<s_section>& sections,bool wavedata) {
+	std::array<std::array<uint8_t,9>,4> flows = { };
+	char buf[8];
+
+	if ( !wavedata ) {
+		const s_section& section = sections[0];
+
+		out << "static unsigned char flowstates" << section.environ.at(unsigned(PseudoOps::WaveForm)) << "[9] = {\n\t";
+		for ( auto byte : section.flow ) {
+			snprintf(buf,sizeof buf,"0x%02X,",byte);
+			out << buf;
+		}
+		out << "\n};\n\n";
+		return;
+	}
+
+	for ( auto& section : sections )
+		flows[section.environ.at(unsigned(PseudoOps::WaveForm))] = section.flow;
+
+	out << "const char xdata FlowStates[36] =\n{\n";
+	for ( unsigned wx=0; wx<4; ++wx ) {
+		out << "/* Wave " << wx << " FlowStates */ ";
+		for ( auto byte : flows[wx] ) {
+			snprintf(buf,sizeof buf,"0x%02X,",byte);
+			out << buf;
+		}
+		out << '\n';
+	}
+	out << "};\n\n";
+}
+
+//////////////////////////////////////////////////////////////////////
+// The waveform memory image, in the same row order as the C arrays.
+// A single section is the 32 bytes of its slot at 0xE400 + 32 * n,
+// else all four slots are the 128 bytes at 0xE400.
+//////////////////////////////////////////////////////////////////////
+
+static const unsigned waveform_addr = 0xE400;	// GPIF waveform memory
+
+static std::vector<uint8_t>
+wave_image(const std::vector<s_section>& sections,unsigned& addr) {
+	std::vector<uint8_t> image(sections.size() == 1 ? 32 : 128,0);
+
+	addr = waveform_addr;
+	for ( auto& section : sections ) {
+		unsigned offset = 32 * section.environ.at(unsigned(PseudoOps::WaveForm));
+
+		if ( sections.size() == 1 ) {
+			addr += offset;
+			offset = 0;
+		}
+		for ( unsigned sx=0; sx<8; ++sx ) {
+			const s_instr& instr = section.instrs[sx];
+
+			image[offset + sx] = instr.branch.byte;
+			image[offset + 8 + sx] = instr.opcode.byte;
+			image[offset + 16 + sx] = instr.output.byte;
+			image[offset + 24 + sx] = instr.logfunc.byte;
+		}
+	}
+	return image;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Emit the image as Intel HEX data records of 16 bytes, then the
+// end of file record.
+//////////////////////////////////////////////////////////////////////
+
+static void
+emit_ihex(std::ostream& out,unsigned addr,const std::vector<uint8_t>& image) {
+	char buf[16];
+
+	for ( size_t ix=0; ix < image.size(); ix += 16 ) {
+		unsigned count = std::min<size_t>(16,image.size() - ix);
+		unsigned at = addr + ix;
+		unsigned sum = count + (at >> 8) + (at & 0xFF);
+
+		snprintf(buf,sizeof buf,":%02X%04X00",count,at);
+		out << buf;
+		for ( unsigned bx=0; bx < count; ++bx ) {
+			snprintf(buf,sizeof buf,"%02X",image[ix+bx]);
+			out << buf;
+			sum += image[ix+bx];
+		}
+		snprintf(buf,sizeof buf,"%02X\n",(0x100 - (sum & 0xFF)) & 0xFF);
+		out << buf;
+	}
+	out << ":00000001FF\n";
+}
+
+//////////////////////////////////////////////////////////////////////
+// Emit the image as a stream of register writes, 3 bytes each:
+// address high, address low, value. The loader stores each value
+// at its XDATA address, so the stream can be sent in one vendor
+// request or kept in EEPROM.
+//////////////////////////////////////////////////////////////////////
+
+static void
+emit_regwrite(std::ostream& out,unsigned addr,unsigned byte) {
+	out.put(char(addr >> 8));
+	out.put(char(addr & 0xFF));
+	out.put(char(byte));
+}
+
+static void
+emit_regwrites(std::ostream& out,unsigned addr,const std::vector<uint8_t>& image) {
+	for ( auto byte : image )
+		emit_regwrite(out,addr++,byte);
+}
+
+//////////////////////////////////////////////////////////////////////
+// GPIF register settings for GpifInit(), from the pseudo ops
+//////////////////////////////////////////////////////////////////////
+
+enum InitRegs {
+	GpifReadyCfg, GpifCtlCfg, GpifIdleCs, GpifIdleCtl, IfConfig, GpifWfSelect, GpifReadyStat
+};
+
+static const std::array<const char *,7> initnames = { {
+	"GPIFREADYCFG", "GPIFCTLCFG", "GPIFIDLECS", "GPIFIDLECTL", "IFCONFIG", "GPIFWFSELECT", "GPIFREADYSTAT"
+} };
+
+static const std::array<unsigned,7> initaddrs = { {
+	0xE6F3, 0xE6C3, 0xE6C1, 0xE6C2, 0xE601, 0xE6C0, 0xE6F4
+} };
+
+static const unsigned gpifabort_addr = 0xE6F5;
+
+struct s_initdata {
+	std::array<uint8_t,7>	regs;		// In InitData[] order
+	std::map<unsigned,uint8_t> flgsel;	// EP n to EPnGPIFFLGSEL
+	const s_section		*flow = nullptr; // Flow state loaded
+};
+
+static unsigned
+epxgpifflgsel_addr(unsigned ep) {
+	return 0xE6D2 + (ep - 2) * 4;		// EP2GPIFFLGSEL, EP4.. at 8 apart
+}
+
+//////////////////////////////////////////////////////////////////////
+// Work out the register values. The settings that are one register
+// for all of GPIF must agree across the sections, as must the flag
+// selected for each .EP. GPIFWFSELECT starts from the usual FIFORD 0,
+// FIFOWR 1, SINGLERD 2, SINGLEWR 3, then the first FIFO read and
+// FIFO write sections (those without SGL) select their own slots.
+//////////////////////////////////////////////////////////////////////
+
+static bool
+init_data(const std::vector<s_section>& sections,s_initdata& init,std::vector<s_diagnostic>& errors) {
+	static const std::array<PseudoOps,6> globals = { {
+		PseudoOps::Trictl, PseudoOps::GpifReadyCfg5, PseudoOps::GpifReadyCfg7,
+		PseudoOps::IfClk, PseudoOps::Async, PseudoOps::IdleCtl
+	} };
+	const std::map<unsigned,unsigned>& env = sections[0].environ;
+	bool fiford = false, fifowr = false;
+	unsigned wfselect = 0xE4;
+
+	for ( auto ps : globals ) {
+		for ( auto& section : sections ) {
+			if ( section.environ.at(unsigned(ps)) != env.at(unsigned(ps)) ) {
+				auto it = std::find_if(pseudotab.begin(),pseudotab.end(),
+					[ps](const std::pair<const std::string,int>& pair) { return pair.second == int(ps); });
+
+				errors.push_back("Every .WAVEFORM must have the same " + it->first + " for GpifInit()");
+				return false;
+			}
+		}
+	}
+
+	for ( auto& section : sections ) {
+		unsigned ep = section.environ.at(unsigned(PseudoOps::Ep));
+		unsigned sel = section.environ.at(unsigned(PseudoOps::EpxGpifFlgSel));
+		unsigned waveformx = section.environ.at(unsigned(PseudoOps::WaveForm));
+		bool sgl = false;
+
+		if ( waveformx > 3 ) {
+			errors.push_back("GpifInit() needs .WAVEFORM 0 to 3");
+			return false;
+		}
+		if ( ep < 2 ) {
+			errors.push_back(".EP must be 2, 4, 6 or 8 for GpifInit()");
+			return false;
+		}
+		auto it = init.flgsel.find(ep);
+		if ( it != init.flgsel.end() && it->second != sel ) {
+			errors.push_back("Waveforms for .EP " + std::to_string(ep) + " select different FIFO flags");
+			return false;
+		}
+		init.flgsel[ep] = sel;
+
+		for ( auto& instr : section.instrs )
+			sgl = sgl || instr.opcode.bits.sgl;
+		if ( sgl )
+			continue;
+		if ( is_write(section.instrs) ) {
+			if ( !fifowr )
+				wfselect = (wfselect & ~0x0Cu) | waveformx << 2;
+			fifowr = true;
+		} else	{
+			if ( !fiford )
+				wfselect = (wfselect & ~0x03u) | waveformx;
+			fiford = true;
+		}
+	}
+
+	init.regs[GpifReadyCfg] = env.at(unsigned(PseudoOps::GpifReadyCfg7)) << 7	// INTRDY
+		| !env.at(unsigned(PseudoOps::Async)) << 6				// SAS
+		| env.at(unsigned(PseudoOps::GpifReadyCfg5)) << 5;			// TCXRDY5
+	init.regs[GpifCtlCfg] = env.at(unsigned(PseudoOps::Trictl)) << 7;		// TRICTL, CMOS
+	init.regs[GpifIdleCs] = 0x00;							// Tristate bus when idle
+	init.regs[GpifIdleCtl] = env.at(unsigned(PseudoOps::IdleCtl));
+	init.regs[IfConfig] = 0x80							// Internal IFCLK
+		| (env.at(unsigned(PseudoOps::IfClk)) == 48) << 6
+		| env.at(unsigned(PseudoOps::Async)) << 3
+		| 0x02;									// GPIF master
+	init.regs[GpifWfSelect] = wfselect;
+	init.regs[GpifReadyStat] = 0x00;
+	init.flow = first_flow(sections);
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Emit InitData[7] in the order of the Cypress gpif.c, and a
+// GpifInit() that stores the settings as immediate values, copies
+// WaveData[] with the dual autopointers in a DJNZ loop, and puts a
+// SYNCDELAY before the registers that need one (TRM 15.14).
+//////////////////////////////////////////////////////////////////////
+
+static void
+emit_gpifinit(std::ostream& out,const s_initdata& init) {
+	char buf[16];
+
+	auto hex = [&](unsigned byte) -> const char * {
+		snprintf(buf,sizeof buf,"0x%02X",byte);
+		return buf;
+	};
+
+	out << "const char xdata InitData[7] =\n{\n/* Regs  */";
+	for ( unsigned rx=0; rx < init.regs.size(); ++rx )
+		out << ' ' << hex(init.regs[rx]) << (rx + 1 < init.regs.size() ? "," : "\n");
+	out << "};\n\n";
+
+	out << "void\nGpifInit(void) {\n"
+		<< "\tBYTE i;\n\n"
+		<< "\tIFCONFIG = " << hex(init.regs[IfConfig]) << ";\t// GPIF master: waveform memory now accessible\n"
+		<< "\tGPIFABORT = 0xFF;\n\n";
+
+	for ( unsigned rx=0; rx < init.regs.size(); ++rx )
+		if ( rx != IfConfig )
+			out << '\t' << initnames[rx] << " = " << hex(init.regs[rx]) << ";\n";
+
+	out << "\n\tAUTOPTRSETUP = 0x07;\t\t// Increment both autopointers\n"
+		<< "\tAUTOPTRH1 = MSB(&WaveData);\n"
+		<< "\tAUTOPTRL1 = LSB(&WaveData);\n"
+		<< "\tAUTOPTRH2 = " << hex(waveform_addr >> 8) << ";\n"
+		<< "\tAUTOPTRL2 = " << hex(waveform_addr & 0xFF) << ";\n"
+		<< "\ti = 128;\n"
+		<< "\tdo\t{\n"
+		<< "\t\tEXTAUTODAT2 = EXTAUTODAT1;\n"
+		<< "\t} while ( --i );\n\n";
+
+	for ( auto& pair : init.flgsel )
+		out << "\tSYNCDELAY;\n"
+			<< "\tEP" << pair.first << "GPIFFLGSEL = " << hex(pair.second) << ";\n";
+
+	out << "\tSYNCDELAY;\n"
+		<< "\tGPIFADRH = 0x00;\n"
+		<< "\tSYNCDELAY;\n"
+		<< "\tGPIFADRL = 0x00;\n";
+
+	if ( init.flow ) {
+		out << "\n\t// Flow state of Wave " << init.flow->environ.at(unsigned(PseudoOps::WaveForm)) << '\n';
+		for ( unsigned fx=0; fx < flownames.size(); ++fx )
+			out << '\t' << flownames[fx] << " = " << hex(init.flow->flow[fx]) << ";\n";
+	}
+	out << "}\n\n";
+}
+
+//////////////////////////////////////////////////////////////////////
+// The cache key: the version, the options that change the output or
+// listing, then for each section its environment and the tokens of
+// its flow pseudo ops and states. Blank lines, layout and the order
+// of the pseudo ops don't change the key.
+//////////////////////////////////////////////////////////////////////
+
+static std::string
+cache_key(const std::vector<s_section>& sections,const s_options& opts) {
+	std::ostringstream key;
+
+	auto tokens = [&](const s_instr& instr) {
+		key << instr.stropcode;
+		for ( auto& operand : instr.stroperands )
+			key << ' ' << operand;
+		if ( !instr.strcomment.empty() )
+			key << " ;" << instr.strcomment;	// Listed
+		key << '\n';
+	};
+
+	key << std::setprecision(17)
+		<< "ezusbcc " << EZUSBCC_VERSION << '\n'
+		<< "options " << opts.optimize << opts.analyze << unsigned(opts.format) << opts.init << '\n';
+	if ( opts.hostqueue )
+		key << "plan " << opts.hostqueue << ' ' << opts.request << '\n';
+	if ( opts.sim.simulate ) {
+		key << "simulate " << opts.sim.trace << opts.sim.wordwide << ' '
+			<< opts.sim.transactions << ' ' << opts.sim.ifclk << '\n';
+		if ( opts.sim.usbrate > 0.0 )
+			key << "fifo " << opts.sim.usbrate << ' ' << opts.sim.pflevel << opts.sim.pfbelow << '\n';
+		for ( auto& stim : opts.sim.stimulus )
+			key << "stimulus " << stim.cycle << ' ' << unsigned(stim.mask) << ' ' << unsigned(stim.value) << '\n';
+	}
+	for ( auto& section : sections ) {
+		key << "section";
+		for ( auto& pair : section.environ )
+			key << ' ' << pair.first << '=' << pair.second;
+		key << '\n';
+		for ( auto& pair : section.flowterms )
+			tokens(pair.second);
+		for ( auto& constraint : section.timing )
+			tokens(constraint);
+		for ( auto& instr : section.instrs )
+			tokens(instr);
+	}
+	return key.str();
+}
+
+//////////////////////////////////////////////////////////////////////
+// 64-bit FNV-1a hash, naming the cache entry file
+//////////////////////////////////////////////////////////////////////
+
+static uint64_t
+fnv1a(std::string_view text) {
+	uint64_t hash = 0xCBF29CE484222325ull;
+
+	for ( unsigned char ch : text ) {
+		hash ^= ch;
+		hash *= 0x100000001B3ull;
+	}
+	return hash;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Cache entries are dir/<hash>.ezc files holding the full key, which
+// is compared on lookup, then the address, image, output and listing,
+// each as a decimal length line followed by the bytes. Entries are
+// written to a temporary file and renamed into place, so a reader
+// never sees a partial entry. Each hit touches its file, so that the
+// oldest modification times are the least recently used.
+//////////////////////////////////////////////////////////////////////
+
+static const char cache_magic[] = "EZUSBCC-CACHE 1\n";
+
+Cache::Cache(const std::string& dir,unsigned long limit) : dir(dir), limit(limit) {
+	struct stat st;
+
+	if ( mkdir(dir.c_str(),0777) != 0 && errno != EEXIST ) {
+		err = std::string(strerror(errno)) + ": Creating cache " + dir;
+		return;
+	}
+	if ( stat(dir.c_str(),&st) != 0 || !S_ISDIR(st.st_mode) ) {
+		err = "Cache " + dir + " is not a directory";
+		return;
+	}
+	evict();			// Counts used
+}
+
+static std::string
+cache_path(const std::string& dir,const std::string& key) {
+	char name[24];
+
+	snprintf(name,sizeof name,"/%016llx.ezc",(unsigned long long)fnv1a(key));
+	return dir + name;
+}
+
+bool
+Cache::lookup(const std::string& key,s_assembly& entry) {
+	const std::string path = cache_path(dir,key);
+	Source src(path.c_str());
+	std::string_view text = src.text();
+	std::string_view fields[5];
+
+	auto next = [&](std::string_view& field) {
+		size_t nl = text.find('\n');
+		unsigned long size = 0;
+
+		if ( nl == std::string_view::npos || !to_unsigned(text.substr(0,nl),size) || size > text.size() - nl - 1 )
+			return false;
+		field = text.substr(nl+1,size);
+		text.remove_prefix(nl + 1 + size);
+		return true;
+	};
+
+	bool found = src.ok() && text.substr(0,sizeof cache_magic - 1) == cache_magic;
+
+	if ( found ) {
+		text.remove_prefix(sizeof cache_magic - 1);
+		for ( auto& field : fields )
+			if ( !(found = next(field)) )
+				break;
+	}
+
+	unsigned long address = 0;
+
+	if ( !found || fields[0] != key || !to_unsigned(fields[1],address) ) {
+		++misses;
+		return false;
+	}
+
+	entry.ok = true;
+	entry.address = address;
+	entry.image.assign(fields[2].begin(),fields[2].end());
+	entry.output = fields[3];
+	entry.listing = fields[4];
+	utimensat(AT_FDCWD,path.c_str(),nullptr,0);
+	++hits;
+	return true;
+}
+
+void
+Cache::store(const std::string& key,const s_assembly& entry) {
+	const std::string path = cache_path(dir,key);
+	std::string tmp = dir + "/.ezcXXXXXX";
+	std::ostringstream data;
+
+	auto field = [&](std::string_view bytes) {
+		data << bytes.size() << '\n' << bytes;
+	};
+
+	data << cache_magic;
+	field(key);
+	field(std::to_string(entry.address));
+	field(std::string_view(reinterpret_cast<const char *>(entry.image.data()),entry.image.size()));
+	field(entry.output);
+	field(entry.listing);
+
+	const std::string bytes = data.str();
+	int fd = mkstemp(&tmp[0]);
+
+	if ( fd < 0 )
+		return;				// A cache that can't be written is only slower
+	fchmod(fd,0644);
+
+	bool ok = write(fd,bytes.data(),bytes.size()) == ssize_t(bytes.size());
+
+	ok = close(fd) == 0 && ok;
+	if ( !ok || rename(tmp.c_str(),path.c_str()) != 0 ) {
+		unlink(tmp.c_str());
+		return;
+	}
+	++stores;
+
+	std::lock_guard<std::mutex> lock(mutex);
+
+	used += bytes.size();
+	if ( limit && used > limit )
+		evict();
+}
+
+//////////////////////////////////////////////////////////////////////
+// Count the bytes held, removing the least recently used entries
+// while over the limit. Other processes may share the directory, so
+// used is recounted here rather than trusted.
+//////////////////////////////////////////////////////////////////////
+
+void
+Cache::evict() {
+	struct s_file {
+		struct timespec	mtime;
+		unsigned long	size;
+		std::string	path;
+	};
+	std::vector<s_file> files;
+	DIR *dp = opendir(dir.c_str());
+	struct dirent *ent;
+
+	used = 0;
+	if ( !dp )
+		return;
+	while ( (ent = readdir(dp)) != nullptr ) {
+		std::string_view name(ent->d_name);
+		struct stat st;
+
+		if ( name.size() < 4 || name.substr(name.size()-4) != ".ezc" )
+			continue;
+
+		std::string path = dir + '/' + ent->d_name;
+
+		if ( stat(path.c_str(),&st) != 0 )
+			continue;
+		files.push_back({ st.st_mtim, (unsigned long)st.st_size, path });
+		used += st.st_size;
+	}
+	closedir(dp);
+
+	if ( !limit || used <= limit )
+		return;
+
+	std::sort(files.begin(),files.end(),[](const s_file& a,const s_file& b) {
+		return a.mtime.tv_sec != b.mtime.tv_sec ? a.mtime.tv_sec < b.mtime.tv_sec : a.mtime.tv_nsec < b.mtime.tv_nsec;
+	});
+	for ( auto& file : files ) {
+		if ( used <= limit )
+			break;
+		if ( unlink(file.path.c_str()) == 0 )
+			++evictions;
+		used -= file.size;
+	}
+}
+
+s_cachestats
+Cache::stats() const {
+	s_cachestats st;
+
+	st.hits = hits;
+	st.misses = misses;
+	st.stores = stores;
+	st.evictions = evictions;
+	return st;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Phase statistics. thread_allocs is only counted when the program
+// replaces operator new to add to it; otherwise allocs stay at 0.
+//////////////////////////////////////////////////////////////////////
+
+thread_local s_allocs thread_allocs;
+
+static const std::array<const char *,nphases> phasenames = { {
+	"tokenize", "pseudo", "encode", "list", "emit", "scan", "unpack",
+} };
+
+Stats::Stats(bool trace) : tracing(trace), origin(std::chrono::steady_clock::now()) {
+}
+
+void
+Stats::add(Phase phase,uint64_t nanoseconds,unsigned long items,const s_allocs& allocs) {
+	s_counters& c = counters[unsigned(phase)];
+
+	++c.calls;
+	c.items += items;
+	c.nanoseconds += nanoseconds;
+	c.allocs += allocs.count;
+	c.allocbytes += allocs.bytes;
+}
+
+void
+Stats::event(const char *name,uint64_t start,uint64_t end,unsigned long items) {
+	static std::atomic<unsigned> ntids(0);
+	static thread_local unsigned tid = ++ntids;
+
+	if ( !tracing )
+		return;
+
+	std::lock_guard<std::mutex> lock(mutex);
+
+	events.push_back(s_traceevent{name,tid,start,end - start,items});
+}
+
+s_phasestats
+Stats::phase(Phase phase) const {
+	const s_counters& c = counters[unsigned(phase)];
+	s_phasestats st;
+
+	st.calls = c.calls;
+	st.items = c.items;
+	st.nanoseconds = c.nanoseconds;
+	st.allocs = c.allocs;
+	st.allocbytes = c.allocbytes;
+	return st;
+}
+
+std::string
+Stats::report() const {
+	std::ostringstream rpt;
+	char line[160];
+
+	rpt << "; Stats:\n";
+	snprintf(line,sizeof line,";\t%-10s %10s %10s %12s %10s %12s %8s\n",
+		"phase","calls","items","ms","allocs","bytes","ns/item");
+	rpt << line;
+	for ( unsigned px=0; px < nphases; ++px ) {
+		s_phasestats st = phase(Phase(px));
+
+		if ( !st.calls )
+			continue;
+		snprintf(line,sizeof line,";\t%-10s %10lu %10lu %12.3f %10lu %12lu %8.0f\n",
+			phasenames[px],st.calls,st.items,st.nanoseconds / 1e6,st.allocs,st.allocbytes,
+			st.items ? double(st.nanoseconds) / st.items : 0.0);
+		rpt << line;
+	}
+	snprintf(line,sizeof line,";\tElapsed %.3f ms\n",now() / 1e6);
+	rpt << line;
+	return rpt.str();
+}
+
+//////////////////////////////////////////////////////////////////////
+// The events in the Chrome trace event format, complete ("X") events
+// in microseconds, for chrome://tracing or Perfetto
+//////////////////////////////////////////////////////////////////////
+
+std::string
+Stats::trace_json() {
+	std::lock_guard<std::mutex> lock(mutex);
+	std::ostringstream json;
+	char event[200];
+	bool first = true;
+
+	json << "{\"traceEvents\":[";
+	for ( auto& ev : events ) {
+		snprintf(event,sizeof event,
+			"%s\n{\"name\":\"%s\",\"cat\":\"ezusbcc\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+			"\"pid\":1,\"tid\":%u,\"args\":{\"items\":%lu}}",
+			first ? "" : ",",ev.name,ev.start / 1e3,ev.duration / 1e3,ev.tid,ev.items);
+		json << event;
+		first = false;
+	}
+	json << "\n],\"displayTimeUnit\":\"ms\"}\n";
+	return json.str();
+}
+
+//////////////////////////////////////////////////////////////////////
+// Adds the time, allocations and items of a scope to a phase of
+// stats (when it isn't null), and with event, traces it as well
+//////////////////////////////////////////////////////////////////////
+
+class PhaseTimer {
+	Stats		*stats;
+	Phase		phase;
+	bool		event;
+	uint64_t	start = 0;
+	s_allocs	allocs;
+
+public:	unsigned long	items = 1;
+
+	PhaseTimer(Stats *stats,Phase phase,bool event = true) : stats(stats), phase(phase), event(event) {
+		if ( stats ) {
+			allocs = thread_allocs;
+			start = stats->now();
+		}
+	}
+
+	~PhaseTimer() {
+		if ( !stats )
+			return;
+
+		const uint64_t end = stats->now();
+		s_allocs used;
+
+		used.count = thread_allocs.count - allocs.count;
+		used.bytes = thread_allocs.bytes - allocs.bytes;
+		stats->add(phase,end - start,items,used);
+		if ( event )
+			stats->event(phasenames[unsigned(phase)],start,end,items);
+	}
+};
+
+//////////////////////////////////////////////////////////////////////
+// Traces a scope, such as a whole assembly, that isn't a phase
+//////////////////////////////////////////////////////////////////////
+
+class TraceSpan {
+	Stats		*stats;
+	const char	*name;
+	uint64_t	start = 0;
+
+public:	TraceSpan(Stats *stats,const char *name) : stats(stats && stats->trace() ? stats : nullptr), name(name) {
+		if ( this->stats )
+			start = this->stats->now();
+	}
+
+	~TraceSpan() {
+		if ( stats )
+			stats->event(name,start,stats->now());
+	}
+};
+
+//////////////////////////////////////////////////////////////////////
+// Encode, list, analyze and emit the parsed sections. Returns false
+// when an error stopped the assembly.
+//////////////////////////////////////////////////////////////////////
+
+static bool
+assemble_sections(std::vector<s_section>& sections,std::ostream& out,std::ostream& lst,
+  const s_options& opts,std::vector<s_diagnostic>& errors,s_assembly *result) {
+	auto error = [&](const s_diagnostic& diag) {
+		lst << "*** ERROR: " << diag.text() << '\n';
+		errors.push_back(diag);
+	};
+
+	std::vector<s_vcdrun> runs;		// Recorded for opts.sim.vcd
+	std::vector<std::string> metrics;	// For OutFormat::Json
+
+	for ( auto& section : sections ) {
+		std::vector<s_instr>& instrs = section.instrs;
+		const std::map<unsigned,unsigned>& environ = section.environ;
+		const size_t nerrors = errors.size();
+
+		s_diagnostic flowerror;
+
+		{
+			PhaseTimer timer(opts.stats,Phase::Encode);
+
+			timer.items = instrs.size();
+			encode(instrs,environ);
+			if ( !encode_flow(section,flowerror) ) {
+				error(flowerror);
+				return false;
+			}
+		}
+		if ( opts.optimize ) {
+			if ( section.flow[0] )
+				lst << ";\tNot optimized: .FLOWSTATE names a state number.\n";
+			else	optimize(instrs,lst);
+		}
+		{
+			PhaseTimer timer(opts.stats,Phase::List);
+
+			timer.items = instrs.size();
+			if ( !list(instrs,environ,lst,errors) )
+				return false;
+		}
+		if ( !section.timing.empty() && errors.size() == nerrors )
+			check_timing(section,lst,errors);
+		if ( section.flow[0] ) {
+			lst << ";\tFlowStates:";
+			for ( auto byte : section.flow )
+				lst << ' ' << std::hex << std::setw(2) << std::setfill('0') << unsigned(byte);
+			lst << std::dec << '\n';
+		}
+
+		const unsigned nstates = instrs.size();
+
+		instrs.resize(8);
+		if ( opts.format == OutFormat::Json )
+			metrics.push_back(wave_metrics(section,nstates));
+
+		if ( opts.analyze || opts.sim.simulate || opts.hostqueue ) {
+			if ( errors.size() != nerrors ) {
+				std::vector<std::string> skipped;
+				std::string msg;
+
+				if ( opts.analyze )
+					skipped.push_back("analysis");
+				if ( opts.hostqueue )
+					skipped.push_back("transfer planning");
+				if ( opts.sim.simulate )
+					skipped.push_back(opts.sim.replaypath ? "replay" : "simulation");
+				for ( unsigned ux=0; ux < skipped.size(); ++ux ) {
+					if ( ux > 0 )
+						msg += ux + 1 == skipped.size() ? " and " : ", ";
+					msg += skipped[ux];
+				}
+				msg[0] = toupper(msg[0]);
+				error(msg + " skipped due to errors.");
+				return false;
+			}
+			if ( opts.analyze )
+				analyze(instrs,environ,lst);
+			if ( opts.hostqueue && !plan_transfers(instrs,environ,opts,lst,errors) )
+				return false;
+			if ( opts.sim.simulate ) {
+				s_simopts simopts(opts.sim);
+
+				if ( simopts.ifclk == 0.0 )
+					simopts.ifclk = environ.at(unsigned(PseudoOps::IfClk));
+				if ( environ.at(unsigned(PseudoOps::WordWide)) )
+					simopts.wordwide = true;
+				simopts.flgsel = environ.at(unsigned(PseudoOps::EpxGpifFlgSel));
+				simopts.epbuf = environ.at(unsigned(PseudoOps::EpBuf));
+				if ( opts.sim.replaypath ) {
+					if ( !replay(instrs,simopts,lst,errors) )
+						return false;
+				} else if ( opts.sim.vcd ) {
+					runs.push_back(s_vcdrun{
+						environ.at(unsigned(PseudoOps::WaveForm)),
+						environ.at(unsigned(PseudoOps::Trictl)) != 0,
+						simopts.ifclk,
+						uint8_t(environ.at(unsigned(PseudoOps::IdleCtl))),
+						{}});
+					if ( !simulate(instrs,simopts,lst,errors,&runs.back().cycles) )
+						return false;
+				} else if ( !simulate(instrs,simopts,lst,errors) ) {
+					return false;
+				}
+			}
+		}
+	}
+
+	if ( !runs.empty() )
+		emit_vcd(*opts.sim.vcd,runs);
+
+	PhaseTimer timer(opts.stats,Phase::Emit);
+	s_initdata init;
+
+	timer.items = sections.size();
+
+	if ( result && sections[0].environ.at(unsigned(PseudoOps::WaveForm)) <= 3 )
+		result->image = wave_image(sections,result->address);
+
+	if ( opts.init && !init_data(sections,init,errors) ) {
+		lst << "*** ERROR: " << errors.back().text() << '\n';
+		return false;
+	}
+
+	if ( opts.format == OutFormat::C ) {
+		bool wavedata = opts.init || sections.size() > 1;
+
+		if ( wavedata )
+			emit_wavedata(out,sections);
+		else	emit_waveform(out,sections[0].environ.at(unsigned(PseudoOps::WaveForm)),sections[0].instrs);
+		if ( first_flow(sections) )
+			emit_flowstates(out,sections,wavedata);
+		if ( opts.init )
+			emit_gpifinit(out,init);
+		return true;
+	}
+
+	if ( opts.format == OutFormat::Json ) {
+		emit_metrics(out,metrics);
+		return true;
+	}
+
+	if ( sections[0].environ.at(unsigned(PseudoOps::WaveForm)) > 3 ) {
+		error("Waveform memory only holds .WAVEFORM 0 to 3");
+		return false;
+	}
+
+	unsigned addr;
+	std::vector<uint8_t> image = wave_image(sections,addr);
+
+	switch ( opts.format ) {
+	case OutFormat::Bin:
+		out.write(reinterpret_cast<const char *>(image.data()),image.size());
+		break;
+	case OutFormat::Hex:
+		emit_ihex(out,addr,image);
+		break;
+	default:
+		if ( opts.init ) {
+			emit_regwrite(out,initaddrs[IfConfig],init.regs[IfConfig]);
+			emit_regwrite(out,gpifabort_addr,0xFF);
+		}
+		emit_regwrites(out,addr,image);
+		if ( opts.init ) {
+			for ( unsigned rx=0; rx < init.regs.size(); ++rx )
+				if ( rx != IfConfig )
+					emit_regwrite(out,initaddrs[rx],init.regs[rx]);
+			for ( auto& pair : init.flgsel )
+				emit_regwrite(out,epxgpifflgsel_addr(pair.first),pair.second);
+		}
+		if ( const s_section *section = first_flow(sections) ) {
+			for ( unsigned fx=0; fx < flownames.size(); ++fx )
+				emit_regwrite(out,flowstate_addr + fx,section->flow[fx]);
+		}
+	}
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Assemble the source text, writing the C code to out and the
+// listing to lst. Errors are listed and also appended to errors.
+// Returns false when an error stopped the assembly.
+//
+// Each .WAVEFORM after the first starts a new section, up to four.
+// Pseudo ops given before the first .WAVEFORM are the defaults for
+// every section. With one section a waveformN[32] array is emitted,
+// else the complete WaveData[128] for waveforms 0 to 3. Other output
+// formats write the same bytes as a waveform memory image, which is
+// also kept in result when one is given.
+//
+// With opts.cache, the sections are looked up in the cache once they
+// are parsed, and only encoded when they are not found there.
+//////////////////////////////////////////////////////////////////////
+
+static bool
+assemble(std::string_view src,std::ostream& out,std::ostream& lst,const s_options& opts,std::vector<s_diagnostic>& errors,s_assembly *result = nullptr) {
+	std::map<unsigned,unsigned> defaults = {
+		{ unsigned(PseudoOps::Trictl),		0u },
+		{ unsigned(PseudoOps::GpifReadyCfg5),	0u },
+		{ unsigned(PseudoOps::GpifReadyCfg7),	0u },
+		{ unsigned(PseudoOps::EpxGpifFlgSel),	0u },
+		{ unsigned(PseudoOps::Ep),		2u },
+		{ unsigned(PseudoOps::WaveForm),	0u },
+		{ unsigned(PseudoOps::IfClk),		48u },
+		{ unsigned(PseudoOps::WordWide),	0u },
+		{ unsigned(PseudoOps::Async),		0u },
+		{ unsigned(PseudoOps::IdleCtl),		0u },
+		{ unsigned(PseudoOps::FlowState),	7u },
+		{ unsigned(PseudoOps::FlowHoldOff),	0u },
+		{ unsigned(PseudoOps::FlowStb),		0u },
+		{ unsigned(PseudoOps::FlowStbEdge),	0u },
+		{ unsigned(PseudoOps::FlowStbHPeriod),	0u },
+		{ unsigned(PseudoOps::EpBuf),		2u },
+		{ unsigned(PseudoOps::AutoCommit),	1u },
+	};
+	std::map<unsigned,s_instr> flowdefaults;
+	std::vector<s_instr> timingdefaults;
+	std::vector<s_section> sections(1);
+	bool named = false;		// Seen .WAVEFORM
+
+	auto error = [&](const s_diagnostic& diag) {
+		lst << "*** ERROR: " << diag.text() << '\n';
+		errors.push_back(diag);
+	};
+
+	sections[0].environ = defaults;
+
+	TraceSpan span(opts.stats,"assemble");
+
+	{
+		TraceSpan span(opts.stats,"parse");
+		Lexer lex(src);
+		s_instr instr;
+
+		auto next = [&]() {
+			PhaseTimer timer(opts.stats,Phase::Tokenize,false);
+
+			return parse(lex,instr);
+		};
+
+		while ( next() ) {
+			auto it = pseudotab.find(instr.stropcode);
+			if ( it != pseudotab.end() ) {
+				PhaseTimer timer(opts.stats,Phase::Pseudo,false);
+				PseudoOps pseudoop = PseudoOps(it->second);
+				unsigned value = 0;
+
+				if ( pseudoop == PseudoOps::FlowLogic || pseudoop == PseudoOps::FlowEq0Ctl
+				  || pseudoop == PseudoOps::FlowEq1Ctl ) {
+					// Encoded later, with the section's environment
+					if ( pseudoop == PseudoOps::FlowLogic ? instr.stroperands.size() != 3 : instr.stroperands.empty() ) {
+						error(where(instr,"Missing operands for pseudo op " + std::string(instr.stropcode)));
+						return false;
+					}
+					if ( !named )
+						flowdefaults[it->second] = instr;
+					sections.back().flowterms[it->second] = instr;
+					continue;
+				}
+
+				if ( pseudoop == PseudoOps::MinPulse || pseudoop == PseudoOps::Setup || pseudoop == PseudoOps::Hold ) {
+					// Checked once the section is encoded
+					if ( instr.stroperands.size() != 2 ) {
+						error(where(instr,std::string(instr.stropcode) + " needs CTLn and ns"));
+						return false;
+					}
+					if ( !named )
+						timingdefaults.push_back(instr);
+					sections.back().timing.push_back(instr);
+					continue;
+				}
+
+				if ( instr.stroperands.size() != 1 ) {
+					error(where(instr,"Only one operand valid for pseudo op " + std::string(instr.stropcode)));
+					return false;
+				}
+				if ( pseudoop != PseudoOps::EpxGpifFlgSel && pseudoop != PseudoOps::FlowStbEdge ) {
+					unsigned long ulvalue = 0;
+					bool fail = !to_unsigned(instr.stroperands[0],ulvalue) || ulvalue > 0xFFFFu;
+
+					value = ulvalue;
+
+					if ( fail ) {
+						;
+					} else if ( pseudoop == PseudoOps::IfClk ) {
+						fail = value != 30 && value != 48;
+					} else if ( pseudoop == PseudoOps::FlowState ) {
+						fail = value > 6;
+					} else if ( pseudoop == PseudoOps::EpBuf ) {
+						fail = value < 2 || value > 4;
+					} else if ( pseudoop == PseudoOps::IdleCtl || pseudoop == PseudoOps::FlowHoldOff
+					  || pseudoop == PseudoOps::FlowStb || pseudoop == PseudoOps::FlowStbHPeriod ) {
+						fail = value > 0xFF;
+					} else if ( pseudoop != PseudoOps::WaveForm ) {
+						fail = value > ( pseudoop != PseudoOps::Ep ? 1 : 8 );
+
+						if ( !fail && pseudoop == PseudoOps::Ep && (value & 1) )
+							fail = true;		// Only EP 2, 4, 6 or 8
+					}
+
+					if ( fail ) {
+						error(where(instr,"Invalid operand '" + std::string(instr.stroperands[0])
+							+ "' for " + std::string(instr.stropcode)));
+						return false;
+					}
+				} else if ( pseudoop == PseudoOps::FlowStbEdge ) {
+					auto it = stbedgetab.find(instr.stroperands[0]);
+					if ( it == stbedgetab.end() ) {
+						error(where(instr,"Operand of " + std::string(instr.stropcode) + " must be NONE, RISING, FALLING or BOTH"));
+						return false;
+					}
+					value = it->second;
+				} else	{
+					auto it = flgsel.find(instr.stroperands[0]);
+					if ( it == flgsel.end() ) {
+						error(where(instr,"Operand of " + std::string(instr.stropcode) + " must be PF, EF, or FF"));
+						return false;
+					}
+					value = it->second;
+				}
+
+				if ( pseudoop == PseudoOps::WaveForm ) {
+					if ( named ) {
+						sections.push_back(s_section());
+						sections.back().environ = defaults;
+						sections.back().flowterms = flowdefaults;
+						sections.back().timing = timingdefaults;
+					}
+					named = true;
+				} else if ( !named ) {
+					defaults[unsigned(pseudoop)] = value;
+				}
+				sections.back().environ[unsigned(pseudoop)] = value;
+				continue;
+			} else	{
+				sections.back().instrs.push_back(instr);
+			}
+		}
+	}
+
+	if ( sections.size() > 1 ) {
+		std::array<bool,4> used = { { false, false, false, false } };
+
+		for ( auto& section : sections ) {
+			unsigned waveformx = section.environ.at(unsigned(PseudoOps::WaveForm));
+
+			if ( waveformx > 3 || used[waveformx] ) {
+				error("Each .WAVEFORM must be a different waveform 0 to 3");
+				return false;
+			}
+			used[waveformx] = true;
+		}
+	}
+
+	if ( !opts.cache || opts.sim.vcd || opts.sim.replaypath )	// Neither is cached
+		return assemble_sections(sections,out,lst,opts,errors,result);
+
+	// A hit replays the stored output and listing. A miss is captured,
+	// and stored when it assembled without errors.
+	const std::string key = cache_key(sections,opts);
+	s_assembly entry;
+	bool ok = true;
+
+	if ( !opts.cache->lookup(key,entry) ) {
+		std::ostringstream cout, clst;
+		const size_t nerrors = errors.size();
+
+		ok = assemble_sections(sections,cout,clst,opts,errors,&entry);
+		entry.output = cout.str();
+		entry.listing = clst.str();
+		if ( ok && errors.size() == nerrors )
+			opts.cache->store(key,entry);
+	}
+
+	out << entry.output;
+	lst << entry.listing;
+	if ( result ) {
+		result->image = entry.image;
+		result->address = entry.address;
+	}
+	return ok;
+}
+
+
+//////////////////////////////////////////////////////////////////////
+// Waveform synthesis from a transaction spec:
+//
+//	.PSEUDOOP	<arg>		; Copied to the source
+//	IDLE	[OEn] [CTLn]		; Outputs high at idle
+//	GATE	A [OP B]		; Wait until true before starting
+//	STROBE	CTLn width		; Driven from idle for >= width cycles
+//	DRIVE	CTLn setup hold		; Data driven around CTLn (write)
+//	SAMPLE	CTLn setup hold		; Data sampled within CTLn (read)
+//	NEXT				; NEXT once the data is done
+//
+// A waveform is searched for as a sequence of segments, each one
+// state: the strobes active, whether it has DATA and NEXT, and its
+// kind. Each strobe is one run of segments, as is the data, and NEXT
+// comes after it. The GATE is a DP state waiting on itself, and the
+// waveform ends with an unconditional DP jump to idle, unless it
+// fills all 7 states. Every timing rule then bounds the cycles of a
+// run of segments from below, so the fewest cycles for a sequence
+// are found exactly, by a greedy pass over the runs in order of
+// their ends. The sequences are searched on every core.
+//////////////////////////////////////////////////////////////////////
+
+struct s_synthstrobe {
+	std::string	name;		// CTLn or OEn
+	unsigned	bit;		// Output bit
+	unsigned	width;		// Minimum cycles driven
+};
+
+struct s_synthspec {
+	std::vector<std::string> pseudoops;	// Copied to the source
+	std::map<unsigned,unsigned> environ;
+	bool		idlectl = false;	// .IDLECTL was given
+	unsigned	idle = 0;		// Output byte at idle
+	std::vector<s_synthstrobe> strobes;
+	std::vector<std::string> gate;		// A [OP B], else empty
+	enum { None, Drive, Sample } data = None;
+	unsigned	datastrobe = 0;		// Index into strobes
+	unsigned	setup = 0;
+	unsigned	hold = 0;
+	bool		next = false;
+};
+
+struct s_segment {
+	enum Kind { Ndp, Gate, Final } kind = Ndp;
+	uint8_t		active = 0;		// Strobes driven, by index
+	bool		data = false;
+	bool		next = false;
+};
+
+struct s_synthbest {
+	unsigned	cycles = ~0u;
+	unsigned	states = 0;
+	std::vector<s_segment> segs;
+	std::vector<unsigned> counts;
+	unsigned long	searched = 0;		// Sequences evaluated
+};
+
+//////////////////////////////////////////////////////////////////////
+// Parse the spec, returning false with errors appended
+//////////////////////////////////////////////////////////////////////
+
+static bool
+synth_parse(std::string_view text,s_synthspec& spec,std::vector<s_diagnostic>& errors) {
+	Lexer lex(text);
+	s_instr instr;
+	bool seen_data = false;
+
+	spec.environ = {
+		{ unsigned(PseudoOps::Trictl),		0u },
+		{ unsigned(PseudoOps::GpifReadyCfg5),	0u },
+		{ unsigned(PseudoOps::GpifReadyCfg7),	0u },
+		{ unsigned(PseudoOps::EpxGpifFlgSel),	0u },
+	};
+
+	auto number = [&](std::string_view sv,unsigned max,unsigned& value) {
+		unsigned long ulvalue;
+
+		if ( !to_unsigned(sv,ulvalue) || ulvalue > max ) {
+			errors.push_back(where(instr,"Invalid number '" + std::string(sv) + "'"));
+			return false;
+		}
+		value = ulvalue;
+		return true;
+	};
+
+	auto output = [&](std::string_view name,unsigned& bit) {
+		const auto& oemap = oetab.at(spec.environ.at(unsigned(PseudoOps::Trictl)));
+		auto it = oemap.find(name);
+
+		if ( it == oemap.end() ) {
+			errors.push_back(where(instr,"Invalid output '" + std::string(name) + "'"));
+			return false;
+		}
+		bit = it->second;
+		return true;
+	};
+
+	while ( parse(lex,instr) ) {
+		std::string_view op = instr.stropcode;
+		const auto& operands = instr.stroperands;
+		auto it = pseudotab.find(op);
+
+		if ( it != pseudotab.end() ) {
+			std::string line = "\t" + std::string(op);
+
+			for ( auto& operand : operands )
+				line += "\t" + std::string(operand);
+			spec.pseudoops.push_back(line);
+
+			PseudoOps pseudoop = PseudoOps(it->second);
+			unsigned long value = 0;
+
+			if ( pseudoop == PseudoOps::IdleCtl )
+				spec.idlectl = true;
+			if ( pseudoop == PseudoOps::EpxGpifFlgSel && operands.size() == 1 && flgsel.count(operands[0]) )
+				spec.environ[it->second] = flgsel.find(operands[0])->second;
+			else if ( spec.environ.count(it->second) && operands.size() == 1 && to_unsigned(operands[0],value) && value <= 1 )
+				spec.environ[it->second] = value;
+			continue;
+		}
+
+		if ( op == "IDLE" ) {
+			for ( auto& operand : operands ) {
+				unsigned bit;
+
+				if ( !output(operand,bit) )
+					return false;
+				spec.idle |= 1 << bit;
+			}
+		} else if ( op == "GATE" ) {
+			const auto& opermap = opertab.at(spec.environ.at(unsigned(PseudoOps::GpifReadyCfg5)))
+				.at(spec.environ.at(unsigned(PseudoOps::EpxGpifFlgSel)))
+				.at(spec.environ.at(unsigned(PseudoOps::GpifReadyCfg7)));
+
+			if ( (operands.size() != 1 && operands.size() != 3) || !spec.gate.empty() ) {
+				errors.push_back(where(instr,"GATE needs A or A OP B, once"));
+				return false;
+			}
+			if ( !opermap.count(operands[0]) || (operands.size() == 3 && (!opermap.count(operands[2]) || !functab.count(operands[1]))) ) {
+				errors.push_back(where(instr,"Invalid GATE term or function"));
+				return false;
+			}
+			for ( auto& operand : operands )
+				spec.gate.push_back(std::string(operand));
+			if ( operands.size() == 1 ) {
+				spec.gate.push_back("AND");
+				spec.gate.push_back(spec.gate[0]);
+			}
+		} else if ( op == "STROBE" ) {
+			s_synthstrobe strobe;
+
+			if ( operands.size() != 2 ) {
+				errors.push_back(where(instr,"STROBE needs CTLn width"));
+				return false;
+			}
+			if ( !output(operands[0],strobe.bit) || !number(operands[1],256*7,strobe.width) )
+				return false;
+			strobe.name = operands[0];
+			for ( auto& other : spec.strobes )
+				if ( other.bit == strobe.bit ) {
+					errors.push_back(where(instr,"STROBE " + strobe.name + " given twice"));
+					return false;
+				}
+			if ( spec.strobes.size() == 6 ) {
+				errors.push_back(where(instr,"Too many strobes"));
+				return false;
+			}
+			spec.strobes.push_back(strobe);
+		} else if ( op == "DRIVE" || op == "SAMPLE" ) {
+			if ( operands.size() != 3 || seen_data ) {
+				errors.push_back(where(instr,std::string(op) + " needs CTLn setup hold, with one DRIVE or SAMPLE"));
+				return false;
+			}
+			unsigned bit;
+
+			if ( !output(operands[0],bit) || !number(operands[1],256*7,spec.setup) || !number(operands[2],256*7,spec.hold) )
+				return false;
+
+			auto sx = std::find_if(spec.strobes.begin(),spec.strobes.end(),[&](const s_synthstrobe& s) { return s.bit == bit; });
+
+			if ( sx == spec.strobes.end() ) {
+				errors.push_back(where(instr,"No STROBE given for " + std::string(operands[0])));
+				return false;
+			}
+			spec.datastrobe = sx - spec.strobes.begin();
+			spec.data = op == "DRIVE" ? s_synthspec::Drive : s_synthspec::Sample;
+			seen_data = true;
+		} else if ( op == "NEXT" ) {
+			spec.next = true;
+		} else	{
+			errors.push_back(where(instr,"Unknown spec line '" + std::string(op) + "'"));
+			return false;
+		}
+	}
+
+	if ( spec.next && spec.data == s_synthspec::None ) {
+		errors.push_back("NEXT needs a DRIVE or SAMPLE");
+		return false;
+	}
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////
+// The fewest cycles for a sequence of segments, with the NDP counts
+// in counts, else ~0u when the rules can't be met. An NDP segment of
+// more than 256 cycles takes more than one state.
+//////////////////////////////////////////////////////////////////////
+
+static unsigned
+synth_cycles(const s_synthspec& spec,const std::vector<s_segment>& segs,std::vector<unsigned>& counts,unsigned& states) {
+	struct s_run {
+		int	first, last;		// Segments
+		unsigned min;			// Cycles at least
+	};
+	std::vector<s_run> runs;
+	const int nsegs = segs.size();
+
+	auto span = [&](uint8_t mask,bool data,int& first,int& last) {
+		first = last = -1;
+		for ( int sx=0; sx < nsegs; ++sx )
+			if ( (segs[sx].active & mask) || (data && segs[sx].data) ) {
+				if ( first < 0 )
+					first = sx;
+				last = sx;
+			}
+	};
+
+	for ( unsigned ix=0; ix < spec.strobes.size(); ++ix ) {
+		int first, last;
+
+		span(1 << ix,false,first,last);
+		runs.push_back({ first, last, spec.strobes[ix].width });
+	}
+
+	if ( spec.data != s_synthspec::None ) {
+		int a, b, p, q;
+
+		span(1 << spec.datastrobe,false,a,b);
+		span(0,true,p,q);
+
+		if ( spec.data == s_synthspec::Drive ) {
+			// Data driven from setup cycles before the strobe to hold after
+			if ( p > a || q < b || (spec.setup && p == a) || (spec.hold && q == b) )
+				return ~0u;
+			if ( spec.setup )
+				runs.push_back({ p, a - 1, spec.setup });
+			if ( spec.hold )
+				runs.push_back({ b + 1, q, spec.hold });
+		} else	{
+			// Sampled at the end of the one DATA state, within the strobe
+			if ( p != q || p < a || p > b || (spec.hold && p == b) )
+				return ~0u;
+			if ( spec.setup )
+				runs.push_back({ a, p, spec.setup });
+			if ( spec.hold )
+				runs.push_back({ p + 1, b, spec.hold });
+		}
+	}
+
+	std::sort(runs.begin(),runs.end(),[](const s_run& x,const s_run& y) {
+		return x.last < y.last;
+	});
+
+	counts.assign(nsegs,1);
+	for ( auto& run : runs ) {
+		unsigned sum = 0;
+		int adjust = -1;
+
+		for ( int sx=run.first; sx <= run.last; ++sx ) {
+			sum += counts[sx];
+			if ( segs[sx].kind == s_segment::Ndp )
+				adjust = sx;
+		}
+		if ( sum >= run.min )
+			continue;
+		if ( adjust < 0 )
+			return ~0u;
+		counts[adjust] += run.min - sum;
+	}
+
+	unsigned cycles = 0;
+
+	states = 0;
+	for ( auto count : counts ) {
+		cycles += count;
+		states += (count + 255) / 256;
+	}
+	return cycles;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Depth first search of the segment sequences following segs. Each
+// segment must advance a strobe, the data or NEXT, and none may run
+// twice. A sequence may end with the Final DP state, or at 7 states.
+//////////////////////////////////////////////////////////////////////
+
+struct s_synthphase {
+	std::array<uint8_t,6> strobe = { { 0 } };	// 0 before, 1 active, 2 done
+	uint8_t		data = 0;
+	bool		next = false;
+};
+
+static bool
+synth_step(const s_synthspec& spec,const s_synthphase& from,const s_segment& seg,s_synthphase& to) {
+	to = from;
+	for ( unsigned ix=0; ix < spec.strobes.size(); ++ix ) {
+		bool on = seg.active >> ix & 1;
+
+		if ( to.strobe[ix] == 2 && on )
+			return false;
+		if ( on )
+			to.strobe[ix] = 1;
+		else if ( to.strobe[ix] == 1 )
+			to.strobe[ix] = 2;
+	}
+	if ( to.data == 2 && seg.data )
+		return false;
+	if ( seg.data )
+		to.data = to.data == 1 && spec.data == s_synthspec::Sample ? 3 : 1;
+	else if ( to.data == 1 )
+		to.data = 2;
+	if ( to.data == 3 )
+		return false;			// One sample only
+	if ( seg.next ) {
+		if ( to.next || to.data != 2 )
+			return false;		// Once, after the data
+		to.next = true;
+	}
+	return true;
+}
+
+static bool
+synth_done(const s_synthspec& spec,const s_synthphase& phase) {
+	for ( unsigned ix=0; ix < spec.strobes.size(); ++ix )
+		if ( phase.strobe[ix] == 0 )
+			return false;
+	if ( spec.data != s_synthspec::None && phase.data == 0 )
+		return false;
+	return phase.next == spec.next;
+}
+
+static void
+synth_search(const s_synthspec& spec,const std::vector<s_segment>& alphabet,
+  std::vector<s_segment>& segs,const s_synthphase& phase,s_synthbest& best);
+
+static void
+synth_extend(const s_synthspec& spec,const std::vector<s_segment>& alphabet,
+  std::vector<s_segment>& segs,const s_synthphase& phase,const s_segment& seg,s_synthbest& best) {
+	const s_segment *prev = segs.empty() ? nullptr : &segs.back();
+	s_synthphase to;
+
+	if ( seg.kind == s_segment::Ndp && prev && prev->kind == s_segment::Ndp
+	  && seg.active == prev->active && seg.data == prev->data && seg.next == prev->next )
+		return;			// Same as one longer state
+	if ( !synth_step(spec,phase,seg,to) )
+		return;
+
+	segs.push_back(seg);
+	if ( seg.kind == s_segment::Final || segs.size() == 7 ) {
+		std::vector<unsigned> counts;
+		unsigned states = 0;
+
+		if ( synth_done(spec,to) ) {
+			unsigned cycles = synth_cycles(spec,segs,counts,states);
+
+			// Without the Final DP, the 7th state runs into idle
+			if ( seg.kind == s_segment::Final ? states > 7 : states != 7 )
+				cycles = ~0u;
+			++best.searched;
+			if ( cycles < best.cycles || (cycles == best.cycles && states < best.states) ) {
+				best.cycles = cycles;
+				best.states = states;
+				best.segs = segs;
+				best.counts = counts;
+			}
+		}
+	} else	{
+		synth_search(spec,alphabet,segs,to,best);
+	}
+	segs.pop_back();
+}
+
+static void
+synth_search(const s_synthspec& spec,const std::vector<s_segment>& alphabet,
+  std::vector<s_segment>& segs,const s_synthphase& phase,s_synthbest& best) {
+	for ( auto& seg : alphabet )
+		synth_extend(spec,alphabet,segs,phase,seg,best);
+}
+
+//////////////////////////////////////////////////////////////////////
+// Write the assembler source for the best sequence
+//////////////////////////////////////////////////////////////////////
+
+static std::string
+synth_source(const s_synthspec& spec,const s_synthbest& best,unsigned nthreads) {
+	const auto& oemap = oetab.at(spec.environ.at(unsigned(PseudoOps::Trictl)));
+	std::ostringstream src;
+	unsigned state = 0;
+
+	auto outputs = [&](uint8_t active) {
+		uint8_t byte = spec.idle;
+		std::string names;
+
+		for ( unsigned ix=0; ix < spec.strobes.size(); ++ix )
+			if ( active >> ix & 1 )
+				byte ^= 1 << spec.strobes[ix].bit;
+		for ( int bit=7; bit >= 0; --bit )
+			for ( auto& pair : oemap )
+				if ( pair.second == unsigned(bit) && (byte >> bit & 1) )
+					names += pair.first + " ";
+		return names;
+	};
+
+	auto notes = [&](const s_segment& seg) {
+		std::string text;
+
+		for ( unsigned ix=0; ix < spec.strobes.size(); ++ix )
+			if ( seg.active >> ix & 1 )
+				text += (text.empty() ? "" : ", ") + spec.strobes[ix].name;
+		if ( seg.data )
+			text += std::string(text.empty() ? "" : ", ") + (spec.data == s_synthspec::Drive ? "data driven" : "data sampled");
+		if ( seg.next )
+			text += std::string(text.empty() ? "" : ", ") + "NEXT";
+		if ( text.empty() )
+			return std::string("Idle levels");
+		text[0] = toupper(text[0]);
+		return text;
+	};
+
+	src << "; Synthesized: " << best.cycles << " cycles per transaction when ready, "
+		<< best.states << " states\n"
+		<< "; (" << best.searched << " state sequences searched on " << nthreads
+		<< (nthreads == 1 ? " thread)\n" : " threads)\n");
+	for ( auto& line : spec.pseudoops )
+		src << line << '\n';
+	if ( !spec.idlectl ) {
+		char hex[8];
+
+		snprintf(hex,sizeof hex,"0x%02X",spec.idle);
+		src << "\t.IDLECTL\t" << hex << '\n';
+	}
+
+	for ( unsigned sx=0; sx < best.segs.size(); ++sx, ++state ) {
+		const s_segment& seg = best.segs[sx];
+		std::string opc = std::string(seg.data ? "D" : "") + (seg.next ? "N" : "");
+
+		switch ( seg.kind ) {
+		case s_segment::Gate:
+			src << "\tJ" << opc << '\t' << spec.gate[0] << ' ' << spec.gate[1] << ' ' << spec.gate[2] << ' '
+				<< outputs(seg.active) << '$' << state << " $" << state + 1 << "\t; Wait for "
+				<< spec.gate[0] << (spec.gate[0] == spec.gate[2] ? "" : " " + spec.gate[1] + " " + spec.gate[2]) << '\n';
+			break;
+		case s_segment::Final:
+			{
+				// Unconditional: both branches go to idle
+				const std::string& term = spec.gate.empty() ? std::string("RDY0") : spec.gate[0];
+
+				src << "\tJ" << opc << '\t' << term << " AND " << term << ' '
+					<< outputs(seg.active) << "$7 $7\t; " << notes(seg) << ", then idle\n";
+			}
+			break;
+		default:
+			for ( unsigned count = best.counts[sx]; count > 0; count -= std::min(count,256u) ) {
+				src << '\t' << (opc.empty() ? "Z" : opc) << '\t' << std::min(count,256u) << ' '
+					<< outputs(seg.active) << "\t; " << notes(seg) << '\n';
+				if ( count > 256 )
+					++state;
+			}
+		}
+	}
+	return src.str();
+}
+
+s_synthesis
+synthesize(std::string_view spectext,unsigned nthreads) {
+	s_synthesis result;
+	s_synthspec spec;
+
+	if ( !synth_parse(spectext,spec,result.diagnostics) )
+		return result;
+
+	// Every segment that could be used: NDP and Final, with each set
+	// of strobes, DATA and NEXT. A strobe that the data doesn't refer
+	// to only has its width, which is best met by driving it in every
+	// state after the GATE, so only the data strobe is searched.
+	std::vector<s_segment> alphabet;
+	const unsigned nstrobes = spec.strobes.size();
+	uint8_t held = (1u << nstrobes) - 1, searched = 0;
+
+	if ( spec.data != s_synthspec::None ) {
+		searched = 1 << spec.datastrobe;
+		held &= ~searched;
+	}
+
+	for ( unsigned kind=0; kind < 2; ++kind )
+		for ( unsigned active=0; active <= searched; active += searched ? searched : 1 )
+			for ( unsigned data=0; data < (spec.data != s_synthspec::None ? 2u : 1u); ++data )
+				for ( unsigned next=0; next < (spec.next ? 2u : 1u); ++next ) {
+					s_segment seg;
+
+					seg.kind = kind ? s_segment::Final : s_segment::Ndp;
+					seg.active = active | held;
+					seg.data = data;
+					seg.next = next;
+					alphabet.push_back(seg);
+				}
+
+	// The GATE is first. The subtrees under each next segment are
+	// shared out to the threads, and their bests merged in order.
+	std::vector<s_segment> prefix;
+	s_synthphase phase;
+
+	if ( !spec.gate.empty() ) {
+		s_segment gate;
+
+		gate.kind = s_segment::Gate;
+		prefix.push_back(gate);
+	}
+
+	std::vector<s_synthbest> bests(alphabet.size());
+	std::atomic<unsigned> nextx(0);
+
+	if ( nthreads == 0 )
+		nthreads = std::max(1u,std::thread::hardware_concurrency());
+
+	auto worker = [&]() {
+		unsigned ax;
+
+		while ( (ax = nextx++) < alphabet.size() ) {
+			std::vector<s_segment> segs(prefix);
+
+			synth_extend(spec,alphabet,segs,phase,alphabet[ax],bests[ax]);
+		}
+	};
+
+	std::vector<std::thread> pool;
+
+	for ( unsigned tx=0; tx < nthreads && tx < alphabet.size(); ++tx )
+		pool.emplace_back(worker);
+	for ( auto& thread : pool )
+		thread.join();
+
+	s_synthbest best;
+
+	for ( auto& sub : bests ) {
+		best.searched += sub.searched;
+		if ( sub.cycles < best.cycles || (sub.cycles == best.cycles && sub.states < best.states) ) {
+			best.cycles = sub.cycles;
+			best.states = sub.states;
+			best.segs = sub.segs;
+			best.counts = sub.counts;
+		}
+	}
+
+	if ( best.cycles == ~0u ) {
+		result.diagnostics.push_back("No waveform of 7 states meets the spec");
+		return result;
+	}
+
+	result.source = synth_source(spec,best,nthreads);
+	result.cycles = best.cycles;
+	result.states = best.states;
+	result.searched = best.searched;
+
+	// The source must assemble cleanly
+	std::ostringstream out, lst;
+
+	result.ok = assemble(result.source,out,lst,s_options(),result.diagnostics) && result.diagnostics.empty();
+	return result;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Names of the DP terms and functions, as far as they are known
+// without the environment
+//////////////////////////////////////////////////////////////////////
+
+static const std::array<const char *,8> dpterms = { {
+	"RDY0", "RDY1", "RDY2", "RDY3", "RDY4", "RDY5|TC", "PF|EF|FF", "INTRDY"
+} };
+
+static const std::array<const char *,4> dpfuncs = { {
+	"AND", "OR", "XOR", "/AND"
+} };
+
+//////////////////////////////////////////////////////////////////////
+// Append the names of the outputs driven, highest bit first
+//////////////////////////////////////////////////////////////////////
+
+static void
+output_names(unsigned output,bool trictl,std::string& oper) {
+	static const char *names[2][8] = {
+		{ "CTL0", "CTL1", "CTL2", "CTL3", "CTL4", "CTL5", nullptr, nullptr },
+		{ "CTL0", "CTL1", "CTL2", "CTL3", "OE0", "OE1", "OE2", "OE3" },
+	};
+
+	for ( int bx=7; bx >= 0; --bx ) {
+		if ( ((output >> bx) & 1) && names[trictl][bx] ) {
+			oper += names[trictl][bx];
+			oper += ' ';
+		}
+	}
+}
+
+//////////////////////////////////////////////////////////////////////
+// The opcode and operands of a state word. With an opermap the DP
+// terms are named for that environment, else as far as they are
+// known without it.
+//////////////////////////////////////////////////////////////////////
+
+void
+state_text(uint32_t w,bool trictl,const t_namemap *opermap,
+  std::string& opc,std::string& oper) {
+	const unsigned opcode = sw_opcode(w);
+
+	auto term = [&](unsigned t) -> std::string_view {
+		if ( opermap )
+			for ( auto& pair : *opermap )
+				if ( pair.second == t )
+					return pair.first;
+		return dpterms[t];
+	};
+
+	opc.clear();
+	oper.clear();
+
+	if ( opcode & SwDp )
+		opc += 'J';
+	if ( opcode & SwSgl )
+		opc += 'S';
+	if ( opcode & SwIncad )
+		opc += '+';
+	if ( opcode & SwGint )
+		opc += 'G';
+	if ( opcode & SwNext )
+		opc += 'N';
+	if ( opcode & SwData )
+		opc += 'D';
+	if ( !opcode )
+		opc += 'Z';
+	if ( sw_dp(w) && sw_reexecute(w) )
+		opc += '*';
+
+	if ( !sw_dp(w) ) {
+		oper += std::to_string(sw_branch(w) ? sw_branch(w) : 256u);
+		oper += ' ';
+		output_names(sw_output(w),trictl,oper);
+	} else	{
+		oper += term(sw_terma(w));
+		oper += ' ';
+		oper += dpfuncs[sw_lfunc(w)];
+		oper += ' ';
+		oper += term(sw_termb(w));
+		oper += ' ';
+		output_names(sw_output(w),trictl,oper);
+		oper += '$' + std::to_string(sw_branch0(w)) + " $" + std::to_string(sw_branch1(w));
+	}
+}
+
+//////////////////////////////////////////////////////////////////////
+// Decompile one unpacked waveform (branch, opcode, logfunc, output
+// per state). Returns true when TRICTL was assumed.
+//////////////////////////////////////////////////////////////////////
+
+bool
+decompile(unsigned waveformx,uint8_t data[32],std::ostream& out) {
+	bool trictl = false;
+	std::string opc, oper;
+	char hex[12];
+
+	out << "; WaveForm " << waveformx << '\n';
+
+	for ( unsigned ux=0; ux<32-4; ux += 4 ) {
+		const uint32_t w = sw_pack(data[ux+0],data[ux+1],data[ux+2],data[ux+3]);
+
+		if ( sw_output(w) & 0xC0 )
+			trictl = true;		// Assume TRICTL (OE3 or OE2)
+		state_text(w,trictl,nullptr,opc,oper);
+		snprintf(hex,sizeof hex,"%08X",unsigned(w));
+		out << hex << '\t' << opc << '\t' << oper << '\n';
+	}
+	return trictl;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Decompile a 9-byte FlowStates[] block into the .FLOW pseudo ops.
+// Nothing is shown for an all zero block.
+//////////////////////////////////////////////////////////////////////
+
+static void
+decompile_flow(const uint8_t flow[9],bool trictl,std::ostream& out) {
+	u_logfunc logfunc;
+	std::string eq;
+
+	if ( std::all_of(flow,flow+9,[](uint8_t byte) { return byte == 0; }) )
+		return;
+
+	out << std::dec;
+	if ( flow[0] & 0x80 )
+		out << "\t.FLOWSTATE\t" << (flow[0] & 7) << '\n';
+	else	out << "; Flow state not enabled\n";
+
+	logfunc.byte = flow[1];
+	out << "\t.FLOWLOGIC\t" << dpterms[logfunc.bits.terma] << ' '
+		<< dpfuncs[logfunc.bits.lfunc] << ' ' << dpterms[logfunc.bits.termb] << '\n';
+
+	for ( unsigned fx=0; fx<2; ++fx ) {
+		eq.clear();
+		output_names(flow[2 + fx],trictl,eq);
+		out << "\t.FLOWEQ" << fx << "CTL\t" << (flow[2 + fx] ? eq : "0") << '\n';
+	}
+
+	out << "\t.FLOWHOLDOFF\t" << unsigned(flow[4]) << '\n'
+		<< "\t.FLOWSTB\t" << unsigned(flow[5]) << '\n';
+	for ( auto& pair : stbedgetab )
+		if ( pair.second == (flow[6] & 3) )
+			out << "\t.FLOWSTBEDGE\t" << pair.first << '\n';
+	out << "\t.FLOWSTBHPERIOD\t" << unsigned(flow[7]) << '\n';
+}
+
+//////////////////////////////////////////////////////////////////////
+// Read the bytes of the C array initializer declared by decl, from
+// the start of the gpif.c stream. Returns false if decl is not found,
+// or with errors appended when the initializer is malformed.
+//////////////////////////////////////////////////////////////////////
+
+static bool
+read_carray(std::istream& gpif_c,const char *decl,const char *path,std::vector<uint8_t>& raw,std::vector<s_diagnostic>& errors) {
+	char buf[2048];
+	bool foundf = false;
+	const size_t decllen = strlen(decl);
+
+	gpif_c.clear();
+	gpif_c.seekg(0);
+	while ( gpif_c.good() ) {
+		if ( !gpif_c.getline(buf,sizeof buf).good() )
+			break;
+		if ( !strncmp(buf,decl,decllen) ) {
+			foundf = true;
+			break;
+		}
+	}
+
+	if ( !foundf )
+		return false;
+
+	char ch;
+
+	foundf = false;
+	while ( gpif_c.good() ) {
+		ch = gpif_c.get();
+		if ( !gpif_c.good() )
+			break;
+		if ( ch == '{' ) {
+			foundf = true;
+			break;
+		}
+	}
+
+	if ( !foundf ) {
+		errors.push_back(std::string("Missing opening brace: ") + path);
+		return false;
+	}
+
+	std::stringstream sbuf;
+
+	while ( gpif_c.good() ) {
+		ch = gpif_c.get();
+		if ( ch == '/' ) {
+			if ((ch = gpif_c.get()) == '/' ) {
+				while ( gpif_c.good() && gpif_c.get() != '\n' )
+					;
+				continue;
+			} else if ( ch == '*' ) {
+				do	{
+					while ( gpif_c.good() && (ch = gpif_c.get()) != '*' )
+						;
+					if ( !gpif_c.good() )
+						break;
+					ch = gpif_c.get();
+				} while ( gpif_c.good() && ch != '/' );
+				if ( !gpif_c.good() )
+					break;
+				continue;
+			}
+		}
+		if ( ch == '}' && sbuf.tellp() <= 0 )
+			break;
+		if ( strchr("\n\r\t\b ",ch) != nullptr )
+			continue;
+
+		if ( ch != ',' && ch != '}' ) {
+			sbuf << ch;
+		} else	{
+			std::string data(sbuf.str());
+			sbuf.clear();
+			sbuf.str("");
+
+			char *ep;
+			unsigned long udata = strtoul(data.c_str(),&ep,0);
+
+			if ( (ep && *ep != 0) || udata > 0xFF ) {
+				errors.push_back("Invalid data: '" + data + "'");
+				return false;
+			}
+			raw.push_back(uint8_t(udata));
+			if ( ch == '}' )
+				break;		// Last value without a comma
+		}
+	}
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Unpack waveform wx of raw WaveData (rows of LenBr, Opcode, Output
+// and LFun) into branch, opcode, logfunc, output per state.
+//////////////////////////////////////////////////////////////////////
+
+static void
+unpack(const uint8_t *raw,unsigned wx,uint8_t unpacked[32]) {
+	unsigned lx = wx * 32;		// Length index
+	unsigned opx = lx + 8;		// Opcode index
+	unsigned otx = opx + 8;		// Output index
+	unsigned lfx = otx + 8;		// Logical function index
+
+	for ( unsigned bx=0; bx < 32; ) {
+		unpacked[bx++] = raw[lx++];
+		unpacked[bx++] = raw[opx++];
+		unpacked[bx++] = raw[lfx++];
+		unpacked[bx++] = raw[otx++];
+	}
+}
+
+//////////////////////////////////////////////////////////////////////
+// The behavior of an unpacked waveform, as a string that is equal for
+// waveforms driving the same outputs and actions for the same cycles
+// under every RDY input. Each state reachable from state 0 is labeled
+// by its actions, outputs, cycles and re-execute, with its next state
+// for each of the 256 term inputs. The states are minimized by
+// partition refinement, then listed in breadth first order from
+// state 0. An unconditional DP jump is 1 cycle, like an NDP count 1.
+//////////////////////////////////////////////////////////////////////
+
+static std::string
+behavior(const uint8_t data[32]) {
+	std::array<std::string,8> label;
+	std::array<std::array<uint8_t,256>,8> next;
+	std::array<unsigned,8> cls;
+	std::vector<bool> seen(8,false);
+	std::vector<unsigned> states;
+
+	for ( unsigned sx=0; sx < 8; ++sx ) {
+		u_branch branch;
+		u_opcode opcode;
+		u_logfunc logfunc;
+		char buf[40];
+
+		branch.byte = data[sx*4+0];
+		opcode.byte = data[sx*4+1];
+		logfunc.byte = data[sx*4+2];
+
+		if ( sx == 7 ) {
+			label[sx] = "idle";
+			next[sx].fill(7);
+		} else if ( !opcode.bits.dp ) {
+			snprintf(buf,sizeof buf,"%02X %02X %u 0",opcode.byte & 0x3E,data[sx*4+3],branch.byte ? branch.byte : 256u);
+			label[sx] = buf;
+			next[sx].fill(sx + 1);
+		} else	{
+			snprintf(buf,sizeof buf,"%02X %02X 1 %u",opcode.byte & 0x3E,data[sx*4+3],unsigned(branch.bits.reexecute));
+			label[sx] = buf;
+			for ( unsigned ix=0; ix < 256; ++ix ) {
+				bool a = ix >> logfunc.bits.terma & 1, b = ix >> logfunc.bits.termb & 1, f;
+
+				switch ( u_logfunc::e_logfunc(logfunc.bits.lfunc) ) {
+				case u_logfunc::e_logfunc::a_and_b:
+					f = a && b;
+					break;
+				case u_logfunc::e_logfunc::a_or_b:
+					f = a || b;
+					break;
+				case u_logfunc::e_logfunc::a_xor_b:
+					f = a != b;
+					break;
+				default:
+					f = !a && b;
+				}
+				next[sx][ix] = f ? branch.bits.branch1 : branch.bits.branch0;
+			}
+		}
+	}
+
+	// States reachable from state 0 (7 always is)
+	states.push_back(0);
+	seen[0] = true;
+	for ( unsigned qx=0; qx < states.size(); ++qx )
+		for ( auto to : next[states[qx]] )
+			if ( !seen[to] ) {
+				seen[to] = true;
+				states.push_back(to);
+			}
+
+	// Refine classes of equal labels until the next classes agree
+	std::map<std::string,unsigned> classes;
+
+	for ( auto sx : states )
+		cls[sx] = classes.emplace(label[sx],classes.size()).first->second;
+
+	for ( size_t nclasses = classes.size();; ) {
+		std::map<std::vector<unsigned>,unsigned> refined;
+		std::array<std::vector<unsigned>,8> sigs;
+
+		for ( auto sx : states ) {
+			sigs[sx].push_back(cls[sx]);
+			for ( auto to : next[sx] )
+				sigs[sx].push_back(cls[to]);
+			refined.emplace(sigs[sx],refined.size());
+		}
+		for ( auto sx : states )
+			cls[sx] = refined.at(sigs[sx]);
+		if ( refined.size() == nclasses )
+			break;
+		nclasses = refined.size();
+	}
+
+	// Number the classes breadth first from state 0 and list them
+	std::map<unsigned,unsigned> order;		// Class to position
+	std::vector<unsigned> reps;			// A state of each class
+	std::ostringstream text;
+
+	order[cls[0]] = 0;
+	reps.push_back(0);
+	for ( unsigned rx=0; rx < reps.size(); ++rx ) {
+		unsigned sx = reps[rx];
+
+		text << label[sx] << ':';
+		for ( auto to : next[sx] ) {
+			auto it = order.find(cls[to]);
+
+			if ( it == order.end() ) {
+				it = order.emplace(cls[to],reps.size()).first;
+				reps.push_back(to);
+			}
+			text << ' ' << it->second;
+		}
+		text << '\n';
+	}
+	return text.str();
+}
+
+//////////////////////////////////////////////////////////////////////
+// Find the duplicate waveforms of WaveData, and the slots needed by
+// the waveforms that GPIFWFSELECT selects. Selected waveforms that
+// behave the same share the slot of the first, and the kept slots
+// are packed from 0 in their original order.
+//////////////////////////////////////////////////////////////////////
+
+static const std::array<const char *,4> wfselnames = { {
+	"FIFORD", "FIFOWR", "SINGLERD", "SINGLEWR"
+} };
+
+s_waveslots
+waveform_slots(const uint8_t *wavedata,size_t size,unsigned wfselect) {
+	s_waveslots slots;
+	std::array<std::string,4> behaviors;
+	std::array<bool,4> selected = { { false, false, false, false } };
+
+	slots.nwaves = std::min<size_t>(size / 32,4);
+	slots.wfselect = wfselect & 0xFF;
+	slots.identical.fill(-1);
+	slots.equivalent.fill(-1);
+	slots.slot.fill(-1);
+
+	for ( unsigned wx=0; wx < slots.nwaves; ++wx ) {
+		uint8_t unpacked[32];
+
+		unpack(wavedata,wx,unpacked);
+		behaviors[wx] = behavior(unpacked);
+
+		for ( unsigned ox=0; ox < wx; ++ox ) {
+			if ( slots.identical[wx] < 0 && !memcmp(wavedata + ox*32,wavedata + wx*32,32) )
+				slots.identical[wx] = ox;
+			if ( slots.equivalent[wx] < 0 && behaviors[ox] == behaviors[wx] )
+				slots.equivalent[wx] = ox;
+		}
+	}
+
+	for ( unsigned fx=0; fx < 4; ++fx ) {
+		unsigned wx = wfselect >> fx * 2 & 3;
+
+		if ( wx < slots.nwaves )
+			selected[slots.equivalent[wx] < 0 ? wx : slots.equivalent[wx]] = true;
+	}
+
+	for ( unsigned wx=0; wx < slots.nwaves; ++wx )
+		if ( selected[wx] )
+			slots.slot[wx] = slots.nslots++;
+	for ( unsigned wx=0; wx < slots.nwaves; ++wx )
+		if ( slots.slot[wx] < 0 && slots.equivalent[wx] >= 0 && selected[slots.equivalent[wx]] )
+			slots.slot[wx] = slots.slot[slots.equivalent[wx]];
+
+	slots.compacted = 0;
+	for ( unsigned fx=0; fx < 4; ++fx ) {
+		unsigned wx = wfselect >> fx * 2 & 3;
+		unsigned sx = wx < slots.nwaves && slots.slot[wx] >= 0 ? slots.slot[wx] : wx;
+
+		slots.compacted |= sx << fx * 2;
+	}
+	return slots;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Report the duplicates and the compacted slots as comments
+//////////////////////////////////////////////////////////////////////
+
+static void
+report_slots(const s_waveslots& slots,std::ostream& out) {
+	auto wfsel = [&](unsigned value) {
+		std::ostringstream text;
+
+		text << "0x" << std::uppercase << std::hex << std::setw(2) << std::setfill('0') << value << std::dec << " (";
+		for ( unsigned fx=0; fx < 4; ++fx )
+			text << (fx ? ", " : "") << wfselnames[fx] << ' ' << (value >> fx * 2 & 3);
+		return text.str() + ")";
+	};
+
+	out << std::dec << ";\n; Waveform slots, GPIFWFSELECT " << wfsel(slots.wfselect) << ":\n";
+	for ( unsigned wx=0; wx < slots.nwaves; ++wx ) {
+		if ( slots.identical[wx] >= 0 )
+			out << ";\tWave " << wx << " is byte identical to wave " << slots.identical[wx] << '\n';
+		else if ( slots.equivalent[wx] >= 0 )
+			out << ";\tWave " << wx << " behaves as wave " << slots.equivalent[wx] << " under every RDY input\n";
+		if ( slots.slot[wx] < 0 )
+			out << ";\tWave " << wx << " is not selected by GPIFWFSELECT\n";
+	}
+
+	if ( slots.nslots == slots.nwaves ) {
+		out << "; No slots can be freed.\n";
+		return;
+	}
+
+	out << "; Compacted to " << slots.nslots << " slot" << (slots.nslots == 1 ? "" : "s") << ":\n";
+	for ( unsigned wx=0; wx < slots.nwaves; ++wx )
+		if ( slots.slot[wx] >= 0 && slots.equivalent[wx] < 0 )
+			out << ";\tWave " << wx << " in slot " << slots.slot[wx] << '\n';
+	out << ";\tGPIFWFSELECT " << wfsel(slots.compacted) << '\n';
+	if ( slots.nslots < 4 ) {
+		out << ";\tFree slots:";
+		for ( unsigned sx=slots.nslots; sx < 4; ++sx )
+			out << ' ' << sx;
+		out << '\n';
+	}
+}
+
+//////////////////////////////////////////////////////////////////////
+// Decompile raw WaveData bytes, with the FlowStates[] of each wave
+// when there are any. With analyze, the duplicate waveforms and the
+// slots they could be compacted to are reported, for the selections
+// of wfselect. With replayopts, each wave is replayed against its
+// capture. With stats, each wave is counted as an unpack. Errors are
+// appended to errors, returning false.
+//////////////////////////////////////////////////////////////////////
+
+static bool
+decompile(const std::vector<uint8_t>& raw,const std::vector<uint8_t>& flows,std::ostream& out,
+  std::vector<s_diagnostic>& errors,bool analyze = false,unsigned wfselect = 0xE4,const s_simopts *replayopts = nullptr,
+  Stats *stats = nullptr) {
+	switch ( raw.size() ) {
+	case 32:
+	case 64:
+	case 96:
+	case 128:
+		break;
+	default:
+		errors.push_back(s_diagnostic("Unusual data size! Extraction failed."));
+		return false;
+	}
+
+	if ( flows.size() % 9 != 0 ) {
+		errors.push_back(s_diagnostic("Unusual FlowStates size! Extraction failed."));
+		return false;
+	}
+
+	uint8_t unpacked[32];
+
+	for ( unsigned ux=0; ux < raw.size(); ux += 32 ) {
+		{
+			PhaseTimer timer(stats,Phase::Unpack);
+
+			unpack(raw.data(),ux/32,unpacked);
+
+			bool trictl = decompile(ux/32,unpacked,out);
+
+			if ( ux / 32 * 9 < flows.size() )
+				decompile_flow(&flows[ux / 32 * 9],trictl,out);
+		}
+
+		if ( replayopts ) {
+			std::vector<s_instr> instrs(8);
+
+			for ( unsigned sx=0; sx<8; ++sx ) {
+				instrs[sx].branch.byte = unpacked[sx*4];
+				instrs[sx].opcode.byte = unpacked[sx*4+1];
+				instrs[sx].logfunc.byte = unpacked[sx*4+2];
+				instrs[sx].output.byte = unpacked[sx*4+3];
+			}
+			if ( !replay(instrs,*replayopts,out,errors) )
+				return false;
+		}
+	}
+	if ( analyze )
+		report_slots(waveform_slots(raw.data(),raw.size(),wfselect),out);
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Decompile the WaveData[] of gpif.c text in gpif_c (from path) to
+// out, with the FlowStates[] of each wave when present. With analyze,
+// GPIFWFSELECT is taken from InitData[5] for the slot report. With
+// replayopts, each wave is replayed, at the IFCLK of InitData[4]
+// unless one is given. With stats, each array read is counted as a
+// scan. Errors are appended to errors, returning false.
+//////////////////////////////////////////////////////////////////////
+
+static bool
+decompile(std::istream& gpif_c,const char *path,std::ostream& out,std::vector<s_diagnostic>& errors,
+  bool analyze = false,const s_simopts *replayopts = nullptr,Stats *stats = nullptr) {
+	std::vector<uint8_t> raw, flows, init;
+	unsigned wfselect = 0xE4;
+	s_simopts simopts;
+	TraceSpan span(stats,"decompile");
+
+	auto scan = [&](const char *decl,std::vector<uint8_t>& bytes) {
+		PhaseTimer timer(stats,Phase::Scan);
+		bool found = read_carray(gpif_c,decl,path,bytes,errors);
+
+		timer.items = bytes.size();
+		return found;
+	};
+
+	if ( !scan("const char xdata WaveData[128] =",raw) ) {
+		if ( errors.empty() )
+			errors.push_back(std::string("Did not find line: 'const char xdata WaveData[128] =' in ") + path);
+		return false;
+	}
+
+	out << raw.size() << " bytes.\n";
+
+	if ( !scan("const char xdata FlowStates[36] =",flows) && !errors.empty() )
+		return false;
+	if ( analyze || replayopts ) {
+		if ( scan("const char xdata InitData[7] =",init) && init.size() == 7 )
+			wfselect = init[GpifWfSelect];
+		else if ( !errors.empty() )
+			return false;
+		else if ( analyze )
+			out << "; No InitData[7], GPIFWFSELECT assumed to be 0xE4\n";
+	}
+	if ( replayopts ) {
+		simopts = *replayopts;
+		if ( simopts.ifclk == 0.0 )
+			simopts.ifclk = init.size() == 7 && !(init[IfConfig] & 0x40) ? 30.0 : 48.0;
+	}
+	return decompile(raw,flows,out,errors,analyze,wfselect,replayopts ? &simopts : nullptr,stats);
+}
+
+//////////////////////////////////////////////////////////////////////
+// Firmware scanning. A waveform is 32 bytes in rows of LenBr, Opcode,
+// Output and LFun, and is taken to be one when its states 0 to 6 are
+// legal encodings (opcode bits 7:6 clear, DP branch bit 6 clear, NDP
+// LFun zero), its idle state 7 column is as ezusbcc (zeros) or the
+// GPIF Designer (LenBr 7, Opcode 0, LFun 0x3F) leaves it, and state 7
+// is reachable from state 0 through NDP states of 1 to 255 cycles
+// (256 is legal, but looks like zeroed memory). A table is 1 to 4
+// such waveforms in a row, the first reaching a state with an opcode.
+//////////////////////////////////////////////////////////////////////
+
+typedef uint8_t v32u8 __attribute__((vector_size(32)));
+typedef uint64_t v4u64 __attribute__((vector_size(32)));
+
+//////////////////////////////////////////////////////////////////////
+// Bit i % 64 of legal[i / 64] is set when byte i is a legal opcode,
+// 32 bytes at a time. Each byte lane of 0 or 1 is gathered into a
+// mask by one multiply per 8 lanes.
+//////////////////////////////////////////////////////////////////////
+
+static void
+opcode_mask(const uint8_t *data,size_t size,std::vector<uint64_t>& legal) {
+	size_t bx = 0;
+
+	legal.assign(size / 64 + 2,0);
+	for ( ; bx + 32 <= size; bx += 32 ) {
+		v32u8 v;
+
+		memcpy(&v,data + bx,sizeof v);
+
+		v32u8 ok = (v32u8)((v & 0xC0) == 0) & 1;
+		v4u64 bits = ((v4u64)ok * 0x0102040810204080ull) >> 56;
+
+		for ( unsigned lx=0; lx < 4; ++lx )
+			legal[(bx + lx * 8) / 64] |= bits[lx] << (bx + lx * 8) % 64;
+	}
+	for ( ; bx < size; ++bx )
+		if ( !(data[bx] & 0xC0) )
+			legal[bx / 64] |= 1ull << bx % 64;
+}
+
+static bool
+plausible_wave(const uint8_t *wave,bool first) {
+	static const s_stateenv any = { 1, 0, 0, 1 };	// Every term and output named
+	std::array<uint32_t,7> words;	// Idle state 7 isn't run
+	std::array<uint8_t,7> reasons;
+
+	if ( wave[8+7] != 0 || ((wave[7] != 0 || wave[24+7] != 0) && (wave[7] != 7 || wave[24+7] != 0x3F)) )
+		return false;
+
+	for ( unsigned sx=0; sx < 7; ++sx )
+		words[sx] = sw_pack(wave[sx],wave[8+sx],wave[24+sx],wave[16+sx]);
+	classify_states(words.data(),words.size(),any,reasons.data());
+	for ( auto why : reasons )
+		if ( why )
+			return false;
+
+	// Idle state 7 reachable from state 0
+	unsigned seen = 1, todo = 1;
+	bool idle = false, active = !first;
+
+	while ( todo ) {
+		const unsigned sx = __builtin_ctz(todo);
+		const uint32_t w = words[sx];
+		unsigned next = sw_dp(w) ? 1u << sw_branch0(w) | 1u << sw_branch1(w) : 1u << (sx + 1);
+
+		todo &= todo - 1;
+		if ( !sw_dp(w) && sw_branch(w) == 0 )
+			return false;		// 256 cycles, as zeroed memory
+		active |= sw_opcode(w) != 0;
+		idle |= (next & 0x80) != 0;
+		next &= 0x7F;
+		todo |= next & ~seen;
+		seen |= next;
+	}
+	return idle && active;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Find the waveform tables in size bytes of an image at address. The
+// opcode rows are found first from the legal opcode mask: bit o of
+// run is set when the 8 bytes from o are all legal. The rest of each
+// waveform is then checked, and a table is extended over the
+// waveforms that follow it. Tables don't overlap.
+//////////////////////////////////////////////////////////////////////
+
+std::vector<s_firmhit>
+find_waveforms(const uint8_t *data,size_t size,unsigned long address) {
+	std::vector<s_firmhit> hits;
+	std::vector<uint64_t> legal;
+	size_t next = 0;		// First offset not in a table
+
+	if ( size < 32 )
+		return hits;
+	opcode_mask(data,size,legal);
+
+	for ( size_t wx=0; wx * 64 < size; ++wx ) {
+		uint64_t run = legal[wx];
+
+		for ( unsigned s=1; s < 8; ++s )
+			run &= legal[wx] >> s | legal[wx+1] << (64 - s);
+
+		// The opcode row is at offset + 8
+		while ( run ) {
+			const size_t row = wx * 64 + __builtin_ctzll(run);
+
+			run &= run - 1;
+			if ( row < 8 || row < next + 8 || row + 24 > size || !plausible_wave(data + row - 8,true) )
+				continue;
+
+			s_firmhit hit;
+			const size_t offset = row - 8;
+
+			hit.address = address + offset;
+			hit.size = 32;
+			while ( hit.size < 128 && offset + hit.size + 32 <= size && plausible_wave(data + offset + hit.size,false) )
+				hit.size += 32;
+
+			s_decompilation dc = Decompiler().decompile(data + offset,hit.size);
+
+			hit.text = dc.text;
+			hits.push_back(hit);
+			next = offset + hit.size;
+		}
+	}
+	return hits;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Read Intel HEX text into runs of contiguous bytes, by address
+//////////////////////////////////////////////////////////////////////
+
+static bool
+read_ihex(std::string_view text,std::map<unsigned long,std::vector<uint8_t>>& runs,std::vector<s_diagnostic>& errors) {
+	std::vector<std::pair<unsigned long,std::vector<uint8_t>>> records;
+	unsigned long upper = 0;	// Extended address
+	unsigned lno = 0;
+	size_t px = 0;
+
+	auto hexbyte = [&](std::string_view line,size_t ix,unsigned& byte) {
+		if ( ix + 2 > line.size() || !isxdigit(uint8_t(line[ix])) || !isxdigit(uint8_t(line[ix+1])) )
+			return false;
+		byte = std::stoul(std::string(line.substr(ix,2)),nullptr,16);
+		return true;
+	};
+
+	while ( px < text.size() ) {
+		size_t nl = text.find('\n',px);
+		std::string_view line = text.substr(px,nl == std::string_view::npos ? std::string_view::npos : nl - px);
+
+		px = nl == std::string_view::npos ? text.size() : nl + 1;
+		++lno;
+		while ( !line.empty() && isspace(uint8_t(line.back())) )
+			line.remove_suffix(1);
+		if ( line.empty() )
+			continue;
+
+		std::vector<uint8_t> rec;
+		unsigned byte, sum = 0;
+
+		for ( size_t ix=1; line[0] == ':' && hexbyte(line,ix,byte); ix += 2 ) {
+			rec.push_back(byte);
+			sum += byte;
+		}
+		if ( line[0] != ':' || line.size() % 2 == 0 || rec.size() < 5 || rec.size() != rec[0] + 5u ) {
+			errors.push_back(s_diagnostic("Invalid Intel HEX record",lno));
+			return false;
+		}
+		if ( sum & 0xFF ) {
+			errors.push_back(s_diagnostic("Intel HEX checksum error",lno));
+			return false;
+		}
+
+		switch ( rec[3] ) {
+		case 0x00:
+			records.emplace_back(upper + (rec[1] << 8 | rec[2]),std::vector<uint8_t>(rec.begin() + 4,rec.end() - 1));
+			break;
+		case 0x01:
+			px = text.size();
+			break;
+		case 0x02:
+			upper = (rec.size() == 7 ? rec[4] << 8 | rec[5] : 0) << 4;
+			break;
+		case 0x04:
+			upper = (unsigned long)(rec.size() == 7 ? rec[4] << 8 | rec[5] : 0) << 16;
+			break;
+		default:
+			break;		// Start addresses
+		}
+	}
+
+	std::sort(records.begin(),records.end(),
+		[](const std::pair<unsigned long,std::vector<uint8_t>>& a,const std::pair<unsigned long,std::vector<uint8_t>>& b) {
+			return a.first < b.first;
+		});
+	for ( auto& rec : records ) {
+		if ( !runs.empty() ) {
+			auto& last = *runs.rbegin();
+
+			if ( last.first + last.second.size() == rec.first ) {
+				last.second.insert(last.second.end(),rec.second.begin(),rec.second.end());
+				continue;
+			}
+		}
+		runs[rec.first] = std::move(rec.second);
+	}
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Scan a firmware image, memory mapped. Intel HEX (.hex, .ihx) is
+// recognized by its leading ':', and anything else is binary loaded
+// at address 0.
+//////////////////////////////////////////////////////////////////////
+
+s_firmscan
+scan_firmware(const char *path) {
+	s_firmscan result;
+	Source src(path);
+
+	if ( !src.ok() ) {
+		result.diagnostics.push_back(src.error());
+		return result;
+	}
+
+	std::string_view text = src.text();
+	size_t first = 0;
+
+	while ( first < text.size() && isspace(uint8_t(text[first])) )
+		++first;
+
+	if ( first < text.size() && text[first] == ':' ) {
+		std::map<unsigned long,std::vector<uint8_t>> runs;
+
+		if ( !read_ihex(text,runs,result.diagnostics) )
+			return result;
+		for ( auto& run : runs ) {
+			std::vector<s_firmhit> hits = find_waveforms(run.second.data(),run.second.size(),run.first);
+
+			result.bytes += run.second.size();
+			result.hits.insert(result.hits.end(),hits.begin(),hits.end());
+		}
+	} else	{
+		result.bytes = text.size();
+		result.hits = find_waveforms(reinterpret_cast<const uint8_t *>(text.data()),text.size(),0);
+	}
+	result.ok = true;
+	return result;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Just enough JSON to read back the -o json metrics
+//////////////////////////////////////////////////////////////////////
+
+struct s_json {
+	enum class Kind { Null, Bool, Number, String, Array, Object };
+
+	Kind		kind = Kind::Null;
+	double		number = 0.0;	// Number, or 1/0 for Bool
+	std::string	text;		// String
+	std::vector<std::string> keys;	// Object member names
+	std::vector<s_json> items;	// Array elements, or member values
+
+	const s_json *member(std::string_view key) const {
+		for ( size_t kx=0; kx < keys.size(); ++kx )
+			if ( keys[kx] == key )
+				return &items[kx];
+		return nullptr;
+	}
+
+	double num(std::string_view key) const {
+		const s_json *m = member(key);
+
+		return m && m->kind == Kind::Number ? m->number : 0.0;
+	}
+
+	std::string str(std::string_view key) const {
+		const s_json *m = member(key);
+
+		return m && m->kind == Kind::String ? m->text : std::string();
+	}
+};
+
+class JsonParser {
+	const char	*p;
+	const char	*end;
+
+	void skip() {
+		while ( p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') )
+			++p;
+	}
+
+	bool literal(const char *word) {
+		size_t n = strlen(word);
+
+		if ( size_t(end - p) < n || strncmp(p,word,n) != 0 )
+			return false;
+		p += n;
+		return true;
+	}
+
+	bool string(std::string& text) {
+		if ( p >= end || *p != '"' )
+			return false;
+		for ( ++p; p < end && *p != '"'; ++p ) {
+			if ( *p == '\\' && ++p >= end )
+				return false;
+			text += *p;		// \uXXXX is not needed here
+		}
+		return p++ < end;
+	}
+
+public:	JsonParser(std::string_view text) : p(text.data()), end(text.data() + text.size()) {}
+
+	bool value(s_json& v) {
+		skip();
+		if ( p >= end )
+			return false;
+
+		switch ( *p ) {
+		case '{':
+			v.kind = s_json::Kind::Object;
+			++p;
+			skip();
+			if ( p < end && *p == '}' ) {
+				++p;
+				return true;
+			}
+			for (;;) {
+				v.keys.emplace_back();
+				v.items.emplace_back();
+				skip();
+				if ( !string(v.keys.back()) )
+					return false;
+				skip();
+				if ( p >= end || *p++ != ':' || !value(v.items.back()) )
+					return false;
+				skip();
+				if ( p < end && *p == ',' ) {
+					++p;
+					continue;
+				}
+				return p < end && *p++ == '}';
+			}
+		case '[':
+			v.kind = s_json::Kind::Array;
+			++p;
+			skip();
+			if ( p < end && *p == ']' ) {
+				++p;
+				return true;
+			}
+			for (;;) {
+				v.items.emplace_back();
+				if ( !value(v.items.back()) )
+					return false;
+				skip();
+				if ( p < end && *p == ',' ) {
+					++p;
+					continue;
+				}
+				return p < end && *p++ == ']';
+			}
+		case '"':
+			v.kind = s_json::Kind::String;
+			return string(v.text);
+		default:
+			if ( literal("null") )
+				return true;
+			if ( literal("true") ) {
+				v.kind = s_json::Kind::Bool;
+				v.number = 1.0;
+				return true;
+			}
+			if ( literal("false") ) {
+				v.kind = s_json::Kind::Bool;
+				return true;
+			}
+			{
+				std::string num(p,std::min<size_t>(end - p,64));
+				char *ep = nullptr;
+
+				v.kind = s_json::Kind::Number;
+				v.number = strtod(num.c_str(),&ep);
+				if ( ep == num.c_str() )
+					return false;
+				p += ep - num.c_str();
+			}
+			return true;
+		}
+	}
+
+	bool done() {
+		skip();
+		return p >= end;
+	}
+};
+
+//////////////////////////////////////////////////////////////////////
+// What changed between two encoded states (hex branch, opcode,
+// logfunc and output bytes), in words
+//////////////////////////////////////////////////////////////////////
+
+static std::string
+state_changes(const std::string& was,const std::string& now) {
+	auto byte = [](const std::string& code,unsigned bx) {
+		return unsigned(strtoul(code.substr(bx * 2,2).c_str(),nullptr,16));
+	};
+	static const char *flags[] = { "DP", "DATA", "NEXT", "INCAD", "GINT", "SGL" };
+	u_branch b0, b1;
+	u_opcode o0, o1;
+	std::ostringstream why;
+
+	if ( was.size() != 8 || now.size() != 8 )
+		return std::string();
+
+	b0.byte = byte(was,0);
+	b1.byte = byte(now,0);
+	o0.byte = byte(was,1);
+	o1.byte = byte(now,1);
+
+	for ( unsigned fx=0; fx < 6; ++fx ) {
+		bool f0 = (o0.byte >> fx) & 1, f1 = (o1.byte >> fx) & 1;
+
+		if ( f0 != f1 )
+			why << (f1 ? " +" : " -") << flags[fx];
+	}
+	if ( !o0.bits.dp && !o1.bits.dp ) {
+		if ( b0.byte != b1.byte )
+			why << " count " << (b0.byte ? b0.byte : 256u) << " -> " << (b1.byte ? b1.byte : 256u);
+	} else if ( o0.bits.dp && o1.bits.dp ) {
+		if ( b0.bits.branch0 != b1.bits.branch0 || b0.bits.branch1 != b1.bits.branch1 )
+			why << " targets $" << b0.bits.branch0 << " $" << b0.bits.branch1
+				<< " -> $" << b1.bits.branch0 << " $" << b1.bits.branch1;
+		if ( b0.bits.reexecute != b1.bits.reexecute )
+			why << (b1.bits.reexecute ? " +re-execute" : " -re-execute");
+		if ( byte(was,2) != byte(now,2) )
+			why << " function";
+	}
+	if ( byte(was,3) != byte(now,3) )
+		why << " outputs " << was.substr(6,2) << " -> " << now.substr(6,2);
+	return why.str().empty() ? std::string() : why.str().substr(1);
+}
+
+//////////////////////////////////////////////////////////////////////
+// Compare -o json metrics with a baseline, listing what changed in
+// each waveform. A waveform whose worst case MB/s dropped by more
+// than threshold percent, or that is gone, is a regression.
+//////////////////////////////////////////////////////////////////////
+
+s_comparison
+compare_metrics(std::string_view baseline,std::string_view current,double threshold) {
+	s_comparison result;
+	std::array<s_json,2> docs;
+	std::array<std::map<unsigned,const s_json *>,2> waves;
+	std::ostringstream rpt;
+	unsigned changed = 0;
+
+	for ( unsigned dx=0; dx < 2; ++dx ) {
+		JsonParser parser(dx ? current : baseline);
+		const s_json *arr;
+
+		if ( !parser.value(docs[dx]) || !parser.done()
+		  || !(arr = docs[dx].member("waveforms")) || arr->kind != s_json::Kind::Array ) {
+			result.diagnostics.push_back(std::string(dx ? "Current" : "Baseline") + " metrics are not -o json output");
+			return result;
+		}
+		for ( auto& wave : arr->items )
+			waves[dx][unsigned(wave.num("waveform"))] = &wave;
+	}
+
+	std::map<unsigned,bool> all;
+
+	for ( auto& w : waves )
+		for ( auto& pair : w )
+			all[pair.first] = true;
+
+	rpt << std::fixed << std::setprecision(3);
+	for ( auto& pair : all ) {
+		const unsigned wx = pair.first;
+		auto ib = waves[0].find(wx), ic = waves[1].find(wx);
+
+		if ( ic == waves[1].end() ) {
+			rpt << "Waveform " << wx << ": removed *** REGRESSION\n";
+			++result.regressions;
+			++changed;
+			continue;
+		}
+		if ( ib == waves[0].end() ) {
+			rpt << "Waveform " << wx << ": added, " << ic->second->num("mbps") << " MB/s\n";
+			++changed;
+			continue;
+		}
+
+		const s_json& b = *ib->second, & c = *ic->second;
+		const double mb0 = b.num("mbps"), mb1 = c.num("mbps");
+		const s_json *s0 = b.member("state"), *s1 = c.member("state");
+		std::ostringstream states;
+		bool differ = mb0 != mb1 || b.num("cycles_best") != c.num("cycles_best")
+			|| b.num("cycles_worst") != c.num("cycles_worst") || b.num("states") != c.num("states");
+		size_t n0 = s0 ? s0->items.size() : 0, n1 = s1 ? s1->items.size() : 0;
+
+		for ( size_t sx=0; sx < std::max(n0,n1); ++sx ) {
+			std::string code0 = sx < n0 ? s0->items[sx].str("code") : "";
+			std::string code1 = sx < n1 ? s1->items[sx].str("code") : "";
+
+			if ( code0 == code1 )
+				continue;
+			differ = true;
+			states << "\t$" << sx << '\t' << (sx < n0 ? s0->items[sx].str("text") : "(none)")
+				<< "\t->\t" << (sx < n1 ? s1->items[sx].str("text") : "(none)");
+
+			std::string why = state_changes(code0,code1);
+
+			if ( !why.empty() )
+				states << "\t(" << why << ')';
+			states << '\n';
+		}
+		if ( !differ )
+			continue;
+
+		const bool regressed = mb1 < mb0 * (1.0 - threshold / 100.0);
+
+		++changed;
+		rpt << "Waveform " << wx << ": " << mb0 << " -> " << mb1 << " MB/s";
+		if ( mb0 > 0.0 )
+			rpt << std::showpos << std::setprecision(1) << " (" << (mb1 - mb0) * 100.0 / mb0 << "%)"
+				<< std::noshowpos << std::setprecision(3);
+		rpt << ", cycles " << unsigned(b.num("cycles_best")) << '/' << unsigned(b.num("cycles_worst"))
+			<< " -> " << unsigned(c.num("cycles_best")) << '/' << unsigned(c.num("cycles_worst"))
+			<< ", states " << unsigned(b.num("states")) << " -> " << unsigned(c.num("states"));
+		if ( regressed ) {
+			rpt << " *** REGRESSION";
+			++result.regressions;
+		}
+		rpt << '\n' << states.str();
+	}
+
+	rpt << std::setprecision(1) << all.size() << " waveforms compared, " << changed << " changed, "
+		<< result.regressions << " regressed (threshold " << threshold << "%)\n";
+	result.report = rpt.str();
+	result.ok = true;
+	return result;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Estimated FX2 8051 cycles (4 CPU clocks each) of the code that a
+// compiler makes of GpifInit() and GpifReload()
+//////////////////////////////////////////////////////////////////////
+
+static const unsigned c51_xwrite = 7;		// MOV DPTR,#a; MOV A,#v; MOVX @DPTR,A
+static const unsigned c51_syncdelay = 4;	// NOPs of SYNCDELAY
+static const unsigned c51_sfr = 3;		// MOV direct,#v (AUTOPTRH1 etc.)
+static const unsigned c51_span = 22;		// Read n and the address, loop
+static const unsigned c51_byte = 13;		// EXTAUTODAT2 = EXTAUTODAT1, DJNZ
+static const unsigned c51_end = 9;		// Read the 0 ending the table
+static const double c51_mhz = 12.0;		// Cycles per us at CPUCLK 48 MHz
+
+//////////////////////////////////////////////////////////////////////
+// The XDATA bytes that GpifInit() loads for a source: the register
+// writes of -I -o regs, with all 128 bytes of waveform memory (the
+// slots without a section are zeroed, as WaveData[] has them) and
+// the flow registers, at 0 when no section has a flow state.
+//////////////////////////////////////////////////////////////////////
+
+static bool
+xdata_image(std::string_view src,std::map<unsigned,uint8_t>& image,std::vector<s_diagnostic>& errors) {
+	std::ostringstream out, lst;
+	s_options opts;
+
+	opts.format = OutFormat::Regs;
+	opts.init = true;
+
+	const size_t nerrors = errors.size();
+
+	if ( !assemble(src,out,lst,opts,errors) || errors.size() != nerrors )
+		return false;
+
+	const std::string writes = out.str();
+
+	for ( unsigned ax=0; ax < 128; ++ax )
+		image[waveform_addr + ax] = 0x00;
+	for ( size_t wx=0; wx + 3 <= writes.size(); wx += 3 ) {
+		const unsigned addr = uint8_t(writes[wx]) << 8 | uint8_t(writes[wx+1]);
+
+		if ( addr != gpifabort_addr )
+			image[addr] = uint8_t(writes[wx+2]);
+	}
+	for ( unsigned fx=0; fx < flownames.size(); ++fx )
+		image.emplace(flowstate_addr + fx,0x00);
+	return true;
+}
+
+static bool
+is_flgsel(unsigned addr) {
+	for ( unsigned ep=2; ep <= 8; ep += 2 )
+		if ( epxgpifflgsel_addr(ep) == addr )
+			return true;
+	return false;
+}
+
+// The register name, or Wave n row $s, of an XDATA address
+static std::string
+xdata_name(unsigned addr) {
+	static const char *rows[] = { "LenBr", "Opcode", "Output", "LFun" };
+
+	if ( addr >= waveform_addr && addr < waveform_addr + 128 ) {
+		const unsigned ox = addr - waveform_addr;
+
+		return "Wave " + std::to_string(ox / 32) + ' ' + rows[ox / 8 % 4] + " $" + std::to_string(ox % 8);
+	}
+	for ( unsigned rx=0; rx < initaddrs.size(); ++rx )
+		if ( initaddrs[rx] == addr )
+			return initnames[rx];
+	if ( addr >= flowstate_addr && addr < flowstate_addr + flownames.size() )
+		return flownames[addr - flowstate_addr];
+	if ( is_flgsel(addr) )
+		return "EP" + std::to_string((addr - epxgpifflgsel_addr(2)) / 4 + 2) + "GPIFFLGSEL";
+	return "XDATA";
+}
+
+//////////////////////////////////////////////////////////////////////
+// Work out the reload patch from the loaded set to the source. A
+// register that only the loaded set writes goes back to its reset
+// value of 0. The bytes that differ are gathered into spans of
+// contiguous addresses, and two spans are joined when the unchanged
+// bytes between them cost fewer cycles to copy than a span. IFCONFIG
+// is written before the spans, and the EPnGPIFFLGSEL after them,
+// each on its own.
+//////////////////////////////////////////////////////////////////////
+
+struct s_span {
+	unsigned	addr;
+	std::vector<uint8_t> bytes;
+};
+
+s_reload
+reload_patch(std::string_view loaded,std::string_view src,OutFormat format) {
+	s_reload result;
+	std::array<std::map<unsigned,uint8_t>,2> images;
+	std::vector<std::pair<unsigned,uint8_t>> before, after;	// Direct writes
+	std::vector<s_span> spans;
+	std::ostringstream out, rpt;
+	char buf[32];
+
+	if ( format != OutFormat::C && format != OutFormat::Regs ) {
+		result.diagnostics.push_back("A reload is emitted as -o c or -o regs");
+		return result;
+	}
+	for ( unsigned ix=0; ix < 2; ++ix ) {
+		std::vector<s_diagnostic> errors;
+
+		if ( !xdata_image(ix ? src : loaded,images[ix],errors) ) {
+			for ( auto& diag : errors ) {
+				diag.message = std::string(ix ? "New set: " : "Loaded set: ") + diag.message;
+				result.diagnostics.push_back(diag);
+			}
+			return result;
+		}
+	}
+
+	// GpifInit(): IFCONFIG, GPIFABORT, the other 6 registers, the
+	// 128-byte copy, the flow registers when there is a flow state,
+	// then the flags and GPIFADRH/L after a SYNCDELAY
+	const std::map<unsigned,uint8_t>& was = images[0], & now = images[1];
+	const unsigned nflow = now.at(flowstate_addr) ? flownames.size() : 0;
+	unsigned nflgsel = 0;
+	std::string regs;
+
+	for ( auto& pair : now )
+		if ( is_flgsel(pair.first) )
+			++nflgsel;
+	result.initcycles = (8 + nflow) * c51_xwrite + 5 * c51_sfr + 2 + 128 * c51_byte
+		+ (nflgsel + 2) * (c51_syncdelay + c51_xwrite);
+
+	for ( auto& pair : was )
+		images[1].emplace(pair.first,0x00);
+
+	for ( auto& pair : now ) {
+		auto it = was.find(pair.first);
+
+		if ( it != was.end() && it->second == pair.second )
+			continue;
+		++result.changed;
+		if ( pair.first >= waveform_addr + 128 )
+			regs += (regs.empty() ? "" : ", ") + xdata_name(pair.first);
+
+		if ( pair.first == initaddrs[IfConfig] ) {
+			before.push_back(pair);
+		} else if ( is_flgsel(pair.first) ) {
+			after.push_back(pair);
+		} else if ( !spans.empty() && pair.first == spans.back().addr + spans.back().bytes.size() ) {
+			spans.back().bytes.push_back(pair.second);
+		} else	{
+			// Join the last span when the bytes between are known and cheap
+			bool join = !spans.empty();
+			const unsigned from = join ? spans.back().addr + spans.back().bytes.size() : 0;
+
+			if ( join && (pair.first - from) * c51_byte >= c51_span )
+				join = false;
+			for ( unsigned ax=from; join && ax < pair.first; ++ax ) {
+				auto iw = was.find(ax), in = now.find(ax);
+
+				join = iw != was.end() && in != now.end() && iw->second == in->second;
+			}
+			if ( join ) {
+				for ( unsigned ax=from; ax < pair.first; ++ax )
+					spans.back().bytes.push_back(now.at(ax));
+				spans.back().bytes.push_back(pair.second);
+			} else	spans.push_back(s_span{pair.first,{pair.second}});
+		}
+	}
+
+	unsigned tablebytes = 1;
+
+	result.spans = spans.size();
+	result.cycles = c51_xwrite + before.size() * c51_xwrite + 3 * c51_sfr + c51_end
+		+ after.size() * (c51_syncdelay + c51_xwrite);
+	for ( auto& span : spans ) {
+		result.cycles += c51_span + span.bytes.size() * c51_byte;
+		tablebytes += 3 + span.bytes.size();
+	}
+
+	rpt << std::fixed << std::setprecision(3)
+		<< "; Reload: " << result.changed << " bytes differ, " << spans.size() << " spans, "
+		<< tablebytes << " table bytes\n";
+	if ( !regs.empty() )
+		rpt << "; Registers: " << regs << '\n';
+	rpt << "; Estimated " << result.cycles << " 8051 cycles (" << result.cycles / c51_mhz
+		<< " us at 48 MHz), against " << result.initcycles << " for GpifInit() ("
+		<< result.initcycles / c51_mhz << " us)\n";
+
+	auto hex = [&](unsigned value,unsigned digits) -> const char * {
+		snprintf(buf,sizeof buf,"0x%0*X",digits,value);
+		return buf;
+	};
+
+	if ( format == OutFormat::Regs ) {
+		emit_regwrite(out,gpifabort_addr,0xFF);
+		for ( auto& pair : before )
+			emit_regwrite(out,pair.first,pair.second);
+		for ( auto& span : spans )
+			emit_regwrites(out,span.addr,span.bytes);
+		for ( auto& pair : after )
+			emit_regwrite(out,pair.first,pair.second);
+	} else	{
+		out << "// Reload of the GPIF: " << result.changed << " bytes in " << spans.size()
+			<< " spans, about " << result.cycles << " 8051 cycles\n"
+			<< "const char xdata GpifPatch[" << tablebytes << "] =\n{\n";
+		for ( auto& span : spans ) {
+			out << "/* " << xdata_name(span.addr) << " */ " << hex(span.bytes.size(),2) << ',';
+			out << ' ' << hex(span.addr >> 8,2) << ',';
+			out << ' ' << hex(span.addr & 0xFF,2) << ',';
+			for ( auto byte : span.bytes )
+				out << ' ' << hex(byte,2) << ',';
+			out << '\n';
+		}
+		out << "/* End */ 0x00\n};\n\n";
+
+		out << "void\nGpifReload(void) {\n"
+			<< "\tBYTE n;\n\n"
+			<< "\tGPIFABORT = 0xFF;\t\t// Stop the GPIF while it changes\n";
+		for ( auto& pair : before )
+			out << '\t' << xdata_name(pair.first) << " = " << hex(pair.second,2) << ";\n";
+		out << "\n\tAUTOPTRSETUP = 0x07;\t\t// Increment both autopointers\n"
+			<< "\tAUTOPTRH1 = MSB(&GpifPatch);\n"
+			<< "\tAUTOPTRL1 = LSB(&GpifPatch);\n"
+			<< "\twhile ( (n = EXTAUTODAT1) != 0 ) {\n"
+			<< "\t\tAUTOPTRH2 = EXTAUTODAT1;\n"
+			<< "\t\tAUTOPTRL2 = EXTAUTODAT1;\n"
+			<< "\t\tdo\t{\n"
+			<< "\t\t\tEXTAUTODAT2 = EXTAUTODAT1;\n"
+			<< "\t\t} while ( --n );\n"
+			<< "\t}\n";
+		for ( auto& pair : after )
+			out << "\tSYNCDELAY;\n"
+				<< '\t' << xdata_name(pair.first) << " = " << hex(pair.second,2) << ";\n";
+		out << "}\n\n";
+	}
+
+	result.output = out.str();
+	result.report = rpt.str();
+	result.ok = true;
+	return result;
+}
+
+//////////////////////////////////////////////////////////////////////
+// libezusbcc API
+//////////////////////////////////////////////////////////////////////
+
+std::string
+s_diagnostic::text() const {
+	if ( !line )
+		return message;
+	return "line " + std::to_string(line) + ": " + message;
+}
+
+bool
+Assembler::assemble(std::string_view src,std::ostream& out,std::ostream& lst,std::vector<s_diagnostic>& diags) const {
+	const size_t ndiags = diags.size();
+
+	return ezusbcc::assemble(src,out,lst,opts,diags) && diags.size() == ndiags;
+}
+
+s_assembly
+Assembler::assemble(std::string_view src) const {
+	std::ostringstream out, lst;
+	s_assembly result;
+
+	result.ok = ezusbcc::assemble(src,out,lst,opts,result.diagnostics,&result) && result.diagnostics.empty();
+	result.output = out.str();
+	result.listing = lst.str();
+	if ( !result.ok ) {
+		result.image.clear();
+		result.address = 0;
+	}
+	return result;
+}
+
+s_decompilation
+Decompiler::decompile(std::string_view gpif_c) const {
+	std::istringstream istr{std::string(gpif_c)};
+	std::ostringstream out;
+	s_decompilation result;
+
+	result.ok = ezusbcc::decompile(istr,"gpif.c",out,result.diagnostics,opts.analyze,
+		opts.sim.replaypath ? &opts.sim : nullptr,opts.stats);
+	result.text = out.str();
+	return result;
+}
+
+s_decompilation
+Decompiler::decompile(const uint8_t *wavedata,size_t size,const uint8_t *flowstates,size_t flowsize) const {
+	std::ostringstream out;
+	s_decompilation result;
+	s_simopts simopts(opts.sim);
+
+	if ( simopts.ifclk == 0.0 )
+		simopts.ifclk = 48.0;
+	result.ok = ezusbcc::decompile(std::vector<uint8_t>(wavedata,wavedata+size),
+		std::vector<uint8_t>(flowstates,flowstates+flowsize),out,result.diagnostics,opts.analyze,0xE4,
+		simopts.replaypath ? &simopts : nullptr,opts.stats);
+	result.text = out.str();
+	return result;
+}
+
+bool
+Decompiler::decompile_file(const char *path,std::ostream& out,std::vector<s_diagnostic>& diags) const {
+	std::ifstream gpif_c(path);
+
+	if ( gpif_c.fail() ) {
+		diags.push_back(std::string(strerror(errno)) + ": Opening " + path + " for read");
+		return false;
+	}
+	return ezusbcc::decompile(gpif_c,path,out,diags,opts.analyze,opts.sim.replaypath ? &opts.sim : nullptr,opts.stats);
+}
+
+} // namespace ezusbcc
+
+// End libezusbcc.cpp
@@ -0,0 +1,183 @@
+//////////////////////////////////////////////////////////////////////
+// libezusbcc.hpp -- Internals of libezusbcc shared with its tools
+///////////////////////////////////////////////////////////////////////
+//
+// The parsed state, the name tables and the encoder and decompiler
+// steps of libezusbcc.cpp, for ezverify and ezbench, which link
+// against libezusbcc.a. Programs using the library include
+// ezusbcc.hpp instead: nothing here is part of its API.
+
+#ifndef LIBEZUSBCC_HPP
+#define LIBEZUSBCC_HPP
+
+#include <iosfwd>
+#include <map>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "ezusbcc.hpp"
+#include "lexer.hpp"
+#include "gpiftab.hpp"
+
+namespace ezusbcc {
+
+using namespace gpiftab;
+
+enum class PseudoOps {
+	Trictl,			// TRICTL
+	GpifReadyCfg5,		// 
+	GpifReadyCfg7,		// 
+	EpxGpifFlgSel,		// PF, EF or FF
+	Ep,			// 2, 4, 6 or 8
+	WaveForm,		// x
+	IfClk,			// 30 or 48 MHz
+	WordWide,		// 16-bit data bus
+	Async,			// Asynchronous RDY sampling
+	IdleCtl,		// GPIFIDLECTL idle output levels
+	FlowState,		// Flow state number, 7 when none
+	FlowLogic,		// A OP B for FLOWLOGIC
+	FlowEq0Ctl,		// Outputs when FLOWLOGIC is 0
+	FlowEq1Ctl,		// Outputs when FLOWLOGIC is 1
+	FlowHoldOff,		// FLOWHOLDOFF
+	FlowStb,		// FLOWSTB
+	FlowStbEdge,		// FLOWSTBEDGE
+	FlowStbHPeriod,		// FLOWSTBHPERIOD
+	MinPulse,		// CTLn ns: minimum asserted width
+	Setup,			// CTLn ns: DATA before CTLn asserts
+	Hold,			// CTLn ns: DATA after CTLn releases
+	EpBuf,			// .EP buffers: 2, 3 or 4
+	AutoCommit,		// AUTOIN/AUTOOUT packet commit
+};
+
+typedef std::map<std::string,unsigned,std::less<>> t_namemap;
+
+extern const std::map<std::string,int,std::less<>> pseudotab;
+extern const std::map<std::string,int,std::less<>> flgsel;
+extern const std::map<unsigned,t_namemap> oetab;	// By .TRICTL
+extern const std::map<unsigned/*GpifReadyCfg5*/,
+	std::map<unsigned/*EPxGPIFFLGSEL*/,
+	std::map<unsigned/*GPIFREADYCFG.7*/,
+	t_namemap
+	>>> opertab;
+
+union u_opcode {
+	uint8_t			byte;
+	struct s_opcode {
+		uint8_t	dp : 1;		// 1 == DP
+		uint8_t	data : 1;	// 1 == Drive FIFO / Sample
+		uint8_t	next : 1;	// 1 == move next to FIFO, or use UDMACRCH:L
+		uint8_t	incad : 1;	// 1 == increment GPIFADR
+		uint8_t	gint : 1;	// 1 == generate a GPIFWF
+		uint8_t	sgl : 1;	// 1 == use SGLDATH:L / UDMACRCH:L
+		uint8_t	reserved : 2;	// Ignored
+	}			bits;
+};
+
+union u_logfunc {
+	enum class e_logfunc {
+		a_and_b = 0,
+		a_or_b = 1,
+		a_xor_b = 2,
+		na_and_b = 3
+	};
+	uint8_t			byte;
+	struct s_logfunc {
+		uint8_t	termb : 3;	// TERM B
+		uint8_t	terma : 3;	// TERM A
+		uint8_t	lfunc : 2;	// e_log_func
+	}			bits;
+};
+
+union u_branch {
+	uint8_t			byte;
+	struct s_branch {
+		uint8_t	branch0 : 3;
+		uint8_t	branch1 : 3;
+		uint8_t	reserved : 1;
+		uint8_t	reexecute : 1;
+	}			bits;
+};
+
+union u_output {
+	uint8_t			byte;
+	struct s_output1 {
+		uint8_t	ctl0 : 1;
+		uint8_t	ctl1 : 1;
+		uint8_t	ctl2 : 1;
+		uint8_t	ctl3 : 1;
+		uint8_t	oes0 : 1;
+		uint8_t	oes1 : 1;
+		uint8_t	oes2 : 1;
+		uint8_t	oes3 : 1;
+	}			bits1;
+	struct s_output0 {
+		uint8_t	ctl0 : 1;
+		uint8_t	ctl1 : 1;
+		uint8_t	ctl2 : 1;
+		uint8_t	ctl3 : 1;
+		uint8_t	ctl4 : 1;
+		uint8_t	ctl5 : 1;
+		uint8_t	reserved : 2;
+	}			bits0;
+};
+
+struct s_instr {
+	std::string_view	stropcode;	// Views into the source text
+	std::vector<std::string_view> stroperands;
+	std::string_view	strcomment;
+	std::string		error;
+	unsigned		line = 0;	// Source line and column
+	unsigned		column = 0;
+
+	u_branch		branch;
+	u_opcode		opcode;
+	u_logfunc		logfunc;
+	u_output		output;
+
+	void clear() {
+		stropcode = std::string_view();
+		stroperands.clear();
+		strcomment = std::string_view();
+		opcode.byte = 0;
+		logfunc.byte = 0;
+		branch.byte = 0;
+		output.byte = 0;
+	};
+};
+
+//////////////////////////////////////////////////////////////////////
+// Why a state word can't come back unchanged from the assembler, as
+// a mask of the State* reasons (0 when it can). The environment
+// decides which DP terms and outputs have names.
+//////////////////////////////////////////////////////////////////////
+
+inline uint8_t
+sw_reasons(uint32_t w,const s_stateenv& env) {
+	uint8_t why = 0;
+
+	if ( sw_opcode(w) & 0xC0 )
+		why |= StateReservedOpcode;
+	if ( sw_dp(w) ) {
+		if ( sw_branch(w) & 0x40 )
+			why |= StateReservedBranch;
+		if ( !env.gpifreadycfg7 && (sw_terma(w) == 7 || sw_termb(w) == 7) )
+			why |= StateNoTerm;
+	} else if ( sw_logfunc(w) ) {
+		why |= StateNdpLogfunc;
+	}
+	if ( !env.trictl && (sw_output(w) & 0xC0) )
+		why |= StateNoOutput;
+	return why;
+}
+
+bool parse(Lexer& lex,s_instr& instr);
+void encode(std::vector<s_instr>& instrs,const std::map<unsigned,unsigned>& environ);
+void state_text(uint32_t w,bool trictl,const t_namemap *opermap,std::string& opc,std::string& oper);
+bool decompile(unsigned waveformx,uint8_t data[32],std::ostream& out);
+
+} // namespace ezusbcc
+
+#endif // LIBEZUSBCC_HPP
+
+// End libezusbcc.hpp
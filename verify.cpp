@@ -0,0 +1,287 @@
+//////////////////////////////////////////////////////////////////////
+// verify.cpp -- Exhaustive round trip check of the state encoding
+///////////////////////////////////////////////////////////////////////
+//
+// For each environment of opertab (.GPIFREADYCFG5, .EPXGPIFFLGSEL and
+// .GPIFREADYCFG7), under .TRICTL 0 and 1, checks over all 2^32 state
+// words that assemble(decompile(x)) == x exactly when classify_states()
+// finds no reason against it:
+//
+//	unions	The bitfield unions agree with the sw_ shifts and masks
+//		for every byte value
+//	fields	Each byte of a state, for every value, is decompiled to
+//		text and assembled back, giving a table per field
+//	words	Every state word is classified by classify_states() and
+//		checked against the field tables, on all threads
+//	samples	Random whole words go through the text, to check that
+//		the fields are independent, and through sw_reasons()
+//
+// Exits with 1 when any environment disagrees:
+//
+//	$ ./ezverify [-t threads] [-s stride] [-r samples]
+//
+// A stride of n checks every nth word only (an odd stride still
+// reaches every value of each byte).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <chrono>
+#include <random>
+
+#include "libezusbcc.hpp"
+
+using namespace ezusbcc;
+
+//////////////////////////////////////////////////////////////////////
+// The bitfields of the unions against the shifts and masks
+//////////////////////////////////////////////////////////////////////
+
+static bool
+check_unions() {
+	for ( unsigned v=0; v < 256; ++v ) {
+		u_branch br;
+		u_opcode op;
+		u_logfunc lf;
+		const uint32_t wb = sw_pack(v,0,0,0), wl = sw_pack(0,0,v,0);
+
+		br.byte = op.byte = lf.byte = v;
+
+		if ( br.bits.branch0 != sw_branch0(wb) || br.bits.branch1 != sw_branch1(wb)
+		  || br.bits.reexecute != sw_reexecute(wb)
+		  || sw_encode_branch(br.bits.branch0,br.bits.branch1,br.bits.reexecute) != (v & 0xBF) )
+			return false;
+		if ( sw_encode_opcode(op.bits.dp,op.bits.data,op.bits.next,op.bits.incad,
+		  op.bits.gint,op.bits.sgl) != (v & 0x3F) )
+			return false;
+		if ( lf.bits.terma != sw_terma(wl) || lf.bits.termb != sw_termb(wl) || lf.bits.lfunc != sw_lfunc(wl)
+		  || sw_encode_logfunc(lf.bits.terma,lf.bits.lfunc,lf.bits.termb) != v )
+			return false;
+	}
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Decompile one state word to text under env and assemble it back
+//////////////////////////////////////////////////////////////////////
+
+static bool
+roundtrip(uint32_t w,const s_stateenv& env,const t_namemap& opermap) {
+	const std::map<unsigned,unsigned> environ = {
+		{ unsigned(PseudoOps::Trictl),		env.trictl },
+		{ unsigned(PseudoOps::GpifReadyCfg5),	env.gpifreadycfg5 },
+		{ unsigned(PseudoOps::GpifReadyCfg7),	env.gpifreadycfg7 },
+		{ unsigned(PseudoOps::EpxGpifFlgSel),	env.epxgpifflgsel },
+	};
+	std::string opc, oper;
+
+	state_text(w,env.trictl,&opermap,opc,oper);
+
+	const std::string src = opc + '\t' + oper + '\n';
+	Lexer lex(src);
+	s_instr instr;
+
+	if ( !parse(lex,instr) )
+		return false;
+
+	// Seven states, so that any $n target is in range
+	std::vector<s_instr> instrs(7,instr);
+
+	encode(instrs,environ);
+
+	const s_instr& st = instrs[0];
+
+	return st.error.empty()
+		&& sw_pack(st.branch.byte,st.opcode.byte,st.logfunc.byte,st.output.byte) == w;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Whether each value of each byte round trips, with the other bytes
+// those of a plain NDP or DP state
+//////////////////////////////////////////////////////////////////////
+
+struct s_fields {
+	std::array<bool,256> opcode;
+	std::array<std::array<bool,256>,2> branch, logfunc, output;	// [dp]
+
+	bool ok(uint32_t w) const {
+		const unsigned dp = sw_dp(w);
+
+		return opcode[sw_opcode(w)] && branch[dp][sw_branch(w)]
+			&& logfunc[dp][sw_logfunc(w)] && output[dp][sw_output(w)];
+	}
+};
+
+static void
+field_tables(const s_stateenv& env,const t_namemap& opermap,s_fields& f) {
+	const std::array<uint32_t,2> base = { {
+		sw_pack(1,0,0,0),		// Z 1
+		sw_pack(0x3F,SwDp,0,0),		// J RDY0 AND RDY0 $7 $7
+	} };
+
+	for ( unsigned v=0; v < 256; ++v ) {
+		f.opcode[v] = roundtrip((base[v & SwDp] & 0xFF00FFFF) | v << 16,env,opermap);
+		for ( unsigned dp=0; dp < 2; ++dp ) {
+			f.branch[dp][v] = roundtrip((base[dp] & 0x00FFFFFF) | v << 24,env,opermap);
+			f.logfunc[dp][v] = roundtrip((base[dp] & 0xFFFF00FF) | v << 8,env,opermap);
+			f.output[dp][v] = roundtrip((base[dp] & 0xFFFFFF00) | v,env,opermap);
+		}
+	}
+}
+
+struct s_result {
+	unsigned long	words = 0;
+	unsigned long	canonical = 0;	// Round trip
+	unsigned long	mismatches = 0;
+	uint32_t	first = 0;	// First mismatch
+};
+
+//////////////////////////////////////////////////////////////////////
+// Check every stride'th state word on nthreads threads
+//////////////////////////////////////////////////////////////////////
+
+static s_result
+check_words(const s_stateenv& env,const s_fields& fields,unsigned long stride,unsigned nthreads) {
+	static const unsigned long chunk = 1ul << 16;
+	const unsigned long nwords = ((1ul << 32) + stride - 1) / stride;
+	std::atomic<unsigned long> next(0);
+	std::vector<s_result> results(nthreads);
+	std::vector<std::thread> threads;
+
+	auto worker = [&](s_result& r) {
+		std::vector<uint32_t> words(chunk);
+		std::vector<uint8_t> reasons(chunk);
+		unsigned long kx;
+
+		while ( (kx = next.fetch_add(chunk)) < nwords ) {
+			const size_t n = std::min(chunk,nwords - kx);
+
+			for ( size_t ux=0; ux < n; ++ux )
+				words[ux] = uint32_t((kx + ux) * stride);
+			classify_states(words.data(),n,env,reasons.data());
+
+			for ( size_t ux=0; ux < n; ++ux ) {
+				const uint32_t w = words[ux];
+				const bool ok = reasons[ux] == 0;
+
+				if ( ok != fields.ok(w) ) {
+					if ( !r.mismatches++ )
+						r.first = w;
+				}
+				r.canonical += ok;
+			}
+			r.words += n;
+		}
+	};
+
+	for ( unsigned tx=0; tx < nthreads; ++tx )
+		threads.emplace_back(worker,std::ref(results[tx]));
+	for ( auto& t : threads )
+		t.join();
+
+	s_result total;
+
+	for ( auto& r : results ) {
+		if ( r.mismatches && !total.mismatches )
+			total.first = r.first;
+		total.words += r.words;
+		total.canonical += r.canonical;
+		total.mismatches += r.mismatches;
+	}
+	return total;
+}
+
+int
+main(int argc,char **argv) {
+	static const char *flags[] = { "PF", "EF", "FF" };
+	unsigned nthreads = std::thread::hardware_concurrency();
+	unsigned long stride = 1, samples = 100000;
+	bool failed = false;
+	int optch;
+
+	while ( (optch = getopt(argc,argv,"t:s:r:")) != -1 ) {
+		unsigned long value = strtoul(optarg,nullptr,10);
+
+		switch ( optch ) {
+		case 't':
+			nthreads = value;
+			break;
+		case 's':
+			stride = value;
+			break;
+		case 'r':
+			samples = value;
+			break;
+		default:
+			std::cerr << "Usage: " << argv[0] << " [-t threads] [-s stride] [-r samples]\n";
+			return 1;
+		}
+	}
+	if ( nthreads == 0 )
+		nthreads = 1;
+	if ( stride == 0 )
+		stride = 1;
+
+	if ( !check_unions() ) {
+		std::cerr << "*** The bitfield unions do not match the state word shifts and masks\n";
+		return 1;
+	}
+	printf("unions: bitfields match the shifts and masks\n");
+
+	std::mt19937 rng(1);
+
+	for ( unsigned trictl=0; trictl < 2; ++trictl ) {
+		for ( auto& p5 : opertab ) {
+			for ( auto& pf : p5.second ) {
+				for ( auto& p7 : pf.second ) {
+					s_stateenv env;
+					s_fields fields;
+
+					env.trictl = trictl;
+					env.gpifreadycfg5 = p5.first;
+					env.epxgpifflgsel = pf.first;
+					env.gpifreadycfg7 = p7.first;
+
+					const t_namemap& opermap = p7.second;
+					auto t0 = std::chrono::steady_clock::now();
+
+					field_tables(env,opermap,fields);
+
+					s_result r = check_words(env,fields,stride,nthreads);
+					std::chrono::duration<double> secs = std::chrono::steady_clock::now() - t0;
+					unsigned long bad = 0;
+
+					for ( unsigned long sx=0; sx < samples; ++sx ) {
+						uint32_t w = rng();
+
+						uint8_t why;
+
+						classify_states(&w,1,env,&why);
+						if ( (roundtrip(w,env,opermap) != (why == 0) || why != sw_reasons(w,env))
+						  && !bad++ && !r.mismatches )
+							r.first = w;
+					}
+
+					printf(".TRICTL %u .GPIFREADYCFG5 %u .EPXGPIFFLGSEL %s .GPIFREADYCFG7 %u: "
+						"%lu words, %lu round trip, %lu mismatches, %lu/%lu samples bad, %.2f s (%.0f Mwords/s)\n",
+						trictl,env.gpifreadycfg5,flags[env.epxgpifflgsel],env.gpifreadycfg7,
+						r.words,r.canonical,r.mismatches,bad,samples,secs.count(),
+						r.words / secs.count() / 1e6);
+					fflush(stdout);
+
+					if ( r.mismatches || bad ) {
+						printf("*** First mismatch: %08X\n",unsigned(r.first));
+						failed = true;
+					}
+				}
+			}
+		}
+	}
+	return failed ? 1 : 0;
+}
+
+// End verify.cpp